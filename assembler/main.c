@@ -82,7 +82,7 @@ int main (int argc, char* argv[])
     //buffer_t BEGIN
     //^^^^^^^^^^^^^^^^^^^^^^^^^
     buffer_t buffer;
-    if (!buffer_t_construct_filename (&buffer, inName))
+    if (!buffer_t_construct_map (&buffer, inName))
     {
         perror ("#Input error");
         return WRONG_RESULT;
@@ -343,7 +343,7 @@ unsigned assemble(const buffer_t* source, buffer_t* assembled, label_t* labels,
 
                     return writing_pos;
                 }
-                #define CMD(name, key, shift, arguments) \
+                #define CMD(name, key, shift, arguments, pops, pushes) \
                 if (!(arguments & ARG_OVL)) \
                 {\
                     if ((state == CMD) && (!strcmp (word, #name)))\
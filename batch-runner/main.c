@@ -0,0 +1,227 @@
+/// Author name
+#define AUTHOR "Alartum"
+/// Project name
+#define PROJECT "BatchRunner"
+/// Version
+#define VERSION "1.0"
+
+#include <stdio.h>
+#include "mylib.h"
+#include <string.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "cpu_t.h"
+#include "pool_t.h"
+
+/// Engines of cpu_t
+enum BATCH_ENGINE {ENGINE_RUN, ENGINE_CACHED, ENGINE_TIERED};
+
+/// Result of a single run
+typedef struct batch_result batch_result;
+struct batch_result
+{
+    bool is_ok; /**< true if the program has reached stop */
+    double time; /**< Time of the run in ms */
+    unsigned worker; /**< Worker that has run the job */
+};
+
+/// Jobs of the batch: the program is run once for every input
+typedef struct batch_t batch_t;
+struct batch_t
+{
+    const cpu_t* program; /**< cpu_t with the loaded program, its decoded code is shared by all the jobs */
+    const cpu_t_snapshot* snapshot; /**< State every job starts from, NULL to start from the beginning */
+    char** inputs; /**< Input file of every job */
+    const char* output_dir; /**< Directory for the outputs, NULL to write them next to the inputs */
+    batch_result* results;
+    unsigned memory_size;
+    unsigned stack_size;
+    bool is_binary;
+    char engine;
+};
+
+/**
+*@brief Makes the name of the output: 'input.out' in the output directory or next to the input.
+*@return true if the name fits PATH_MAX, false otherwise.
+*/
+bool get_output_name (const batch_t* batch, const char input[], char output[])
+{
+    int length = 0;
+    if (batch->output_dir){
+        const char* name = strrchr (input, '/');
+        name = (name)? name + 1 : input;
+        length = snprintf (output, PATH_MAX, "%s/%s.out", batch->output_dir, name);
+    }
+    else
+        length = snprintf (output, PATH_MAX, "%s.out", input);
+    return length > 0 && length < PATH_MAX;
+}
+
+double get_time ()
+{
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return now.tv_sec*1000.0 + now.tv_nsec/1000000.0;
+}
+
+/**
+*@brief Runs the program on the input of the job in its own cpu_t.
+*/
+void run_job (void* context, size_t job, unsigned worker)
+{
+    batch_t* batch = (batch_t*)context;
+    batch_result* result = batch->results + job;
+    double begin = get_time ();
+    result->is_ok = false;
+    result->worker = worker;
+
+    char output_name[PATH_MAX];
+    int in_fd = open (batch->inputs[job], O_RDONLY);
+    int out_fd = -1;
+    if (in_fd >= 0 && get_output_name (batch, batch->inputs[job], output_name))
+        out_fd = open (output_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (in_fd < 0 || out_fd < 0){
+        perror (batch->inputs[job]);
+        if (in_fd >= 0)
+            close (in_fd);
+        return;
+    }
+
+    cpu_t cpu;
+    if (cpu_t_construct_size (&cpu, batch->memory_size, batch->stack_size)){
+        if (cpu_t_load_shared (&cpu, batch->program) && (!batch->snapshot || cpu_t_restore (&cpu, batch->snapshot)) &&
+            cpu_t_set_io (&cpu, in_fd, out_fd, batch->is_binary)){
+            switch (batch->engine)
+            {
+            case ENGINE_CACHED:
+                result->is_ok = cpu_t_run_cached (&cpu);
+                break;
+            case ENGINE_TIERED:
+                result->is_ok = cpu_t_run_tiered (&cpu);
+                break;
+            default:
+                result->is_ok = cpu_t_run (&cpu);
+            }
+            result->is_ok = result->is_ok && cpu.is_halted;
+        }
+        cpu_t_destruct (&cpu);
+    }
+    close (in_fd);
+    close (out_fd);
+    result->time = get_time () - begin;
+}
+
+int main (int argc, char* argv[])
+{
+    CHECK_DEFAULT_ARGS();
+    if (argc < 3){
+        WRITE_WRONG_USE();
+    }
+    batch_t batch = {};
+    batch.memory_size = MEM_SIZE;
+    batch.stack_size = STACK_SIZE;
+    batch.engine = ENGINE_RUN;
+    batch.inputs = (char**)calloc (argc, sizeof(char*));
+    unsigned threads = 0;
+    size_t njobs = 0;
+    bool do_fuse = false;
+    bool is_verbose = false;
+    const char* restore_name = NULL;
+    for (int i = 2; i < argc; i++){
+        if (!strcmp ("--fuse", argv[i]))
+            do_fuse = true;
+        else if (!strcmp ("--cache", argv[i]))
+            batch.engine = ENGINE_CACHED;
+        else if (!strcmp ("--jit", argv[i]))
+            batch.engine = ENGINE_TIERED;
+        else if (!strcmp ("--binary", argv[i]))
+            batch.is_binary = true;
+        else if (!strcmp ("--verbose", argv[i]))
+            is_verbose = true;
+        else if (!strcmp ("--threads", argv[i]) && i + 1 < argc && read_size (argv[i + 1], &threads))
+            i++;
+        else if (!strcmp ("--output", argv[i]) && i + 1 < argc)
+            batch.output_dir = argv[++i];
+        else if (!strcmp ("--restore", argv[i]) && i + 1 < argc)
+            restore_name = argv[++i];
+        else if (!strcmp ("--memory", argv[i]) && i + 1 < argc && read_size (argv[i + 1], &batch.memory_size))
+            i++;
+        else if (!strcmp ("--stack", argv[i]) && i + 1 < argc && read_size (argv[i + 1], &batch.stack_size))
+            i++;
+        else if (!strncmp ("--", argv[i], 2)){
+            WRITE_WRONG_USE();
+        }
+        else
+            batch.inputs[njobs++] = argv[i];
+    }
+    if (!njobs){
+        WRITE_WRONG_USE();
+    }
+    batch.results = (batch_result*)calloc (njobs, sizeof(batch_result));
+
+    // The report goes to the standard output, the messages of the processors are hidden
+    FILE* report = fdopen (dup (STDOUT_FILENO), "w");
+    int messages = open ((is_verbose)? "/dev/stderr" : "/dev/null", O_WRONLY);
+    if (!report || !batch.inputs || !batch.results || messages < 0){
+        perror ("BatchRunner");
+        return WRONG_RESULT;
+    }
+    fflush (stdout);
+    dup2 (messages, STDOUT_FILENO);
+    close (messages);
+
+    // The program is loaded and decoded once
+    buffer_t binary;
+    cpu_t program;
+    if (!buffer_t_construct_map (&binary, argv[1]))
+        return WRONG_RESULT;
+    if (!cpu_t_construct_size (&program, batch.memory_size, batch.stack_size) || !cpu_t_load_program (&program, &binary)){
+        fprintf (report, "#Can't load %s\n", argv[1]);
+        return WRONG_RESULT;
+    }
+    if (do_fuse)
+        cpu_t_fuse (&program, false);
+    // The runs map the program copy-on-write instead of copying it
+    cpu_t_share_program (&program);
+    batch.program = &program;
+    // The runs map the saved memory copy-on-write as well
+    cpu_t_snapshot snapshot;
+    if (restore_name){
+        if (!cpu_t_snapshot_construct_filename (&snapshot, restore_name)){
+            fprintf (report, "#Can't load %s\n", restore_name);
+            return WRONG_RESULT;
+        }
+        batch.snapshot = &snapshot;
+    }
+
+    pool_t pool;
+    if (!pool_t_construct (&pool, threads))
+        return WRONG_RESULT;
+    double begin = get_time ();
+    pool_t_run (&pool, njobs, run_job, &batch);
+    double time_spent = get_time () - begin;
+
+    size_t failed = 0;
+    double busy = 0;
+    for (size_t i = 0; i < njobs; i++){
+        fprintf (report, "%-40s %-6s %10.3lfms  [worker %u]\n", batch.inputs[i],
+                 (batch.results[i].is_ok)? "ok" : "FAILED", batch.results[i].time, batch.results[i].worker);
+        failed += !batch.results[i].is_ok;
+        busy += batch.results[i].time;
+    }
+    fprintf (report, "#Jobs: %lu, failed: %lu, workers: %u, stolen: %lu\n", njobs, failed, pool.size, pool_t_stolen (&pool));
+    fprintf (report, "#Total: %lfms, jobs: %lfms (x%.2lf)\n", time_spent, busy, (time_spent > 0)? busy / time_spent : 0);
+    fclose (report);
+
+    pool_t_destruct (&pool);
+    if (batch.snapshot)
+        cpu_t_snapshot_destruct (&snapshot);
+    cpu_t_destruct (&program);
+    buffer_t_destruct (&binary);
+    free (batch.inputs);
+    free (batch.results);
+    return (failed)? WRONG_RESULT : NO_ERROR;
+}
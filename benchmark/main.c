@@ -0,0 +1,497 @@
+/// Author name
+#define AUTHOR "Alartum"
+/// Project name
+#define PROJECT "Benchmark"
+/// Version
+#define VERSION "1.0"
+
+#include <stdio.h>
+#include "mylib.h"
+#include <string.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+// The stack_t of signal.h is hidden, cpu_t has its own one
+#define stack_t signal_stack_t
+#include <sys/wait.h>
+#undef stack_t
+#include <sys/resource.h>
+#include "cpu_t.h"
+#include "profile_t.h"
+
+/// Ways to run the workload, the rows of the report go in this order
+enum BENCH_ENGINE {ENGINE_ASSEMBLER, ENGINE_RUN, ENGINE_CACHED, ENGINE_TIERED, ENGINE_TRANSLATOR, ENGINE_NUMBER};
+/// Names of the engines in the report
+const char* ENGINE_NAMES[ENGINE_NUMBER] = {"assembler", "run", "cached", "jit", "translator"};
+/// Longest allowed number of trials
+#define BENCH_MAX_TRIALS 1000
+/// Name of the source generated for the assembler
+#define BENCH_GENERATED "generated"
+
+/// Result of the trials of a single engine, it is passed from the child process through the pipe
+typedef struct bench_result bench_result;
+struct bench_result
+{
+    bool is_ok; /**< true if every run has succeeded */
+    uint64_t instructions; /**< Number of the executed instructions, 0 if they aren't counted */
+    double time; /**< Median time of the trials in ms */
+    double min_time; /**< Fastest trial in ms */
+    double bytes; /**< Bytes processed by a trial: the source by the assembler, the program by the translator */
+    double bytes_time; /**< Median time of processing the bytes in ms */
+    long rss; /**< Peak resident set size in KB */
+};
+
+/// Settings of the suite
+typedef struct bench_t bench_t;
+struct bench_t
+{
+    const char* assembler; /**< Assembler to run */
+    char dir[PATH_MAX]; /**< Temporary directory for the assembled programs */
+    unsigned trials;
+    unsigned warmup;
+    bool is_optimized; /**< If the translator runs the passes over its IR */
+    bool is_peephole; /**< If the translator runs its peephole pass */
+    FILE* report;
+    FILE* baseline; /**< Report of the previous build to compare with, NULL if none */
+};
+
+double get_time ()
+{
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return now.tv_sec*1000.0 + now.tv_nsec/1000000.0;
+}
+
+int compare_times (const void* first, const void* second)
+{
+    double difference = *(const double*)first - *(const double*)second;
+    return (difference > 0) - (difference < 0);
+}
+
+/**
+*@brief Sorts the times and takes the median.
+*/
+double get_median (double times[], unsigned ntimes)
+{
+    qsort (times, ntimes, sizeof(double), compare_times);
+    return (ntimes % 2)? times[ntimes/2] : (times[ntimes/2 - 1] + times[ntimes/2])/2;
+}
+
+/**
+*@brief Gets the name of the workload: the name of its source without the directory and the extension.
+*/
+void get_workload_name (const char source[], char name[])
+{
+    const char* begin = strrchr (source, '/');
+    begin = (begin)? begin + 1 : source;
+    strncpy (name, begin, NAME_MAX - 1);
+    name[NAME_MAX - 1] = '\0';
+    char* dot = strrchr (name, '.');
+    if (dot && dot != name)
+        *dot = '\0';
+}
+
+/**
+*@brief Writes the source for the assembler: blocks of instructions of every kind with a label each.
+*@return true if success, false otherwise.
+*/
+bool write_source (const char filename[], unsigned nblocks)
+{
+    FILE* f = fopen (filename, "w");
+    if (!f){
+        perror (filename);
+        return false;
+    }
+    fprintf (f, ".data\n    value: dword 0\n    half: word raw\n    low: byte raw\n.code\n");
+    for (unsigned i = 0; i < nblocks; i++)
+        fprintf (f, "BLOCK_%u:\n"
+                    "    push %u\n    push dword [value]\n    add\n    pop dword [value]\n"
+                    "    push word [half]\n    pop word [half]\n    push byte [low]\n    pop byte [low]\n"
+                    "    push %u.5\n    push ebx\n    fmul\n    pop ebx\n"
+                    "    push %u\n    push eax\n    cmp\n    ja BLOCK_%u\n",
+                    i, i, i % 100, i, (i + 1) % nblocks);
+    fprintf (f, "    stop\n");
+    if (fclose (f)){
+        perror (filename);
+        return false;
+    }
+    return true;
+}
+
+/**
+*@brief Runs the assembler on the source, the messages of the assembler are hidden.
+*@return true if the assembler has succeeded, false otherwise.
+*/
+bool run_assembler (const bench_t* bench, const char source[], const char binary[])
+{
+    pid_t pid = fork ();
+    if (pid < 0){
+        perror ("Benchmark");
+        return false;
+    }
+    if (!pid){
+        execl (bench->assembler, bench->assembler, source, binary, (char*)NULL);
+        perror (bench->assembler);
+        _exit (WRONG_RESULT);
+    }
+    int status = 0;
+    while (waitpid (pid, &status, 0) < 0)
+        if (errno != EINTR)
+            return false;
+    return WIFEXITED(status) && WEXITSTATUS(status) == NO_ERROR;
+}
+
+/**
+*@brief Counts the instructions executed by the program with the profiler.
+*@return Number of the instructions, 0 in case of error.
+*/
+uint64_t count_instructions (const buffer_t* binary)
+{
+    cpu_t cpu;
+    profile_t profile;
+    uint64_t instructions = 0;
+    if (!cpu_t_construct (&cpu))
+        return 0;
+    if (cpu_t_load_program (&cpu, binary) && profile_t_construct (&profile, &cpu)){
+        if (profile_t_run (&profile, &cpu) && cpu.is_halted)
+            instructions = profile.total;
+        profile_t_destruct (&profile);
+    }
+    cpu_t_destruct (&cpu);
+    return instructions;
+}
+
+/**
+*@brief Runs the program once with the engine of cpu_t.
+*@param time Where to add the time of the run in ms, loading isn't included.
+*@return true if the program has reached stop, false otherwise.
+*/
+bool run_cpu (const buffer_t* binary, char engine, double* time)
+{
+    cpu_t cpu;
+    if (!cpu_t_construct (&cpu))
+        return false;
+    bool is_ok = false;
+    int in_fd = open ("/dev/null", O_RDONLY);
+    int out_fd = open ("/dev/null", O_WRONLY);
+    if (cpu_t_load_program (&cpu, binary) && cpu_t_set_io (&cpu, in_fd, out_fd, false)){
+        double begin = get_time ();
+        switch (engine)
+        {
+        case ENGINE_CACHED:
+            is_ok = cpu_t_run_cached (&cpu);
+            break;
+        case ENGINE_TIERED:
+            is_ok = cpu_t_run_tiered (&cpu);
+            break;
+        default:
+            is_ok = cpu_t_run (&cpu);
+        }
+        *time = get_time () - begin;
+        is_ok = is_ok && cpu.is_halted;
+    }
+    cpu_t_destruct (&cpu);
+    close (in_fd);
+    close (out_fd);
+    return is_ok;
+}
+
+/**
+*@brief Translates the program to native code and executes it once.
+*@param translation Where to save the time of the translation in ms.
+*@param time Where to save the time of the execution in ms.
+*@param is_optimized If the passes over the IR run before the translation.
+*@param is_peephole If the pairs of the instructions are translated together.
+*/
+bool run_translator (const buffer_t* binary, double* translation, double* time, bool is_optimized, bool is_peephole)
+{
+    image_t image;
+    if (!image_t_construct (&image, binary))
+        return false;
+    image.is_optimized = is_optimized;
+    image.is_peephole = is_peephole;
+    double begin = get_time ();
+    bool is_ok = image_t_translate (&image);
+    *translation = get_time () - begin;
+    if (is_ok){
+        begin = get_time ();
+        image_t_execute (&image);
+        *time = get_time () - begin;
+    }
+    image_t_destruct (&image);
+    return is_ok;
+}
+
+/**
+*@brief Runs the warmup and the trials of the engine, it is done in the child process.
+*/
+void run_trials (const bench_t* bench, const char source[], const char binary_name[], char engine, bench_result* result)
+{
+    double times[BENCH_MAX_TRIALS] = {};
+    double bytes_times[BENCH_MAX_TRIALS] = {};
+    buffer_t binary = {};
+    result->is_ok = true;
+    if (engine == ENGINE_ASSEMBLER){
+        buffer_t text;
+        if (!buffer_t_construct_map (&text, source)){
+            result->is_ok = false;
+            return;
+        }
+        result->bytes = text.size;
+        buffer_t_destruct (&text);
+    }
+    else if (!buffer_t_construct_map (&binary, binary_name)){
+        result->is_ok = false;
+        return;
+    }
+    else if (engine == ENGINE_TRANSLATOR)
+        result->bytes = binary.size;
+
+    for (unsigned i = 0; result->is_ok && i < bench->warmup + bench->trials; i++){
+        double time = 0, bytes_time = 0;
+        if (engine == ENGINE_ASSEMBLER){
+            double begin = get_time ();
+            result->is_ok = run_assembler (bench, source, binary_name);
+            time = bytes_time = get_time () - begin;
+        }
+        else if (engine == ENGINE_TRANSLATOR)
+            result->is_ok = run_translator (&binary, &bytes_time, &time, bench->is_optimized, bench->is_peephole);
+        else
+            result->is_ok = run_cpu (&binary, engine, &time);
+        // The warmup runs aren't measured
+        if (i >= bench->warmup){
+            times[i - bench->warmup] = time;
+            bytes_times[i - bench->warmup] = bytes_time;
+        }
+    }
+    if (result->is_ok){
+        result->time = get_median (times, bench->trials);
+        result->min_time = times[0];
+        result->bytes_time = get_median (bytes_times, bench->trials);
+        // Counting is slow, so it is done once for all the engines
+        if (engine == ENGINE_RUN)
+            result->is_ok = (result->instructions = count_instructions (&binary));
+    }
+    if (engine != ENGINE_ASSEMBLER)
+        buffer_t_destruct (&binary);
+
+    struct rusage usage;
+    getrusage ((engine == ENGINE_ASSEMBLER)? RUSAGE_CHILDREN : RUSAGE_SELF, &usage);
+    result->rss = usage.ru_maxrss;
+}
+
+/**
+*@brief Runs the trials in the child process, so the crash of the engine doesn't stop the suite
+*and the peak RSS belongs to this engine only.
+*@return true if the trials have succeeded, false otherwise.
+*/
+bool measure (const bench_t* bench, const char source[], const char binary_name[], char engine, bench_result* result)
+{
+    memset (result, 0, sizeof(*result));
+    int channel[2];
+    if (pipe (channel)){
+        perror ("Benchmark");
+        return false;
+    }
+    fflush (NULL);
+    pid_t pid = fork ();
+    if (pid < 0){
+        perror ("Benchmark");
+        close (channel[0]);
+        close (channel[1]);
+        return false;
+    }
+    if (!pid){
+        close (channel[0]);
+        run_trials (bench, source, binary_name, engine, result);
+        ssize_t written = write (channel[1], result, sizeof(*result));
+        close (channel[1]);
+        _exit ((written == sizeof(*result))? NO_ERROR : WRONG_RESULT);
+    }
+    close (channel[1]);
+    ssize_t nread = 0, total = 0;
+    while (total < (ssize_t)sizeof(*result) &&
+           ((nread = read (channel[0], (char*)result + total, sizeof(*result) - total)) > 0 || (nread < 0 && errno == EINTR)))
+        total += (nread > 0)? nread : 0;
+    close (channel[0]);
+    int status = 0;
+    while (waitpid (pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    if (total != sizeof(*result) || !WIFEXITED(status))
+        result->is_ok = false;
+    return result->is_ok;
+}
+
+/**
+*@brief Finds the median time of the row in the report of the previous build.
+*@return true if the row is found, false otherwise.
+*/
+bool find_baseline (FILE* baseline, const char workload[], const char engine[], double* time)
+{
+    char line[LINE_MAX], row_workload[NAME_MAX], row_engine[NAME_MAX], row_time[NAME_MAX];
+    rewind (baseline);
+    while (fgets (line, sizeof(line), baseline))
+        if (*line != '#' && sscanf (line, "%255s %255s %*s %255s", row_workload, row_engine, row_time) == 3 &&
+            !strcmp (workload, row_workload) && !strcmp (engine, row_engine))
+            return sscanf (row_time, "%lf", time) == 1;
+    return false;
+}
+
+/**
+*@brief Prints the row of the report, the columns that don't apply to the engine are '-'.
+*/
+void print_row (const bench_t* bench, const char workload[], char engine, const bench_result* result)
+{
+    FILE* f = bench->report;
+    if (!result->is_ok){
+        fprintf (f, "%-12s %-11s FAILED\n", workload, ENGINE_NAMES[(int)engine]);
+        return;
+    }
+    char column[NAME_MAX];
+    fprintf (f, "%-12s %-11s ", workload, ENGINE_NAMES[(int)engine]);
+    if (result->instructions)
+        fprintf (f, "%12lu ", result->instructions);
+    else
+        fprintf (f, "%12s ", "-");
+    fprintf (f, "%10.3lf %10.3lf ", result->time, result->min_time);
+    if (result->instructions && result->time > 0)
+        fprintf (f, "%9.3lf %9.2lf ", result->time*1000000/result->instructions, result->instructions/(result->time*1000));
+    else
+        fprintf (f, "%9s %9s ", "-", "-");
+    if (result->bytes && result->bytes_time > 0)
+        snprintf (column, sizeof(column), "%.0lf", result->bytes*1000/result->bytes_time);
+    else
+        strcpy (column, "-");
+    fprintf (f, "%12s %8ld", column, result->rss);
+    double time = 0;
+    if (bench->baseline && find_baseline (bench->baseline, workload, ENGINE_NAMES[(int)engine], &time) && time > 0)
+        fprintf (f, " %+7.1lf%%", (result->time/time - 1)*100);
+    fprintf (f, "\n");
+    fflush (f);
+}
+
+/**
+*@brief Runs all the engines on the workload.
+*@return Number of the failed engines.
+*/
+unsigned run_workload (const bench_t* bench, const char source[])
+{
+    char name[NAME_MAX], binary_name[PATH_MAX];
+    get_workload_name (source, name);
+    int length = snprintf (binary_name, PATH_MAX, "%s/%s.bin", bench->dir, name);
+    if (length <= 0 || length >= PATH_MAX)
+        return ENGINE_NUMBER;
+
+    unsigned failed = 0;
+    uint64_t instructions = 0;
+    for (char engine = 0; engine < ENGINE_NUMBER; engine++){
+        bench_result result;
+        measure (bench, source, binary_name, engine, &result);
+        // The engines run the same instructions, they are counted with the first of them
+        if (engine == ENGINE_RUN)
+            instructions = result.instructions;
+        else if (engine != ENGINE_ASSEMBLER)
+            result.instructions = instructions;
+        print_row (bench, name, engine, &result);
+        failed += !result.is_ok;
+        // The other engines run the program written by the assembler
+        if (engine == ENGINE_ASSEMBLER && !result.is_ok){
+            for (engine++; engine < ENGINE_NUMBER; engine++)
+                print_row (bench, name, engine, &result);
+            return ENGINE_NUMBER;
+        }
+    }
+    unlink (binary_name);
+    return failed;
+}
+
+int main (int argc, char* argv[])
+{
+    CHECK_DEFAULT_ARGS();
+    if (argc < 2){
+        WRITE_WRONG_USE();
+    }
+    bench_t bench = {};
+    bench.assembler = "./Assembler";
+    bench.trials = 5;
+    bench.warmup = 1;
+    bench.is_optimized = true;
+    bench.is_peephole = true;
+    unsigned nblocks = 2000;
+    const char* baseline_name = NULL;
+    char** sources = (char**)calloc (argc, sizeof(char*));
+    unsigned nsources = 0;
+    for (int i = 1; i < argc; i++){
+        if (!strcmp ("--assembler", argv[i]) && i + 1 < argc)
+            bench.assembler = argv[++i];
+        else if (!strcmp ("--trials", argv[i]) && i + 1 < argc && sscanf (argv[i + 1], "%u", &bench.trials) == 1)
+            i++;
+        else if (!strcmp ("--warmup", argv[i]) && i + 1 < argc && sscanf (argv[i + 1], "%u", &bench.warmup) == 1)
+            i++;
+        else if (!strcmp ("--source", argv[i]) && i + 1 < argc && sscanf (argv[i + 1], "%u", &nblocks) == 1)
+            i++;
+        else if (!strcmp ("--compare", argv[i]) && i + 1 < argc)
+            baseline_name = argv[++i];
+        else if (!strcmp ("--no-optimize", argv[i]))
+            bench.is_optimized = false;
+        else if (!strcmp ("--no-peephole", argv[i]))
+            bench.is_peephole = false;
+        else if (!strncmp ("--", argv[i], 2)){
+            WRITE_WRONG_USE();
+        }
+        else if (sources)
+            sources[nsources++] = argv[i];
+    }
+    if (!bench.trials || bench.trials > BENCH_MAX_TRIALS || bench.warmup > BENCH_MAX_TRIALS || (!nsources && !nblocks)){
+        WRITE_WRONG_USE();
+    }
+    if (baseline_name && !(bench.baseline = fopen (baseline_name, "r"))){
+        perror (baseline_name);
+        return WRONG_RESULT;
+    }
+
+    // The report goes to the standard output, the messages of the processors and the tools are hidden
+    bench.report = fdopen (dup (STDOUT_FILENO), "w");
+    int messages = open ("/dev/null", O_WRONLY);
+    strcpy (bench.dir, "/tmp/benchmark.XXXXXX");
+    if (!bench.report || !sources || messages < 0 || !mkdtemp (bench.dir)){
+        perror ("Benchmark");
+        return WRONG_RESULT;
+    }
+    fflush (stdout);
+    dup2 (messages, STDOUT_FILENO);
+    close (messages);
+
+    fprintf (bench.report, "#Benchmark %s: median of %u trials after %u warmup%s%s, times in ms, peak RSS in KB\n",
+             VERSION, bench.trials, bench.warmup, (bench.is_optimized)? "" : ", no optimize",
+             (bench.is_peephole)? "" : ", no peephole");
+    fprintf (bench.report, "#%-11s %-11s %12s %10s %10s %9s %9s %12s %8s%s\n", "workload", "engine", "instructions",
+             "time", "min", "ns/insn", "Minsn/s", "bytes/s", "rss", (bench.baseline)? "   change" : "");
+    unsigned failed = 0;
+    for (unsigned i = 0; i < nsources; i++)
+        failed += run_workload (&bench, sources[i]);
+
+    // The workloads are small, so the throughput of the assembler is measured on the large generated source
+    if (nblocks){
+        char source[PATH_MAX], binary_name[PATH_MAX];
+        snprintf (source, PATH_MAX, "%s/" BENCH_GENERATED ".asm", bench.dir);
+        snprintf (binary_name, PATH_MAX, "%s/" BENCH_GENERATED ".bin", bench.dir);
+        bench_result result = {};
+        if (write_source (source, nblocks))
+            measure (&bench, source, binary_name, ENGINE_ASSEMBLER, &result);
+        print_row (&bench, BENCH_GENERATED, ENGINE_ASSEMBLER, &result);
+        failed += !result.is_ok;
+        unlink (source);
+        unlink (binary_name);
+    }
+    fprintf (bench.report, "#Failed: %u\n", failed);
+
+    fclose (bench.report);
+    if (bench.baseline)
+        fclose (bench.baseline);
+    rmdir (bench.dir);
+    free (sources);
+    return (failed)? WRONG_RESULT : NO_ERROR;
+}
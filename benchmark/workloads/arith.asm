@@ -0,0 +1,42 @@
+; ARITHMETIC LOOP
+;
+; INPUT:   none
+; OUTPUT:  sum of (i*i - 3*i + 7 + i mod 1000) for i from 0 to 999999 modulo 2^32 = 35731296
+; COMMENT: integer arithmetics and a conditional jump, the counters live in the registers
+.data
+    sum: dword 0
+.code
+    push 0
+    pop ecx
+    push 0
+    pop ebx
+LOOP:
+    push 3
+    push ecx
+    mul
+    push ecx
+    push ecx
+    mul
+    sub
+    push 7
+    add
+    push 1000
+    push ecx
+    mod
+    add
+    push ebx
+    add
+    pop ebx
+    push 1
+    push ecx
+    add
+    pop ecx
+    push 1000000
+    push ecx
+    cmp
+    jb LOOP
+    push ebx
+    dworddup
+    pop dword [sum]
+    out
+    stop
@@ -0,0 +1,44 @@
+; RECURSIVE FIBONACCI
+;
+; INPUT:   none
+; OUTPUT:  fib(25) = 75025
+; COMMENT: two recursive calls per level, so the calls and the returns dominate
+.data
+    n: dword 25
+.code
+    push dword [n]
+    call FIB
+    out
+    jmp END
+; Replaces n on the top of the stack with fib(n)
+FIB:
+    pop edx
+    dworddup
+    push 2
+    cmp
+    ja BASE
+    pop ecx
+    push edx
+    push ecx
+    push -1
+    add
+    dworddup
+    call FIB
+    pop ecx
+    push -1
+    add
+    pop eax
+    push ecx
+    push eax
+    call FIB
+    add
+    pop ecx
+    pop edx
+    push ecx
+    push edx
+    ret
+BASE:
+    push edx
+    ret
+END:
+    stop
@@ -0,0 +1,45 @@
+; MEMORY TRAFFIC
+;
+; INPUT:   none
+; OUTPUT:  fib(500001) modulo 2^32
+; COMMENT: every value lives in the memory, so almost every instruction is push or pop of a byte, a word or a dword
+.data
+    v0: dword 0
+    v1: dword 1
+    v2: dword 0
+    k:  dword 0
+    w0: word raw
+    w1: word raw
+    b0: byte raw
+    b1: byte raw
+.code
+LOOP:
+    ; v0, v1 = v1, v0 + v1
+    push dword [v1]
+    push dword [v0]
+    add
+    pop dword [v2]
+    push dword [v1]
+    pop dword [v0]
+    push dword [v2]
+    pop dword [v1]
+    ; swapping the words and the bytes through the stack
+    push word [w0]
+    push word [w1]
+    pop word [w0]
+    pop word [w1]
+    push byte [b0]
+    push byte [b1]
+    pop byte [b0]
+    pop byte [b1]
+    push dword [k]
+    push 1
+    add
+    dworddup
+    pop dword [k]
+    push 500000
+    cmp
+    ja LOOP
+    push dword [v1]
+    out
+    stop
@@ -0,0 +1,102 @@
+; QUADRATIC EQUATIONS
+;
+; INPUT:   none
+; OUTPUT:  sum of the roots of x^2 + b*x + 1 = 0 for 50000 values of b from 2 to 3, about -125000
+; COMMENT: float arithmetics, the square root of the discriminant takes 6 iterations of Newton's method
+.data
+    a:   dword raw
+    b:   dword raw
+    c:   dword raw
+    d:   dword raw
+    sum: dword raw
+.code
+    push 1.0
+    pop dword [a]
+    push 2.0
+    pop dword [b]
+    push 1.0
+    pop dword [c]
+    push 0.0
+    pop dword [sum]
+    push 0
+    pop ecx
+LOOP:
+    ; d = b*b - 4*a*c
+    push dword [c]
+    push dword [a]
+    fmul
+    push 4.0
+    fmul
+    push dword [b]
+    push dword [b]
+    fmul
+    fsub
+    pop dword [d]
+    ; ebx = sqrt(d)
+    push 1.0
+    push dword [d]
+    fadd
+    pop ebx
+    push 6
+    pop edx
+SQRT:
+    push ebx
+    push dword [d]
+    fdiv
+    push ebx
+    fadd
+    push 0.5
+    fmul
+    pop ebx
+    push -1
+    push edx
+    add
+    pop edx
+    push 0
+    push edx
+    cmp
+    ja SQRT
+    ; sum += (sqrt(d) - b)/2a + (-sqrt(d) - b)/2a
+    push dword [a]
+    push 2.0
+    fmul
+    push dword [b]
+    push ebx
+    fsub
+    fdiv
+    push dword [a]
+    push 2.0
+    fmul
+    push ebx
+    push dword [b]
+    fadd
+    push -1.0
+    fmul
+    fdiv
+    fadd
+    push dword [sum]
+    fadd
+    pop dword [sum]
+    ; b goes from 2 to 3 by 0.01 and starts again
+    push 0.01
+    push dword [b]
+    fadd
+    pop dword [b]
+    push 3.0
+    push dword [b]
+    fcmp
+    jb NEXT
+    push 2.0
+    pop dword [b]
+NEXT:
+    push 1
+    push ecx
+    add
+    pop ecx
+    push 50000
+    push ecx
+    cmp
+    jb LOOP
+    push dword [sum]
+    fout
+    stop
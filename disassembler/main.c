@@ -7,7 +7,7 @@
 
 #include <stdio.h>
 #include "mylib.h"
-#include "exit_codes.h"
+#include "buffer_t.h"
 #include <string.h>
 #include <limits.h>
 
@@ -40,33 +40,33 @@ int main (int argc, char* argv[])
         WRITE_WRONG_USE();
     }
 
-    Buffer assembled = {};
-    if (!buffer_construct (&assembled, inName))
+    buffer_t assembled;
+    if (!buffer_t_construct_map (&assembled, inName))
     {
         perror ("#Input error");
         return WRONG_RESULT;
     }
 
-    Buffer source;
-    buffer_construct_empty (&source, 10*assembled.length);
+    buffer_t source;
+    buffer_t_construct (&source, 10*assembled.size + 1, false);
 
     char state = CMD, arg_type = -1;
     int reading_pos = 0;
-    while (reading_pos <= assembled.length)
+    while (reading_pos <= assembled.size)
     {
         switch (state)
         {
         case CMD:
             ;// Just very strange behavior
-            char code = assembled.chars[reading_pos];
+            char code = assembled.data[reading_pos];
             reading_pos++;
-            #define CMD(name, key, shift, arguments) \
+            #define CMD(name, key, shift, arguments, pops, pushes) \
             if (!(arguments & ARG_OVL)) \
             {\
                 if (state == CMD && code == key)\
                 {\
                     printf ("%s ", #name);\
-                    strcat (source.chars, #name " ");\
+                    strcat (source.data, #name " ");\
                     if (arguments & ARG_NO)\
                     {\
                         state = DONE;\
@@ -80,14 +80,14 @@ int main (int argc, char* argv[])
                 else if (arguments & ARG_REG && code == key + 1)\
                 {\
                     printf (#name " ");\
-                    strcat (source.chars, #name " ");\
+                    strcat (source.data, #name " ");\
                     state = ARG;\
                     arg_type = ARG_REG;\
                 }\
                 else if (arguments & ARG_MEM && code == key + 2)\
                 {\
                     printf (#name " ");\
-                    strcat (source.chars, #name " ");\
+                    strcat (source.data, #name " ");\
                     state = ARG;\
                     arg_type = ARG_MEM;\
                 }\
@@ -104,12 +104,12 @@ int main (int argc, char* argv[])
         case ARG:
             if ((state != DONE) && (arg_type & ARG_NUM))
             {
-                float num = *(float*)(assembled.chars+reading_pos);
+                float num = *(float*)(assembled.data+reading_pos);
 
                 char *temp = (char*)calloc (128, sizeof(char));
                 temp[0] = '\0';
                 sprintf (temp, "%g", num);
-                strcat (source.chars, temp);
+                strcat (source.data, temp);
                 free (temp);
 
                 printf ("(%g)", num);
@@ -118,12 +118,12 @@ int main (int argc, char* argv[])
             }
             if ((state != DONE) && (arg_type & ARG_MEM))
             {
-                unsigned mem = *(unsigned*)(assembled.chars + reading_pos);
+                unsigned mem = *(unsigned*)(assembled.data + reading_pos);
 
                 char *temp = (char*)calloc (128, sizeof(char));
                 temp[0] = '\0';
                 sprintf (temp, "[%u]", mem);
-                strcat (source.chars, temp);
+                strcat (source.data, temp);
                 free (temp);
 
                 printf ("[%u]", mem);
@@ -133,7 +133,7 @@ int main (int argc, char* argv[])
             }
             if ((state != DONE) && (arg_type & ARG_REG))
             {
-                char reg = assembled.chars[reading_pos];
+                char reg = assembled.data[reading_pos];
                 reading_pos++;
                 #define ADDRESS(name, address) \
                 if (state != DONE && reg == address)\
@@ -142,7 +142,7 @@ int main (int argc, char* argv[])
                     char *temp = (char*)calloc (128, sizeof(char));\
                     temp[0] = '\0';\
                     sprintf (temp, #name);\
-                    strcat (source.chars, temp);\
+                    strcat (source.data, temp);\
                     free (temp);\
                     printf ("%s", #name);\
                     state = DONE;\
@@ -152,12 +152,12 @@ int main (int argc, char* argv[])
             }
             if ((state != DONE) && (arg_type & ARG_POS))
             {
-                int pos = *(int*)(assembled.chars+reading_pos);
+                int pos = *(int*)(assembled.data+reading_pos);
 
                 char *temp = (char*)calloc (128, sizeof(char));
                 temp[0] = '\0';
                 sprintf (temp, "%d", pos);
-                strcat (source.chars, temp);
+                strcat (source.data, temp);
                 free (temp);
 
                 printf ("{%d}", pos);
@@ -168,7 +168,7 @@ int main (int argc, char* argv[])
             if (state != DONE)
             {
                 printf ("\nCommand is corrupted\n");
-                buffer_destruct(&assembled);
+                buffer_t_destruct(&assembled);
                 return WRONG_RESULT;
             }
             break;
@@ -180,15 +180,15 @@ int main (int argc, char* argv[])
         if (state == DONE)
         {
             printf ("\n");
-            strcat (source.chars, "\n");
+            strcat (source.data, "\n");
             state = CMD;
         }
     }
 
-    buffer_destruct(&assembled);
+    buffer_t_destruct(&assembled);
     open_file (out, outName, "wb", "#Output error");
-    fprintf (out, "%s", source.chars);
-    buffer_destruct(&source);
+    fprintf (out, "%s", source.data);
+    buffer_t_destruct(&source);
     close_file (out);
     printf("#Programm successfully written to %s.\n", outName);
     //^^^^^^^^^^^^^^^^^^^^^^^^^
@@ -0,0 +1,362 @@
+#include "mylib.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef ARENA_H_INCLUDED
+#define ARENA_H_INCLUDED
+
+/// Default size of the slab, the pages are committed on the first touch
+#define ARENA_SLAB_SIZE (1024*1024)
+/// Blocks begin at the cache lines
+#define ARENA_ALIGN 64
+/// More comfortable dump
+#define arena_t_dump(This) arena_t_dump_(This, #This)
+
+/// Mapping of the slabs: the first that the kernel allows, the pages made executable by mprotect
+/// or the file mapped twice: the writable view and the executable view
+enum ARENA_MODE {ARENA_AUTO, ARENA_SINGLE, ARENA_DUAL};
+
+/// Freed block of the slab, the description lives out of the slab as the slab isn't writable
+typedef struct arena_t_block arena_t_block;
+struct arena_t_block
+{
+    size_t offset;/**< Offset of the block in the slab */
+    size_t size;/**< Size of the block */
+    arena_t_block* next;/**< The next freed block, they are sorted by the offsets */
+};
+
+/// Slab of the executable memory
+typedef struct arena_t_slab arena_t_slab;
+struct arena_t_slab
+{
+    char* code;/**< Executable view */
+    char* data;/**< Writable view, the same as code in ARENA_SINGLE mode */
+    size_t size;/**< Size of the slab */
+    size_t used;/**< Bytes at the beginning given to the blocks, the rest has never been given */
+    arena_t_block* free;/**< Freed blocks before used, the neighbours are merged */
+    arena_t_slab* next;
+};
+
+/**
+@brief Allocator of the native code.
+
+The code is never writable and executable at the same time: it is written by arena_t_write
+through the writable view or with the pages made writable for a moment. The freed blocks
+are given again, so the slabs are mapped once for all the code that comes and goes.
+The arena isn't thread-safe.
+*/
+typedef struct arena_t arena_t;
+struct arena_t
+{
+    arena_t_slab* slabs;
+    size_t slab_size;/**< Size of the new slabs */
+    size_t allocated;/**< Bytes in the blocks in use */
+    char mode;/**< ARENA_MODE, ARENA_AUTO is replaced with the working one by the first slab */
+};
+
+/**
+*@brief Arena constructor, the slabs are mapped when they are needed.
+*
+*@param This Pointer to the arena to be constructed.
+*@param slab_size Size of the slabs, the bigger blocks get the slabs of their own.
+*@param mode ARENA_MODE.
+*@return true if success, false otherwise.
+*/
+bool arena_t_construct (arena_t* This, size_t slab_size, char mode);
+
+/**
+*@brief Destructs the arena and unmaps all the code.
+*/
+void arena_t_destruct (arena_t* This);
+
+/**
+*@brief Validates the arena.
+*/
+bool arena_t_OK (const arena_t* This);
+
+/**
+*@brief Prints arena's dump.
+*/
+void arena_t_dump_ (const arena_t* This, const char name[]);
+
+/**
+*@brief Gives the block of the executable memory, it is written with arena_t_write.
+*@return Executable address of the block, NULL in case of error.
+*/
+char* arena_t_allocate (arena_t* This, size_t nbytes);
+
+/**
+*@brief Writes the code to the block.
+*@param code Address inside the block given by arena_t_allocate.
+*@return true if success, false otherwise.
+*/
+bool arena_t_write (arena_t* This, char* code, const void* data, size_t nbytes);
+
+/**
+*@brief Gives the block back, its memory is reused by the next blocks.
+*@param code Address of the block given by arena_t_allocate.
+*@param nbytes Size the block was allocated with.
+*/
+void arena_t_free (arena_t* This, char* code, size_t nbytes);
+
+bool arena_t_construct (arena_t* This, size_t slab_size, char mode)
+{
+    assert (This);
+    long page = sysconf(_SC_PAGESIZE);
+    This->slabs = NULL;
+    This->slab_size = (slab_size + page - 1) / page * page;
+    This->allocated = 0;
+    This->mode = mode;
+    return This->slab_size;
+}
+
+void arena_t_destruct (arena_t* This)
+{
+    assert (This);
+    while (This->slabs){
+        arena_t_slab* slab = This->slabs;
+        This->slabs = slab->next;
+        while (slab->free){
+            arena_t_block* block = slab->free;
+            slab->free = block->next;
+            free (block);
+        }
+        munmap (slab->code, slab->size);
+        if (slab->data != slab->code)
+            munmap (slab->data, slab->size);
+        free (slab);
+    }
+    This->allocated = 0;
+}
+
+bool arena_t_OK (const arena_t* This)
+{
+    assert (This);
+    for (const arena_t_slab* slab = This->slabs; slab; slab = slab->next){
+        if (!slab->code || !slab->data || slab->used > slab->size)
+            return false;
+        for (const arena_t_block* block = slab->free; block; block = block->next)
+            if (block->offset + block->size > slab->used || (block->next && block->next->offset <= block->offset + block->size))
+                return false;
+    }
+    return This->slab_size && (This->mode != ARENA_AUTO || !This->slabs);
+}
+
+void arena_t_dump_ (const arena_t* This, const char name[])
+{
+    assert (This);
+    DUMP_INDENT += INDENT_VALUE;
+    printf ("%s = " ANSI_COLOR_BLUE "arena_t" ANSI_COLOR_RESET " (", name);
+    if (arena_t_OK(This))
+        printf (ANSI_COLOR_GREEN "ok" ANSI_COLOR_RESET ")\n");
+    else
+        printf (ANSI_COLOR_RED "ERROR" ANSI_COLOR_RESET ")\n");
+    printf ("%*smode = %s\n", DUMP_INDENT, "", (This->mode == ARENA_DUAL)? "dual" : (This->mode == ARENA_SINGLE)? "single" : "auto");
+    printf ("%*sslab_size = %lu\n", DUMP_INDENT, "", This->slab_size);
+    printf ("%*sallocated = %lu\n", DUMP_INDENT, "", This->allocated);
+    for (const arena_t_slab* slab = This->slabs; slab; slab = slab->next){
+        printf ("%*s[%p] size = %lu, used = %lu, free:", DUMP_INDENT, "", slab->code, slab->size, slab->used);
+        for (const arena_t_block* block = slab->free; block; block = block->next)
+            printf (" %lu..%lu", block->offset, block->offset + block->size);
+        printf ("\n");
+    }
+    DUMP_INDENT -= INDENT_VALUE;
+}
+
+// Maps the pages made executable by mprotect after they are written
+bool arena_t_map_single (arena_t_slab* slab)
+{
+    slab->code = (char*)mmap(NULL, slab->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab->code == MAP_FAILED)
+        return false;
+    // The kernels with W^X enforced refuse the writable pages to become executable
+    if (mprotect(slab->code, slab->size, PROT_READ | PROT_EXEC)){
+        munmap(slab->code, slab->size);
+        return false;
+    }
+    slab->data = slab->code;
+    return true;
+}
+
+// Maps the file twice: the pages are never writable and executable at the same address
+bool arena_t_map_dual (arena_t_slab* slab)
+{
+    #if defined(__unix__) && defined(SYS_memfd_create)
+    int fd = (int)syscall(SYS_memfd_create, "arena_t", 0);
+    if (fd < 0)
+        return false;
+    slab->data = MAP_FAILED;
+    slab->code = MAP_FAILED;
+    if (!ftruncate(fd, slab->size)){
+        slab->data = (char*)mmap(NULL, slab->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        slab->code = (char*)mmap(NULL, slab->size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (slab->data != MAP_FAILED && slab->code != MAP_FAILED)
+        return true;
+    if (slab->data != MAP_FAILED)
+        munmap(slab->data, slab->size);
+    if (slab->code != MAP_FAILED)
+        munmap(slab->code, slab->size);
+    #endif
+    (void)slab;
+    return false;
+}
+
+// Maps the slab for at least nbytes
+arena_t_slab* arena_t_add_slab (arena_t* This, size_t nbytes)
+{
+    arena_t_slab* slab = (arena_t_slab*)calloc(1, sizeof(arena_t_slab));
+    if (!slab){
+        perror("arena_t_add_slab: (can't allocate slab)");
+        return NULL;
+    }
+    slab->size = (nbytes > This->slab_size)? (nbytes + This->slab_size - 1) / This->slab_size * This->slab_size : This->slab_size;
+    bool is_mapped = false;
+    if (This->mode != ARENA_DUAL && (is_mapped = arena_t_map_single(slab)))
+        This->mode = ARENA_SINGLE;
+    if (!is_mapped && This->mode != ARENA_SINGLE && (is_mapped = arena_t_map_dual(slab)))
+        This->mode = ARENA_DUAL;
+    if (!is_mapped){
+        perror("arena_t_add_slab: (can't map executable memory)");
+        free(slab);
+        return NULL;
+    }
+    slab->next = This->slabs;
+    This->slabs = slab;
+    return slab;
+}
+
+char* arena_t_allocate (arena_t* This, size_t nbytes)
+{
+    ASSERT_OK(arena_t, This);
+    nbytes = (nbytes + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    if (!nbytes)
+        nbytes = ARENA_ALIGN;
+    // The first fit among the freed blocks, then the never given memory
+    for (arena_t_slab* slab = This->slabs; slab; slab = slab->next)
+        for (arena_t_block** link = &slab->free; *link; link = &(*link)->next){
+            arena_t_block* block = *link;
+            if (block->size < nbytes)
+                continue;
+            char* code = slab->code + block->offset;
+            block->offset += nbytes;
+            block->size -= nbytes;
+            if (!block->size){
+                *link = block->next;
+                free(block);
+            }
+            This->allocated += nbytes;
+            return code;
+        }
+    arena_t_slab* slab = This->slabs;
+    while (slab && slab->size - slab->used < nbytes)
+        slab = slab->next;
+    if (!slab && !(slab = arena_t_add_slab(This, nbytes)))
+        return NULL;
+    char* code = slab->code + slab->used;
+    slab->used += nbytes;
+    This->allocated += nbytes;
+    return code;
+}
+
+// Finds the slab of the address
+arena_t_slab* arena_t_find (arena_t* This, const char* code)
+{
+    for (arena_t_slab* slab = This->slabs; slab; slab = slab->next)
+        if (code >= slab->code && code < slab->code + slab->size)
+            return slab;
+    return NULL;
+}
+
+bool arena_t_write (arena_t* This, char* code, const void* data, size_t nbytes)
+{
+    ASSERT_OK(arena_t, This);
+    arena_t_slab* slab = arena_t_find(This, code);
+    if (!slab || code + nbytes > slab->code + slab->used){
+        printf ("arena_t_write: Error! %p isn't in the allocated block\n", code);
+        return false;
+    }
+    if (slab->data != slab->code){
+        memcpy(slab->data + (code - slab->code), data, nbytes);
+        __builtin___clear_cache(code, code + nbytes);
+        return true;
+    }
+    // The pages of the block are writable only while the code is copied
+    long page = sysconf(_SC_PAGESIZE);
+    char* begin = slab->code + (code - slab->code) / page * page;
+    size_t size = (code + nbytes - begin + page - 1) / page * page;
+    if (mprotect(begin, size, PROT_READ | PROT_WRITE)){
+        perror("arena_t_write: (can't make code writable)");
+        return false;
+    }
+    memcpy(code, data, nbytes);
+    if (mprotect(begin, size, PROT_READ | PROT_EXEC)){
+        perror("arena_t_write: (can't make code executable)");
+        return false;
+    }
+    __builtin___clear_cache(code, code + nbytes);
+    return true;
+}
+
+void arena_t_free (arena_t* This, char* code, size_t nbytes)
+{
+    ASSERT_OK(arena_t, This);
+    if (!code)
+        return;
+    arena_t_slab* slab = arena_t_find(This, code);
+    assert (slab);
+    nbytes = (nbytes + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    if (!nbytes)
+        nbytes = ARENA_ALIGN;
+    This->allocated -= nbytes;
+    size_t offset = code - slab->code;
+    arena_t_block* previous = NULL;
+    arena_t_block* next = slab->free;
+    while (next && next->offset < offset){
+        previous = next;
+        next = next->next;
+    }
+    // Merging with the neighbours
+    if (previous && previous->offset + previous->size == offset){
+        previous->size += nbytes;
+        if (next && previous->offset + previous->size == next->offset){
+            previous->size += next->size;
+            previous->next = next->next;
+            free(next);
+        }
+    }
+    else if (next && offset + nbytes == next->offset){
+        next->offset = offset;
+        next->size += nbytes;
+    }
+    else{
+        arena_t_block* block = (arena_t_block*)malloc(sizeof(arena_t_block));
+        // The block is lost if there is no memory to describe it
+        if (!block)
+            return;
+        block->offset = offset;
+        block->size = nbytes;
+        block->next = next;
+        if (previous)
+            previous->next = block;
+        else
+            slab->free = block;
+    }
+    // The last freed block gives its memory back to the never given part
+    arena_t_block** last = &slab->free;
+    while (*last && (*last)->next)
+        last = &(*last)->next;
+    if (*last && (*last)->offset + (*last)->size == slab->used){
+        slab->used = (*last)->offset;
+        free(*last);
+        *last = NULL;
+    }
+}
+
+#endif // ARENA_H_INCLUDED
@@ -1,6 +1,9 @@
 #include <string.h>
 #include <stdbool.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "mylib.h"
 
 #ifndef BUFFER_H_INCLUDED
@@ -26,6 +29,10 @@ struct buffer_t
     size_t size;
     // Maximum amount of bytes
     size_t max_size;
+    // Size of the mapping if the data is mapped from the file, 0 otherwise
+    size_t map_size;
+    // The data belongs to the other buffer
+    bool is_view;
 };
 
 void buffer_t_destruct (buffer_t* This);
@@ -33,14 +40,19 @@ bool buffer_t_construct_filename (buffer_t* This, const char filename[]);
 bool buffer_t_construct_file (buffer_t* This, FILE* f);
 bool buffer_t_construct (buffer_t* This, size_t nbytes, bool do_alloc);
 bool buffer_t_construct_copy (buffer_t* This, const buffer_t* other);
+bool buffer_t_construct_map (buffer_t* This, const char filename[]);
+bool buffer_t_construct_view (buffer_t* This, const buffer_t* other);
 bool buffer_t_append (buffer_t* This, const char* data, size_t nbytes);
+bool buffer_t_reserve (buffer_t* This, size_t nbytes);
 bool buffer_t_OK (const buffer_t* This);
 void buffer_t_dump_ (const buffer_t* This, const char name[]);
 
 void buffer_t_destruct (buffer_t* This)
 {
     assert (This);
-    if (This->data)
+    if (This->map_size)
+        munmap (This->data, This->map_size);
+    else if (This->data && !This->is_view)
         free (This->data);
     // Just to be sure
     This->data = NULL;
@@ -49,6 +61,8 @@ void buffer_t_destruct (buffer_t* This)
     This->max_size = 0;
     This->do_alloc = false;
     This->alloc_mult = 0;
+    This->map_size = 0;
+    This->is_view = false;
 }
 
 bool buffer_t_OK (const buffer_t* This)
@@ -70,6 +84,8 @@ void buffer_t_dump_ (const buffer_t* This, const char name[])
     printf ("%*smax_size = %lu\n", DUMP_INDENT, "", This->max_size);
     printf ("%*ssize = %lu\n", DUMP_INDENT, "", This->size);
     printf ("%*sdo_alloc = %d\n", DUMP_INDENT, "", This->do_alloc);
+    printf ("%*smap_size = %lu\n", DUMP_INDENT, "", This->map_size);
+    printf ("%*sis_view = %d\n", DUMP_INDENT, "", This->is_view);
     printf ("%*salloc_mult = %lf\n", DUMP_INDENT, "", This->alloc_mult);
     printf ("%*sdata = %p\n", DUMP_INDENT, "", This->data);
     printf ("%*send  = %p\n", DUMP_INDENT, "", This->end);
@@ -111,14 +127,15 @@ bool buffer_t_construct_file (buffer_t* This, FILE* f)
     assert(f);
     struct stat st;
     fstat(fileno(f), &st);
-    buffer_t_construct(This, st.st_size, 0);
+    // The zero byte after the data ends the text
+    if (!buffer_t_construct(This, st.st_size + 1, 0))
+        return false;
 
-    This->size = This->max_size;
+    This->size = st.st_size;
     if (fread (This->data, 1, This->size, f) != This->size){
         errno = EIO;
         perror("buffer_t_construct:");
         buffer_t_destruct (This);
-        fclose (f);
         return false;
     }
 
@@ -134,7 +151,10 @@ bool buffer_t_construct_filename (buffer_t* This, const char filename[])
         buffer_t_destruct (This);
         return false;
     }
-    buffer_t_construct_file(This, f);
+    if (!buffer_t_construct_file(This, f)){
+        fclose (f);
+        return false;
+    }
     if (fclose (f)){
         perror("buffer_t_construct: (can't close file)");
         buffer_t_destruct (This);
@@ -160,6 +180,8 @@ bool buffer_t_construct (buffer_t* This, size_t max_size, bool do_alloc)
     memset (This->data, 0, This->max_size);
     This->do_alloc = do_alloc;
     This->alloc_mult = BUFFER_DEFAULT_MULT;
+    This->map_size = 0;
+    This->is_view = false;
 
     return true;
 }
@@ -168,10 +190,64 @@ bool buffer_t_construct_copy (buffer_t* This, const buffer_t* other)
 {
     assert(This);
     ASSERT_OK(buffer_t, other);
-    buffer_t_construct(This, other->max_size, other->do_alloc);
+    // The zero byte after the data ends the text, the mapped buffers have it out of max_size
+    if (!buffer_t_construct(This, other->max_size + 1, other->do_alloc))
+        return false;
     This->alloc_mult = other->alloc_mult;
     This->size = other->size;
-    memcpy (This->data, other->data, This->max_size);
+    memcpy (This->data, other->data, other->max_size);
+    return true;
+}
+
+bool buffer_t_construct_map (buffer_t* This, const char filename[])
+{
+    assert(This);
+    int fd = open (filename, O_RDONLY);
+    if (fd < 0){
+        perror("buffer_t_construct_map: (can't open file)");
+        memset (This, 0, sizeof(*This));
+        return false;
+    }
+    struct stat st;
+    char* data = MAP_FAILED;
+    size_t map_size = 0;
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0){
+        // The file is mapped over the zero pages, so there is always the zero byte after the data
+        long page = sysconf(_SC_PAGESIZE);
+        map_size = (st.st_size / page + 1) * page;
+        data = (char*)mmap(NULL, map_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (data != MAP_FAILED &&
+            mmap(data, st.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED | MAP_POPULATE, fd, 0) == MAP_FAILED){
+            munmap(data, map_size);
+            data = MAP_FAILED;
+        }
+    }
+    close (fd);
+    // Empty files, pipes and devices are read as usual
+    if (data == MAP_FAILED)
+        return buffer_t_construct_filename(This, filename);
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    This->data = data;
+    This->size = st.st_size;
+    This->max_size = st.st_size;
+    This->end = This->data + This->size - 1;
+    This->map_size = map_size;
+    This->is_view = false;
+    This->do_alloc = false;
+    This->alloc_mult = BUFFER_DEFAULT_MULT;
+    return true;
+}
+
+bool buffer_t_construct_view (buffer_t* This, const buffer_t* other)
+{
+    assert(This);
+    ASSERT_OK(buffer_t, other);
+    *This = *other;
+    // Nothing can be appended to the data of the other
+    This->max_size = This->size;
+    This->map_size = 0;
+    This->is_view = true;
+    This->do_alloc = false;
     return true;
 }
 
@@ -203,4 +279,26 @@ bool buffer_t_append(buffer_t* This, const char* data, size_t nbytes)
     return true;
 }
 
+// Makes the buffer able to take nbytes more without reallocation
+bool buffer_t_reserve(buffer_t* This, size_t nbytes)
+{
+    ASSERT_OK(buffer_t, This);
+    if (This->size + nbytes <= This->max_size)
+        return true;
+    if (!This->do_alloc){
+        printf ("buffer_t_reserve: Error! The buffer is in no-allocation mode\n");
+        return false;
+    }
+    size_t alloc_size = MAX(This->size + nbytes, This->alloc_mult*This->max_size);
+    char* data = (char*)realloc(This->data, alloc_size);
+    if (!data){
+        perror("buffer_t_reserve: (can't realloc)");
+        return false;
+    }
+    This->data = data;
+    This->max_size = alloc_size;
+    This->end = This->data + This->max_size - 1;
+    return true;
+}
+
 #endif // BUFFER_H_INCLUDED
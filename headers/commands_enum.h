@@ -1,14 +1,39 @@
 #ifndef COMMANDS_ENUM_H_INCLUDED
 #define COMMANDS_ENUM_H_INCLUDED
+#include <stdbool.h>
 
 enum COMMANDS
 {
-    #define CMD(name, key_value, shift_to_the_right, arguments_type) \
+    #define CMD(name, key_value, shift_to_the_right, arguments_type, pops, pushes) \
     cmd_ ## name = key_value,
     #include "commands.h"
     #undef CMD
 };
 
-
+/**
+*@brief Gets the numbers of bytes the instruction pops from the stack and pushes to it.
+*
+*The numbers are the ones of commands.h, so the verifier, the JIT and the IR passes agree on them.
+*@param code Code from commands.h.
+*@return false if the instruction isn't a plain one (the branches, call, ret, stop and the unknown codes).
+*/
+bool command_stack_effect (unsigned char code, unsigned* pops, unsigned* pushes)
+{
+    *pops = *pushes = 0;
+    switch (code)
+    {
+    #define CMD(name, key_value, shift_to_the_right, arguments_type, _pops, _pushes) \
+    case cmd_ ## name:\
+        if (_pops == STK_NO)\
+            return false;\
+        *pops = _pops;\
+        *pushes = _pushes;\
+        return true;
+    #include "commands.h"
+    #undef CMD
+    default:
+        return false;
+    }
+}
 
 #endif // COMMANDS_ENUM_H_INCLUDED
@@ -5,6 +5,13 @@
 #include "stack_t.h"
 #include <stdint.h>
 #include "buffer_t.h"
+#include "image_t.h"
+#include "stream_t.h"
+#if defined(__unix__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 #ifndef cpu_t_H_INCLUDED
 #define cpu_t_H_INCLUDED
@@ -12,15 +19,38 @@
 #define DEFINES_ONLY
 #include "reg_address.h"
 #undef DEFINES_ONLY
+#include "commands_enum.h"
 
 /// ESP register address
 #define ESP   6 * REG_SIZE
-/// Memory available for stack
-#define STACK_SIZE 128
-/// Memory size. As the stack is placed in the beginning, be sure to allocate enough space
-#define MEM_SIZE 512
+/// Default memory available for stack
+#define STACK_SIZE (64*1024)
+/// Default memory size. As the stack is placed in the end, be sure to allocate enough space for both program and stack
+#define MEM_SIZE (1024*1024)
+/// Memory of that size or more is reserved with mmap and committed page by page on the first touch
+#define MEM_LAZY_SIZE (64*1024)
+/// Page size where the system doesn't tell it
+#define MEM_PAGE_SIZE 4096
+/// Dispatch engine: decodes every step and compares the code with every command (the original one)
+#define CPU_T_DISPATCH_CHAIN 0
+/// Dispatch engine: walks the decoded program, calling the handlers resolved at load time
+#define CPU_T_DISPATCH_TABLE 1
+/// Dispatch engine: walks the decoded program with computed goto (GCC and Clang only)
+#define CPU_T_DISPATCH_GOTO  2
+/// Dispatch engine used by cpu_t_run. Define it before including the header to choose another one
+#if !defined(CPU_T_DISPATCH)
+    #if defined(__GNUC__)
+        #define CPU_T_DISPATCH CPU_T_DISPATCH_GOTO
+    #else
+        #define CPU_T_DISPATCH CPU_T_DISPATCH_TABLE
+    #endif
+#elif CPU_T_DISPATCH == CPU_T_DISPATCH_GOTO && !defined(__GNUC__)
+    #error Computed goto dispatch requires GCC or Clang
+#endif
 /// More comfortable dump
 #define cpu_t_dump(This) cpu_t_dump_(This, #This)
+/// Validates cpu_t in the handlers, the verified programs run without it (see cpu_t_verify)
+#define CPU_T_ASSERT_OK(This) do{ if (!(This)->is_verified){ ASSERT_OK(cpu_t, This) } } while (0)
 /// More comfortable dump
 #define memory_t_dump(This) memory_t_dump_(This, #This)
 
@@ -35,6 +65,9 @@
 
 typedef struct cpu_t cpu_t;
 typedef struct memory_t memory_t;
+typedef struct insn_t insn_t;
+typedef struct cpu_t_jit cpu_t_jit;
+typedef struct cpu_t_io cpu_t_io;
 
 /**
 @brief Memory controller emulation
@@ -48,17 +81,53 @@ struct memory_t
     unsigned size;
     char* base;
 
+    bool is_mapped; /**< true if the storage is reserved with mmap, false if allocated */
     bool is_valid;
+
+    int segment_fd; /**< File with the copy of the program that other memories map (see memory_t_share), -1 if none */
+    unsigned segment_size; /**< Size of the program mapped from the file of another memory (see memory_t_map_segment) */
 };
 
-void memory_t_erase (memory_t* this)
+void memory_t_unmap_segment (memory_t* this);
+bool memory_t_map_file (memory_t* this, int fd, unsigned nbytes);
+
+/**
+*@brief Fills the first nbytes of the memory with zeros.
+*
+*Whole pages of the mapped memory are given back to the system instead, so they
+*are zero again on the next touch and are not committed until then.
+*/
+void memory_t_erase (memory_t* this, unsigned nbytes)
 {
-    memset(this->storage, 0, this->max_size - STACK_SIZE);
+    #if defined(__unix__)
+    // The pages of the mapped program would come back as the program, not as zeros
+    memory_t_unmap_segment (this);
+    if (this->is_mapped){
+        unsigned pages = nbytes / (unsigned)sysconf(_SC_PAGESIZE) * (unsigned)sysconf(_SC_PAGESIZE);
+        if (pages && !madvise(this->storage, pages, MADV_DONTNEED)){
+            memset(this->storage + pages, 0, nbytes - pages);
+            return;
+        }
+    }
+    #endif
+    memset(this->storage, 0, nbytes);
 }
 void memory_t_destruct (memory_t* this)
 {
+    #if defined(__unix__)
+    if (this->storage && this->is_mapped)
+        munmap (this->storage, this->max_size);
+    else
+    #endif
     if (this->storage)
         free (this->storage);
+    #if defined(__unix__)
+    if (this->segment_fd >= 0)
+        close (this->segment_fd);
+    #endif
+    this->segment_fd = -1;
+    this->segment_size = 0;
+    this->is_mapped = false;
     this->storage = NULL;
     this->size = UINT_MAX; // Poison
     this->max_size = UINT_MAX; // Poison
@@ -68,14 +137,29 @@ void memory_t_destruct (memory_t* this)
 
 bool memory_t_construct (memory_t* this, unsigned memory_size)
 {
-    this->storage = (char*)calloc(memory_size, 1);
+    this->storage = NULL;
+    this->is_mapped = false;
+    this->segment_fd = -1;
+    this->segment_size = 0;
+    #if defined(__unix__)
+    // Only the address space is reserved, so the large memory costs nothing until it is used
+    if (memory_size >= MEM_LAZY_SIZE){
+        void* storage = mmap(NULL, memory_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (storage != MAP_FAILED){
+            this->storage = (char*)storage;
+            this->is_mapped = true;
+        }
+    }
+    #endif
+    if (!this->storage)
+        this->storage = (char*)calloc(memory_size, 1);
     if (!this->storage){
         printf ("memory_t_construct: Can't allocate memory!\n");
         memory_t_destruct (this);
 
         return false;
     }
-    this->max_size = MEM_SIZE;
+    this->max_size = memory_size;
     this->size = 0;
     this->base = this->storage; // The first free byte
     this->is_valid = true;
@@ -134,6 +218,115 @@ unsigned memory_t_reserve (memory_t* this, unsigned nbytes)
     return (address);
 }
 
+/**
+*@brief Saves the first nbytes of the memory to the file that other memories can map.
+*
+*The memories that map the file (see memory_t_map_segment) share its pages until they write to them,
+*so the code is stored once and only the written pages of the data are copied.
+*@return true if success, false if the system can't create the file.
+*/
+bool memory_t_share (memory_t* this, unsigned nbytes)
+{
+    #if defined(__unix__) && defined(SYS_memfd_create)
+    if (this->segment_fd >= 0)
+        close (this->segment_fd);
+    this->segment_fd = (int)syscall (SYS_memfd_create, "memory_t", 0);
+    if (this->segment_fd < 0)
+        return false;
+    unsigned written = 0;
+    while (written < nbytes){
+        ssize_t result = write (this->segment_fd, this->storage + written, nbytes - written);
+        if (result <= 0){
+            close (this->segment_fd);
+            this->segment_fd = -1;
+            return false;
+        }
+        written += result;
+    }
+    return true;
+    #else
+    (void)nbytes;
+    return false;
+    #endif
+}
+
+/**
+*@brief Maps the first nbytes of the file of other (see memory_t_share) to the beginning of this memory copy-on-write.
+*@return true if success, false if the memory must be copied instead.
+*/
+bool memory_t_map_segment (memory_t* this, const memory_t* other, unsigned nbytes)
+{
+    return memory_t_map_file (this, other->segment_fd, nbytes);
+}
+
+/**
+*@brief Maps the first nbytes of the file to the beginning of this memory copy-on-write.
+*
+*Pages that are already there are dropped, so the cost depends on the pages touched
+*before and after the call, not on nbytes.
+*@return true if success, false if the memory must be copied instead.
+*/
+bool memory_t_map_file (memory_t* this, int fd, unsigned nbytes)
+{
+    #if defined(__unix__)
+    unsigned page = (unsigned)sysconf(_SC_PAGESIZE);
+    unsigned size = (nbytes + page - 1) / page * page;
+    if (!this->is_mapped || fd < 0 || !nbytes || size > this->max_size)
+        return false;
+    memory_t_unmap_segment (this);
+    void* segment = mmap(this->storage, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0);
+    if (segment == MAP_FAILED)
+        return false;
+    this->segment_size = size;
+    return true;
+    #else
+    (void)fd;
+    (void)nbytes;
+    return false;
+    #endif
+}
+
+/**
+*@brief Makes the first nbytes of the memory equal to data, page by page.
+*
+*Only the pages that differ are written, so the equal pages of the mapped memory
+*are neither copied nor committed. Every page is compared, so it costs O(nbytes):
+*the written pages aren't tracked, as the native code of the JIT stores to the memory directly.
+*@return Number of the written pages.
+*/
+unsigned memory_t_copy_pages (memory_t* this, const char data[], unsigned nbytes)
+{
+    ASSERT_OK(memory_t, this);
+    assert (nbytes <= this->max_size);
+    unsigned page = MEM_PAGE_SIZE;
+    #if defined(__unix__)
+    page = (unsigned)sysconf(_SC_PAGESIZE);
+    #endif
+    unsigned copied = 0;
+    for (unsigned address = 0; address < nbytes; address += page){
+        unsigned size = (nbytes - address < page)? nbytes - address : page;
+        if (memcmp(this->storage + address, data + address, size)){
+            memcpy(this->storage + address, data + address, size);
+            copied++;
+        }
+    }
+    return copied;
+}
+
+/**
+*@brief Replaces the mapped program with the zeroed memory.
+*/
+void memory_t_unmap_segment (memory_t* this)
+{
+    #if defined(__unix__)
+    if (!this->segment_size)
+        return;
+    if (mmap(this->storage, this->segment_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED)
+        memset(this->storage, 0, this->segment_size);
+    this->segment_size = 0;
+    #endif
+}
+
 bool memory_t_write (memory_t* this, unsigned address, const void* data, unsigned nbytes)
 {
     ASSERT_OK(memory_t, this);
@@ -185,29 +378,195 @@ Processor is a structure that containes a stack and a register to operate with.
 struct cpu_t
 {
     bool is_debug;
+    bool is_halted; /**< true if the program has reached stop */
     char flags; /** Flags register is separated from the main purpose registers */
     stack_t stack;/**< Operating stack. */
     char registers[REG_SIZE * REG_NUMBER];/**< Registers of the processor*/
     unsigned position; /** Instruction pointer (current instruction address in memory)  */
     memory_t memory; /** The memory controller interface emulation */
 
+    insn_t* code; /**< Decoded program. Two extra records follow it: end of the program and bad address */
+    unsigned code_size; /**< Number of decoded instructions */
+    unsigned* map; /**< Index of the decoded instruction for every address of the program, UINT_MAX if none */
+    unsigned program_size; /**< Size of the loaded program in bytes */
+    unsigned pc; /**< Index of the next instruction in the decoded program */
+    bool is_code_shared; /**< true if the decoded program belongs to another cpu_t (see cpu_t_load_shared) */
+    bool is_verified; /**< true if the program is proved safe and runs without the checks (see cpu_t_verify) */
+    cpu_t_jit* jit; /**< Native code of the hot regions (see cpu_t_run_tiered), NULL if not used */
+    cpu_t_io* io; /**< Headless input and output (see cpu_t_set_io), NULL if interactive */
+
     bool state;/**< State of the cpu_t. true if ON, false if OFF. */
 };
 
+/**
+@brief Headless input and output.
+
+Values are read and written without prompts and colours through the buffers,
+so a long series of them costs a few read(2) and write(2) calls.
+*/
+struct cpu_t_io
+{
+    stream_t input; /**< Input of in, fin and cin */
+    stream_t output; /**< Output of out, fout and cout */
+    bool is_binary; /**< true if the values are read and written as they are in memory (4 bytes for int and float, 1 for char) */
+};
+
+/**
+@brief Saved state of cpu_t.
+
+Keeps the registers, the flags, the position, the stack and the image of the whole memory,
+so any number of cpu_t can start from the same point (see cpu_t_restore).
+The image lives in the file that the memories map copy-on-write where the system allows it.
+*/
+typedef struct cpu_t_snapshot cpu_t_snapshot;
+struct cpu_t_snapshot
+{
+    char registers[REG_SIZE * REG_NUMBER]; /**< Registers of the processor */
+    char flags; /**< Flags register */
+    bool is_halted; /**< true if the program has reached stop */
+    unsigned position; /**< Address of the next instruction */
+    unsigned pc; /**< Index of the next instruction in the decoded program */
+    unsigned stack_size; /**< Number of bytes in the stack */
+    unsigned stack_max_size; /**< Size of the stack in the end of the memory */
+    unsigned memory_size; /**< Size of the whole memory */
+    unsigned program_size; /**< Size of the loaded program in bytes */
+    char* memory; /**< Image of the whole memory */
+    int fd; /**< File with the image (see memory_t_map_file), -1 if the image is allocated */
+};
+
+/// Version of the snapshot file format
+#define CPU_T_SNAPSHOT_VERSION 1
+/// Pages of the snapshot file: only the pages with non-zero bytes are stored
+#define CPU_T_SNAPSHOT_PAGE 4096
+
+/**
+@brief Beginning of the snapshot file.
+
+It is followed by the stored pages: the index of the page and CPU_T_SNAPSHOT_PAGE bytes of it
+(less for the last page of the memory).
+*/
+typedef struct cpu_t_snapshot_header cpu_t_snapshot_header;
+struct cpu_t_snapshot_header
+{
+    char magic[4]; /**< "SPSN" */
+    unsigned version;
+    unsigned memory_size;
+    unsigned stack_max_size;
+    unsigned stack_size;
+    unsigned program_size;
+    unsigned position;
+    unsigned pc;
+    unsigned pages; /**< Number of the stored pages */
+    char flags;
+    bool is_halted;
+    char registers[REG_SIZE * REG_NUMBER];
+};
+
+/// Handler of a single instruction
+typedef bool (*cpu_t_handler) (cpu_t* This, const insn_t* insn);
+
+/**
+@brief Decoded instruction.
+
+Instructions are decoded once when the program is loaded, so the handlers
+get their operands ready and don't read the memory.
+*/
+struct insn_t
+{
+    cpu_t_handler handler; /**< Function that executes the instruction */
+    unsigned char code; /**< Instruction code (CPU_T_FUSED_BASE and above for the superinstructions) */
+    unsigned char reg; /**< Register offset (push_reg and pop_reg) */
+    bool keep_flags; /**< Superinstructions only: false if the flags they set are never read */
+    union
+    {
+        int i;
+        float f;
+        char c;
+        unsigned u;
+        char bytes[sizeof(unsigned)];
+    } imm; /**< Immediate value, memory address or branch target address */
+    unsigned target; /**< Index of the branch target in the decoded program */
+    unsigned address; /**< Address of the instruction */
+    unsigned next; /**< Address of the next instruction */
+};
+
+/**
+@brief Entry of the dispatch table.
+
+Describes how to execute the instruction with the given code.
+*/
+typedef struct cpu_t_command cpu_t_command;
+struct cpu_t_command
+{
+    cpu_t_handler handler; /**< Function that executes the instruction, NULL for unknown codes */
+    const char* name; /**< Mnemonic of the instruction (for the debug output) */
+};
+
+/// Dispatch table, indexed by the instruction code
+extern const cpu_t_command CPU_T_COMMANDS[256];
+
+/// Codes of the superinstructions start here (above any code of commands.h)
+#define CPU_T_FUSED_BASE 0x80
+
+/// Indices of the superinstructions
+enum CPU_T_FUSED
+{
+    #define FUSE(name, length, code_1, code_2, code_3, code_4) \
+    fused_ ## name,
+    #include "fusions.h"
+    #undef FUSE
+    CPU_T_FUSED_NUMBER
+};
+
+/**
+@brief Superinstruction pattern.
+
+Sequence of instructions that is executed by one handler.
+*/
+typedef struct cpu_t_fusion cpu_t_fusion;
+struct cpu_t_fusion
+{
+    unsigned char codes[4]; /**< Codes of the fused instructions */
+    unsigned length; /**< Number of the fused instructions */
+    const char* name; /**< Name of the superinstruction (for the report) */
+};
+
+/// Patterns of the superinstructions, indexed by CPU_T_FUSED
+const cpu_t_fusion CPU_T_FUSIONS[CPU_T_FUSED_NUMBER] =
+{
+    #define FUSE(name, length, code_1, code_2, code_3, code_4) \
+    {{code_1, code_2, code_3, code_4}, length, #name},
+    #include "fusions.h"
+    #undef FUSE
+};
+
 /**
 *@brief Standard cpu_t constructor.
 *
-*Constructs cpu_t with empty stack and register.
+*Constructs cpu_t with empty stack and register, MEM_SIZE bytes of memory and STACK_SIZE bytes of stack.
 *@param This Pointer to the cpu_t to be constructed.
 *@return 1 (true) if success, 0 (false) otherwise.
-*@todo Dynamic memory management, so its OK that only true is returned by now.
 */
 bool cpu_t_construct (cpu_t* This);
 
+/**
+*@brief Constructs cpu_t with the given memory layout.
+*
+*The program is loaded to the beginning of the memory, the stack takes its end and grows down.
+*Large memory is committed lazily (see memory_t_construct), so the stack grows in place without
+*any copying and only the touched pages are really used.
+*@param This Pointer to the cpu_t to be constructed.
+*@param memory_size Size of the whole memory in bytes, addresses are 32-bit.
+*@param stack_size Size of the stack in bytes, must be less than memory_size.
+*@return true if success, false otherwise.
+*/
+bool cpu_t_construct_size (cpu_t* This, unsigned memory_size, unsigned stack_size);
+
 /**
 *@brief Copy cpu_t constructor.
 *
-*Constructs cpu_t as copy of other. Writes to errno.
+*Constructs cpu_t as copy of other: the memory, the stack, the registers, the position and
+*the decoded program. The native code and the headless input and output are not copied.
 *@param This Pointer to the cpu_t to be constructed.
 *@param other The cpu_t to copy from.
 *@return 1 (true) if success, 0 (false) otherwise.
@@ -222,6 +581,109 @@ bool cpu_t_construct_copy (cpu_t* This, const cpu_t* other);
 */
 void cpu_t_destruct (cpu_t* This);
 
+/**
+*@brief Frees the native code of the hot regions.
+*/
+void cpu_t_jit_destruct (cpu_t* This);
+
+/**
+*@brief Turns on the headless input and output.
+*
+*The descriptors aren't closed by cpu_t. The output is written when the buffer is full,
+*when the program stops and when cpu_t is destructed (see cpu_t_flush_io).
+*@param This Pointer to the cpu_t to perform operation on.
+*@param in_fd Descriptor to read the input from.
+*@param out_fd Descriptor to write the output to.
+*@param is_binary true if the values are read and written without text formatting.
+*@return true if success, false otherwise.
+*/
+bool cpu_t_set_io (cpu_t* This, int in_fd, int out_fd, bool is_binary);
+
+/**
+*@brief Writes the buffered output of the headless mode.
+*@return true if success or the mode is off, false otherwise.
+*/
+bool cpu_t_flush_io (cpu_t* This);
+
+/**
+*@brief Flushes the output and turns the headless mode off.
+*/
+void cpu_t_io_destruct (cpu_t* This);
+
+/**
+*@brief Executes the loaded program with the dispatch engine chosen by CPU_T_DISPATCH.
+*@param This Pointer to the cpu_t to perform operation on.
+*@return true if no error has occured, false otherwise. In case of fail invalidates cpu_t.
+*/
+bool cpu_t_run (cpu_t* This);
+
+/**
+*@brief Runs the program with cpu_t_run until it reaches the instruction at the address.
+*
+*The instruction isn't executed, so the state can be saved (see cpu_t_snapshot_construct)
+*and the run continued later from the same point. The instruction must not be a part of a superinstruction.
+*@param This Pointer to the cpu_t with the loaded (not shared) program.
+*@param address Address of the instruction to stop at.
+*@return true if the address is reached, false if the program has stopped earlier or failed.
+*/
+bool cpu_t_run_to (cpu_t* This, unsigned address);
+
+/**
+*@brief Saves the state of cpu_t.
+*
+*Takes the registers, the flags, the position, the stack and the memory. The decoded program,
+*the native code and the headless input and output are not saved.
+*@param This Pointer to the snapshot to be constructed.
+*@param cpu The cpu_t to save.
+*@return true if success, false otherwise.
+*/
+bool cpu_t_snapshot_construct (cpu_t_snapshot* This, const cpu_t* cpu);
+
+/**
+*@brief Reads the snapshot saved by cpu_t_snapshot_save.
+*@return true if success, false if the file can't be read or is corrupted.
+*/
+bool cpu_t_snapshot_construct_filename (cpu_t_snapshot* This, const char filename[]);
+
+/**
+*@brief Destructs the snapshot.
+*/
+void cpu_t_snapshot_destruct (cpu_t_snapshot* This);
+
+/**
+*@brief Validates the snapshot.
+*/
+bool cpu_t_snapshot_OK (const cpu_t_snapshot* This);
+
+/**
+*@brief Prints snapshot's dump.
+*/
+void cpu_t_snapshot_dump_ (const cpu_t_snapshot* This, const char name[]);
+
+/// More comfortable dump
+#define cpu_t_snapshot_dump(This) cpu_t_snapshot_dump_(This, #This)
+
+/**
+*@brief Writes the snapshot to the file, the pages of zeros are skipped.
+*@return true if success, false otherwise.
+*/
+bool cpu_t_snapshot_save (const cpu_t_snapshot* This, const char filename[]);
+
+/**
+*@brief Puts cpu_t to the saved state.
+*
+*The memory is mapped from the image copy-on-write, so the restore costs only the pages
+*written since the last one. Where the image can't be mapped, the whole memory is compared with it
+*page by page (O(memory), see memory_t_copy_pages) and only the differing pages are copied.
+*The decoded program is kept if its size matches, so the same program must be loaded
+*(or shared, see cpu_t_load_shared); otherwise it is decoded from the restored memory.
+*The headless input and output are kept as they are.
+*@param This Pointer to the cpu_t with the same memory and stack sizes.
+*@param snapshot The saved state.
+*@return true if success, false otherwise.
+*/
+bool cpu_t_restore (cpu_t* This, const cpu_t_snapshot* snapshot);
+
 /**
 *@brief Validates the cpu_t.
 *
@@ -247,7 +709,7 @@ void cpu_t_dump_ (const cpu_t* This, const char name[]);
 *@param value The value to be put is the stack.
 *@return true if success, false otherwise.
 */
-bool cpu_t_push (cpu_t* This);
+bool cpu_t_push (cpu_t* This, const insn_t* insn);
 
 /**
 *@brief Pushes variable to cpu_t stack.
@@ -257,7 +719,7 @@ bool cpu_t_push (cpu_t* This);
 *@param registerN Register to read the value from.
 *@return true if success, false otherwise.
 */
-bool cpu_t_push_reg (cpu_t* This);
+bool cpu_t_push_reg (cpu_t* This, const insn_t* insn);
 
 /**
 *@brief Pops value from the stack.
@@ -268,7 +730,7 @@ bool cpu_t_push_reg (cpu_t* This);
 *@return true if success, false otherwise. In case it wasn't successful, invalidates cpu_t.
 *@warning Stack must contain at least one element.
 */
-bool cpu_t_pop_reg (cpu_t* This);
+bool cpu_t_pop_reg (cpu_t* This, const insn_t* insn);
 
 /**
 *@brief Summs the top two elements of the stack.
@@ -279,7 +741,7 @@ bool cpu_t_pop_reg (cpu_t* This);
 *@return true if success, false otherwise. In case of fail invalidates cpu_t.
 *@warning Stack must contain at least two elements.
 */
-bool cpu_t_add (cpu_t* This);
+bool cpu_t_add (cpu_t* This, const insn_t* insn);
 
 /**
 *@brief Subtracts the penult stack element from the top one.
@@ -290,7 +752,7 @@ bool cpu_t_add (cpu_t* This);
 *@return true if success, false otherwise. In case of fail invalidates cpu_t.
 *@warning Stack must contain at least two elements.
 */
-bool cpu_t_sub (cpu_t* This);
+bool cpu_t_sub (cpu_t* This, const insn_t* insn);
 
 /**
 *@brief Multiplies the top two elements of the stack.
@@ -301,7 +763,7 @@ bool cpu_t_sub (cpu_t* This);
 *@return true if success, false otherwise. In case of fail invalidates cpu_t.
 *@warning Stack must contain at least two elements.
 */
-bool cpu_t_mul (cpu_t* This);
+bool cpu_t_mul (cpu_t* This, const insn_t* insn);
 
 /**
 *@brief Divides the top stack element by the previous.
@@ -312,7 +774,7 @@ bool cpu_t_mul (cpu_t* This);
 *@return true if success, false otherwise. In case of fail invalidates cpu_t.
 *@warning Stack must contain at least two elements.
 */
-bool cpu_t_div (cpu_t* This);
+bool cpu_t_div (cpu_t* This, const insn_t* insn);
 
 /**
 *@brief Raise the top element in the power of the penult one.
@@ -323,7 +785,7 @@ bool cpu_t_div (cpu_t* This);
 *@return true if success, false otherwise. In case of fail invalidates cpu_t.
 *@warning Stack must contain at least two elements.
 */
-bool cpu_t_pow (cpu_t* This);
+bool cpu_t_pow (cpu_t* This, const insn_t* insn);
 
 /**
 *@brief Executes the given program.
@@ -334,7 +796,7 @@ bool cpu_t_pow (cpu_t* This);
 *@return true if no error has occured, false otherwise. In case of fail invalidates cpu_t.
 *@warning End of the program must be marked with 'end' code. Undefined behaviour otherwise.
 */
-bool cpu_t_execute (cpu_t* This);
+bool cpu_t_execute (cpu_t* This, const insn_t* insn);
 
 /**
 *@brief Prints the top stack element.
@@ -342,7 +804,7 @@ bool cpu_t_execute (cpu_t* This);
 *@param This Pointer to the cpu_t to perform operation on.
 *@return true if no error has occured, false otherwise. In case of fail invalidates cpu_t.
 */
-bool cpu_t_out (cpu_t* This);
+bool cpu_t_out (cpu_t* This, const insn_t* insn);
 
 /**
 *@brief Scans value and puts it to the top of the stack
@@ -350,17 +812,14 @@ bool cpu_t_out (cpu_t* This);
 *@param This Pointer to the cpu_t to perform operation on.
 *@return true if no error has occured, false otherwise. In case of fail invalidates cpu_t.
 */
-bool cpu_t_in (cpu_t* This);
+bool cpu_t_in (cpu_t* This, const insn_t* insn);
 
-bool cpu_t_jmp (cpu_t* This)
+bool cpu_t_jmp (cpu_t* This, const insn_t* insn)
 {
-    ASSERT_OK(cpu_t, This);
-    This->position++;
-    //printf ("This position is: %u\n", This->position);
-    unsigned new_position = *(unsigned*)(This->memory.storage + This->position);
-    //printf ("New position is: %u\n", new_position);
-    This->position = new_position;
-    //printf ("jmp %d\n", new_position);
+    CPU_T_ASSERT_OK(This);
+    This->position = insn->imm.u;
+    This->pc = insn->target;
+    //printf ("jmp %d\n", This->position);
 
     return true;
 }
@@ -369,16 +828,17 @@ bool cpu_t_jmp (cpu_t* This)
 // Some magic: (This->flags & (0xFF ^ 0x3)) resets last 2 bits of flags (cmp flags)
 // Then we can set them again with (This->flags | FLAG)
 #define CMP(_name, _type) \
-bool cpu_t_ ## _name (cpu_t* This) \
+bool cpu_t_ ## _name (cpu_t* This, const insn_t* insn) \
 { \
-    ASSERT_OK(cpu_t, This); \
-    _type top = 0, prev = 0; \
-    if (!stack_t_pop(&This->stack, &top, sizeof(_type)) || !stack_t_pop(&This->stack, &prev, sizeof(_type))){ \
+    CPU_T_ASSERT_OK(This); \
+    if (!stack_t_can_pop(&This->stack, 2*sizeof(_type))){ \
         cpu_t_destruct(This); \
-        ASSERT_OK(cpu_t, This); \
+        CPU_T_ASSERT_OK(This); \
         return false; \
     } \
     else{ \
+        _type top = stack_t_take_ ## _type(&This->stack); \
+        _type prev = stack_t_take_ ## _type(&This->stack); \
         *(unsigned*)(This->registers+ESP) += 2*sizeof(_type);\
         This->flags &= (0xFF ^ 0x3);\
         if (top < prev){ \
@@ -390,7 +850,7 @@ bool cpu_t_ ## _name (cpu_t* This) \
             /*printf ("ZRO_FLAG is set!\n");*/\
         }\
         /*printf ("Flags: %02X\n", This->flags);*/\
-        ASSERT_OK(cpu_t, This); \
+        CPU_T_ASSERT_OK(This); \
         return true; \
     } \
 }
@@ -400,23 +860,18 @@ CMP (fcmp, float)
 CMP (ccmp, char)
 
 #define CON_JUMP(_name, _flags1, _flags2) \
-bool cpu_t_ ## _name (cpu_t* This)\
+bool cpu_t_ ## _name (cpu_t* This, const insn_t* insn)\
 {\
-    ASSERT_OK(cpu_t, This);\
-    This->position++;\
-    unsigned new_position = *(unsigned*)(This->memory.storage + This->position);\
-    assert (new_position < This->memory.max_size); \
+    CPU_T_ASSERT_OK(This);\
+    assert (insn->imm.u < This->memory.max_size); \
     \
     /*printf ("(?) %02X == %02X, %02X\n", This->flags, _flags1, _flags2);*/\
     if (!((This->flags & 0x3) ^ _flags1) | !((This->flags & 0x3) ^ _flags2)){\
-        This->position = new_position;\
-        /*printf ("jmp %d\n", new_position);*/\
-    }\
-    else{\
-        This->position += sizeof(unsigned);\
-        /*printf ("jmp ++\n");*/\
+        This->position = insn->imm.u;\
+        This->pc = insn->target;\
+        /*printf ("jmp %d\n", This->position);*/\
     }\
-    ASSERT_OK(cpu_t, This);\
+    CPU_T_ASSERT_OK(This);\
     return true;\
 }
 
@@ -427,63 +882,70 @@ CON_JUMP (jbe, NEG_FLAG, ZRO_FLAG)
 CON_JUMP (je,  ZRO_FLAG, ZRO_FLAG)
 CON_JUMP (jne, NEG_FLAG, NO_FLAG)
 
-bool cpu_t_call(cpu_t* This)
+bool cpu_t_call(cpu_t* This, const insn_t* insn)
 {
-    ASSERT_OK(cpu_t, This);
-    This->position++;
-    int new_position = *(unsigned*)(This->memory.storage+ This->position);
-    This->position += sizeof(unsigned);
-    if (!stack_t_push (&This->stack, &This->position, sizeof (unsigned)))
+    CPU_T_ASSERT_OK(This);
+    // The return address (This->position) already points to the next instruction
+    if (!stack_t_push_dword (&This->stack, &This->position))
         return false;
-    This->position = new_position;
+    This->position = insn->imm.u;
+    This->pc = insn->target;
     *(unsigned*)(This->registers+ESP) -= sizeof(unsigned);
-    //printf ("call %d\n", new_position);
+    //printf ("call %d\n", This->position);
     return true;
 }
 
-bool cpu_t_err(cpu_t* This)
+bool cpu_t_err(cpu_t* This, const insn_t* insn)
 {
     (void)This;
+    (void)insn;
     printf (ANSI_COLOR_RED "*BEEP-BEEP*"ANSI_COLOR_RESET"[program is corrupted]\n");
     return false;
 }
 
-bool cpu_t_ret(cpu_t* This)
+unsigned cpu_t_find_insn (const cpu_t* This, unsigned address);
+
+bool cpu_t_ret(cpu_t* This, const insn_t* insn)
 {
-    ASSERT_OK(cpu_t, This);
+    CPU_T_ASSERT_OK(This);
+    (void)insn;
     unsigned ret_position = 0;
-    if (!stack_t_pop (&This->stack, &ret_position, sizeof(unsigned)))
+    if (!stack_t_pop_dword (&This->stack, &ret_position))
         return false;
     *(unsigned*)(This->registers+ESP) += sizeof(unsigned);
     This->position = ret_position;
+    This->pc = cpu_t_find_insn (This, ret_position);
     //printf ("ret %d\n", (int)ret_position);
     return true;
 }
-bool cpu_t_stop(cpu_t* This)
+bool cpu_t_stop(cpu_t* This, const insn_t* insn)
 {
-    (void)This;
-    This->memory.storage[This->position] = 0;
+    This->position = insn->address;
+    This->pc = This->code_size;
+    This->is_halted = true;
+    cpu_t_flush_io(This);
     printf (ANSI_COLOR_RED"*BEEP*"ANSI_COLOR_RESET"[reached the end of the program]\n");
     return true;
 }
 // Overloaded
-bool cpu_t_pop(cpu_t* This)
+bool cpu_t_pop(cpu_t* This, const insn_t* insn)
 {
     (void)This;
+    (void)insn;
     return false;
 }
 
 #define POP_MEM(_name, _size) \
-bool cpu_t_pop_mem_ ## _name(cpu_t* This)\
+bool cpu_t_pop_mem_ ## _name(cpu_t* This, const insn_t* insn)\
 {\
-    ASSERT_OK(cpu_t, This);\
-    This->position++;\
-    unsigned address = *(unsigned*)(This->memory.storage+ This->position);\
-    This->position += sizeof (unsigned);\
+    CPU_T_ASSERT_OK(This);\
     char top[_size];\
-    if (!stack_t_pop(&This->stack, top, _size))\
+    if (!stack_t_pop_ ## _name(&This->stack, top))\
         return false;\
-    if (!memory_t_write(&This->memory, address, top, _size))\
+    /* The address of the verified program is known to be in the memory */\
+    if (This->is_verified)\
+        memcpy (This->memory.storage + insn->imm.u, top, _size);\
+    else if (!memory_t_write(&This->memory, insn->imm.u, top, _size))\
         return false;\
     *(unsigned*)(This->registers+ESP) += _size;\
     return true;\
@@ -494,19 +956,18 @@ bool cpu_t_pop_mem_ ## _name(cpu_t* This)\
 #undef VAR
 
 #define PUSH_MEM(_name, _size) \
-bool cpu_t_push_mem_ ## _name(cpu_t* This) \
+bool cpu_t_push_mem_ ## _name(cpu_t* This, const insn_t* insn) \
 {\
-    ASSERT_OK(cpu_t, This);\
-    This->position++;\
-    unsigned address = *(unsigned*)(This->memory.storage+ This->position);\
-    This->position += sizeof(unsigned);\
+    CPU_T_ASSERT_OK(This);\
     char data[_size];\
-    if (!memory_t_read (&This->memory, address, data, _size))\
+    if (This->is_verified)\
+        memcpy (data, This->memory.storage + insn->imm.u, _size);\
+    else if (!memory_t_read (&This->memory, insn->imm.u, data, _size))\
         return false;\
-    if (!stack_t_push(&This->stack, data, _size))\
+    if (!stack_t_push_ ## _name(&This->stack, data))\
         return false;\
     *(unsigned*)(This->registers+ESP) -= _size;\
-    ASSERT_OK(cpu_t, This);\
+    CPU_T_ASSERT_OK(This);\
     return true;\
 }
 
@@ -515,21 +976,27 @@ bool cpu_t_push_mem_ ## _name(cpu_t* This) \
 #undef VAR
 
 
-bool cpu_t_load_program (cpu_t* This, const buffer_t* program)
-{
-    memory_t_erase(&This->memory);
-    COMMENT ("Loading program...");
-    if (!memory_t_write(&This->memory, 0, program->data, program->size))
-        return false;
-    This->position = 0;
-    COMMENT ("Running...");
-    return true;
-}
-
-bool cpu_t_construct (cpu_t* This)
+bool cpu_t_construct_size (cpu_t* This, unsigned memory_size, unsigned stack_size)
 {
     assert (This);
-    if (!memory_t_construct(&This->memory, MEM_SIZE)){
+    This->code = NULL;
+    This->map = NULL;
+    This->jit = NULL;
+    This->io = NULL;
+    This->is_code_shared = false;
+    This->is_verified = false;
+    This->code_size = 0;
+    This->program_size = 0;
+    This->pc = 0;
+    This->is_halted = false;
+    if (stack_size < sizeof(unsigned) || stack_size >= memory_size){
+        printf (ANSI_COLOR_RED "*BEEP-BEEP*"ANSI_COLOR_RESET"[stack of %u bytes doesn't fit into memory of %u bytes]\n", stack_size, memory_size);
+        This->memory.storage = NULL;
+        This->memory.segment_fd = -1;
+        cpu_t_destruct(This);
+        return false;
+    }
+    if (!memory_t_construct(&This->memory, memory_size)){
         cpu_t_destruct(This);
         return false;
     }
@@ -538,7 +1005,7 @@ bool cpu_t_construct (cpu_t* This)
     This->is_debug = false;
     memset (This->registers, 0, REG_SIZE * REG_NUMBER);
     This->position = 0;
-    if (!stack_t_construct_no_alloc(&This->stack, This->memory.storage + This->memory.max_size - STACK_SIZE, STACK_SIZE)){
+    if (!stack_t_construct_no_alloc(&This->stack, This->memory.storage + This->memory.max_size - stack_size, stack_size)){
         cpu_t_destruct(This);
         return false;
     }
@@ -548,25 +1015,41 @@ bool cpu_t_construct (cpu_t* This)
     return true;
 }
 
+bool cpu_t_construct (cpu_t* This)
+{
+    return cpu_t_construct_size (This, MEM_SIZE, STACK_SIZE);
+}
+
 bool cpu_t_construct_copy(cpu_t* This, const cpu_t* other)
 {
     assert (This);
     ASSERT_OK(cpu_t, other);
-    This->position = other->position;
-    memcpy (This->registers, other->registers, REG_SIZE * REG_NUMBER);
-    if (!memory_t_construct(&This->memory, other->memory.max_size)){
-        cpu_t_destruct(This);
+    if (!cpu_t_construct_size(This, other->memory.max_size, other->stack.max_size))
         return false;
-    }
-    memory_t_reserve(&This->memory, This->memory.max_size);
-    if (!stack_t_construct_no_alloc(&This->stack, This->memory.storage, other->stack.size)){
-        cpu_t_destruct(This);
-        return false;
-    }
+    // The untouched pages of the mapped memory are zeros in both, so they stay untouched
+    memory_t_copy_pages(&This->memory, other->memory.storage, other->memory.max_size);
+    This->stack.size = other->stack.size;
+    This->stack.top = This->stack.data + This->stack.max_size - 1 - This->stack.size;
+    memcpy (This->registers, other->registers, REG_SIZE * REG_NUMBER);
+    This->position = other->position;
     This->is_debug = other->is_debug;
+    This->is_halted = other->is_halted;
     This->flags = other->flags;
-    This->state = true;
-    printf (ANSI_COLOR_RED"*BEEP*"ANSI_COLOR_RESET"[processor was turned ON]\n");
+    if (other->code){
+        This->code = (insn_t*)malloc ((other->code_size + 2) * sizeof(insn_t));
+        This->map = (unsigned*)malloc ((other->program_size + 1) * sizeof(unsigned));
+        if (!This->code || !This->map){
+            printf ("cpu_t_construct_copy: Can't allocate memory!\n");
+            cpu_t_destruct(This);
+            return false;
+        }
+        memcpy (This->code, other->code, (other->code_size + 2) * sizeof(insn_t));
+        memcpy (This->map, other->map, (other->program_size + 1) * sizeof(unsigned));
+        This->code_size = other->code_size;
+        This->program_size = other->program_size;
+        This->pc = other->pc;
+        This->is_verified = other->is_verified;
+    }
     return true;
 }
 
@@ -577,12 +1060,60 @@ void cpu_t_destruct (cpu_t* This)
     memset (This->registers, 0, REG_SIZE * REG_NUMBER);
     This->flags = 0;
     This->is_debug = false;
+    cpu_t_jit_destruct(This);
+    cpu_t_io_destruct(This);
     stack_t_destruct_no_alloc(&This->stack);
     memory_t_destruct(&This->memory);
+    if (!This->is_code_shared){
+        free (This->code);
+        free (This->map);
+    }
+    This->code = NULL;
+    This->map = NULL;
+    This->is_code_shared = false;
+    This->is_verified = false;
+    This->code_size = 0;
+    This->pc = 0;
     This->state = false;
     printf (ANSI_COLOR_RED"*BEEP*"ANSI_COLOR_RESET"[processor was turned OFF]\n");
 }
 
+bool cpu_t_set_io (cpu_t* This, int in_fd, int out_fd, bool is_binary)
+{
+    assert (This);
+    cpu_t_io_destruct(This);
+    This->io = (cpu_t_io*)calloc (1, sizeof(cpu_t_io));
+    if (!This->io){
+        printf ("cpu_t_set_io: Can't allocate memory!\n");
+        return false;
+    }
+    This->io->is_binary = is_binary;
+    if (!stream_t_construct(&This->io->input, in_fd, STREAM_SIZE) ||
+        !stream_t_construct(&This->io->output, out_fd, STREAM_SIZE)){
+        cpu_t_io_destruct(This);
+        return false;
+    }
+    return true;
+}
+
+bool cpu_t_flush_io (cpu_t* This)
+{
+    if (!This->io || !This->io->output.data)
+        return true;
+    return stream_t_flush(&This->io->output);
+}
+
+void cpu_t_io_destruct (cpu_t* This)
+{
+    if (!This->io)
+        return;
+    cpu_t_flush_io(This);
+    stream_t_destruct(&This->io->input);
+    stream_t_destruct(&This->io->output);
+    free (This->io);
+    This->io = NULL;
+}
+
 bool cpu_t_OK (const cpu_t* This)
 {
     assert (This);
@@ -613,19 +1144,19 @@ void cpu_t_dump_ (const cpu_t* This, const char name[])
     printf(ANSI_COLOR_YELLOW "-----------------------------------------------------" ANSI_COLOR_RESET "\n");
     DUMP_INDENT -= INDENT_VALUE;
 }
-bool cpu_t_debug (const cpu_t* This)
+bool cpu_t_debug (cpu_t* This, const insn_t* insn)
 {
-    // Breaking const qualifier to save the logic of the program
-    ASSERT_OK(cpu_t, This);
-    ((cpu_t*)This)->is_debug = true;
+    (void)insn;
+    CPU_T_ASSERT_OK(This);
+    This->is_debug = true;
     return true;
 }
 
-bool cpu_t_ndebug (const cpu_t* This)
+bool cpu_t_ndebug (cpu_t* This, const insn_t* insn)
 {
-    // Breaking const qualifier to save the logic of the program
-    ASSERT_OK(cpu_t, This);
-    ((cpu_t*)This)->is_debug = false;
+    (void)insn;
+    CPU_T_ASSERT_OK(This);
+    This->is_debug = false;
     return true;
 }
 
@@ -649,41 +1180,39 @@ void cpu_t_show_info (const cpu_t* This)
     DUMP_INDENT -= INDENT_VALUE;
 }
 
-bool cpu_t_push (cpu_t* This)
+bool cpu_t_push (cpu_t* This, const insn_t* insn)
 {
     (void)This;
+    (void)insn;
     return false;
 }
 
-#define PUSH_NUM(_type)\
-bool cpu_t_push_ ## _type (cpu_t* This)\
+#define PUSH_NUM(_type, _var)\
+bool cpu_t_push_ ## _type (cpu_t* This, const insn_t* insn)\
 {\
-    ASSERT_OK(cpu_t, This);\
-    This->position ++;\
-    char* data = This->memory.storage + This->position;\
-    This->position += sizeof(_type);\
-\
-    if (!stack_t_push(&This->stack, data, sizeof(_type))){\
+    CPU_T_ASSERT_OK(This);\
+    if (!stack_t_push_ ## _var(&This->stack, insn->imm.bytes)){\
         cpu_t_destruct(This);\
         return false;\
     }\
     *(unsigned*)(This->registers+ESP) -= sizeof(_type);\
-    ASSERT_OK(cpu_t, This);\
+    CPU_T_ASSERT_OK(This);\
     return true;\
 }
 
-PUSH_NUM(int)
-PUSH_NUM(float)
-PUSH_NUM(char)
+PUSH_NUM(int, dword)
+PUSH_NUM(float, dword)
+PUSH_NUM(char, byte)
 
 #define DUP(_name, _nbytes)\
-bool cpu_t_ ## _name ## dup (cpu_t* This)\
+bool cpu_t_ ## _name ## dup (cpu_t* This, const insn_t* insn)\
 {\
-    ASSERT_OK(cpu_t, This);\
-    if (!stack_t_push(&This->stack, This->stack.top + 1, _nbytes)){\
+    CPU_T_ASSERT_OK(This);\
+    if (!stack_t_can_pop(&This->stack, _nbytes) || !stack_t_can_push(&This->stack, _nbytes)){\
         cpu_t_destruct(This);\
         return false;\
     }\
+    stack_t_put_ ## _name(&This->stack, This->stack.top + 1);\
     *(unsigned*)(This->registers+ESP) -= _nbytes;\
     return true;\
 }
@@ -693,13 +1222,16 @@ bool cpu_t_ ## _name ## dup (cpu_t* This)\
 #undef VAR
 
 #define DUPD(_name, _nbytes)\
-bool cpu_t_ ## _name ## dupd (cpu_t* This)\
+bool cpu_t_ ## _name ## dupd (cpu_t* This, const insn_t* insn)\
 {\
-    ASSERT_OK(cpu_t, This);\
-    if (!stack_t_push(&This->stack, This->stack.top + 1, 2*_nbytes)){\
+    CPU_T_ASSERT_OK(This);\
+    if (!stack_t_can_pop(&This->stack, 2*_nbytes) || !stack_t_can_push(&This->stack, 2*_nbytes)){\
         cpu_t_destruct(This);\
         return false;\
     }\
+    /* The second element is copied first, then the first one moves to its place */\
+    stack_t_put_ ## _name(&This->stack, This->stack.top + 1 + _nbytes);\
+    stack_t_put_ ## _name(&This->stack, This->stack.top + 1 + _nbytes);\
     *(unsigned*)(This->registers+ESP) -= 2*_nbytes;\
     return true;\
 }
@@ -709,20 +1241,16 @@ bool cpu_t_ ## _name ## dupd (cpu_t* This)\
 #undef VAR
 
 #define PUSH_REG(_name, _nbytes) \
-bool cpu_t_push_reg_ ## _name (cpu_t* This)\
+bool cpu_t_push_reg_ ## _name (cpu_t* This, const insn_t* insn)\
 {\
-    ASSERT_OK(cpu_t, This);\
-    This->position ++;\
-    char address = This->memory.storage[This->position];\
-    This->position ++;\
-\
-    char* data = This->registers + address;\
-    if (!stack_t_push(&This->stack, data, _nbytes)){\
+    CPU_T_ASSERT_OK(This);\
+    char* data = This->registers + insn->reg;\
+    if (!stack_t_push_ ## _name(&This->stack, data)){\
         cpu_t_destruct(This);\
         return false;\
     }\
     *(unsigned*)(This->registers+ESP) -= _nbytes;\
-    ASSERT_OK(cpu_t, This);\
+    CPU_T_ASSERT_OK(This);\
     return true;\
 }
 
@@ -731,20 +1259,16 @@ bool cpu_t_push_reg_ ## _name (cpu_t* This)\
 #undef VAR
 
 #define POP_REG(_name, _nbytes) \
-bool cpu_t_pop_reg_ ## _name (cpu_t* This)\
+bool cpu_t_pop_reg_ ## _name (cpu_t* This, const insn_t* insn)\
 {\
-    ASSERT_OK(cpu_t, This);\
-    This->position ++;\
-    char address = This->memory.storage[This->position];\
-    This->position ++;\
-\
-    char* data = This->registers + address;\
-    if (!stack_t_pop(&This->stack, data, _nbytes)){\
+    CPU_T_ASSERT_OK(This);\
+    char* data = This->registers + insn->reg;\
+    if (!stack_t_pop_ ## _name(&This->stack, data)){\
         cpu_t_destruct(This);\
         return false;\
     }\
     *(unsigned*)(This->registers+ESP) += _nbytes;\
-    ASSERT_OK(cpu_t, This);\
+    CPU_T_ASSERT_OK(This);\
     return true;\
 }
 
@@ -753,25 +1277,21 @@ bool cpu_t_pop_reg_ ## _name (cpu_t* This)\
 #undef VAR
 
 #define ARITHM(_name, _op, _type) \
-bool cpu_t_ ## _name (cpu_t* This) \
+bool cpu_t_ ## _name (cpu_t* This, const insn_t* insn) \
 { \
-    ASSERT_OK(cpu_t, This); \
-    _type a = 0, b = 0, res = 0; \
-    \
-    if (!stack_t_pop(&This->stack, &a, sizeof(_type))){ \
-        cpu_t_destruct(This); \
-        ASSERT_OK(cpu_t, This); \
-        return false; \
-    } \
-    if (!stack_t_pop(&This->stack, &b, sizeof(_type))){ \
+    CPU_T_ASSERT_OK(This); \
+    /* Two operands are popped and the result takes place of one of them */ \
+    if (!stack_t_can_pop(&This->stack, 2*sizeof(_type))){ \
         cpu_t_destruct(This); \
-        ASSERT_OK(cpu_t, This); \
+        CPU_T_ASSERT_OK(This); \
         return false; \
     } \
-    res = a _op b; \
+    _type a = stack_t_take_ ## _type(&This->stack); \
+    _type b = stack_t_take_ ## _type(&This->stack); \
+    stack_t_put_ ## _type(&This->stack, a _op b); \
     *(unsigned*)(This->registers+ESP) += sizeof(_type);\
-    ASSERT_OK(cpu_t, This); \
-    return stack_t_push(&This->stack, &res, sizeof(_type)); \
+    CPU_T_ASSERT_OK(This); \
+    return true; \
 }
 
 ARITHM(add, +, int)
@@ -785,18 +1305,23 @@ ARITHM(fmul, *, float)
 ARITHM(fdiv, /, float)
 
 #define OUT(_name, _type, _spec) \
-bool cpu_t_ ## _name(cpu_t* This)\
+bool cpu_t_ ## _name(cpu_t* This, const insn_t* insn)\
 {\
-    ASSERT_OK(cpu_t, This);\
-    _type top = 0;\
-    if (!stack_t_pop(&This->stack, &top, sizeof(_type))){\
+    CPU_T_ASSERT_OK(This);\
+    if (!stack_t_can_pop(&This->stack, sizeof(_type))){\
         cpu_t_destruct(This);\
-        ASSERT_OK(cpu_t, This);\
+        CPU_T_ASSERT_OK(This);\
         return false;\
     }\
-    printf (ANSI_COLOR_YELLOW "OUT" ANSI_COLOR_GREEN "[" #_type "]"ANSI_COLOR_YELLOW">" ANSI_COLOR_RESET _spec "\n", top);\
+    _type top = stack_t_take_ ## _type(&This->stack);\
+    if (!This->io)\
+        printf (ANSI_COLOR_YELLOW "OUT" ANSI_COLOR_GREEN "[" #_type "]"ANSI_COLOR_YELLOW">" ANSI_COLOR_RESET _spec "\n", top);\
+    else if (This->io->is_binary)\
+        stream_t_write(&This->io->output, &top, sizeof(_type));\
+    else\
+        stream_t_print_ ## _type(&This->io->output, top);\
     *(unsigned*)(This->registers+ESP) += sizeof(_type);\
-    ASSERT_OK(cpu_t, This);\
+    CPU_T_ASSERT_OK(This);\
     return true;\
 }
 
@@ -805,22 +1330,17 @@ OUT(fout, float, "%g")
 OUT(cout, char , "%c")
 
 #define ABS(_name, _type) \
-bool cpu_t_ ## _name(cpu_t* This)\
+bool cpu_t_ ## _name(cpu_t* This, const insn_t* insn)\
 {\
-    ASSERT_OK(cpu_t, This);\
-    _type top = 0;\
-    if (!stack_t_pop(&This->stack, &top, sizeof(_type))){\
+    CPU_T_ASSERT_OK(This);\
+    if (!stack_t_can_pop(&This->stack, sizeof(_type))){\
         cpu_t_destruct(This);\
-        ASSERT_OK(cpu_t, This);\
+        CPU_T_ASSERT_OK(This);\
         return false;\
     }\
-    _type res = (_type)fabs((float)top);\
-    if (!stack_t_push(&This->stack, &res, sizeof(_type))){\
-        cpu_t_destruct(This);\
-        ASSERT_OK(cpu_t, This);\
-        return false;\
-    }\
-    ASSERT_OK(cpu_t, This);\
+    _type top = stack_t_take_ ## _type(&This->stack);\
+    stack_t_put_ ## _type(&This->stack, (_type)fabs((float)top));\
+    CPU_T_ASSERT_OK(This);\
     return true;\
 }
 
@@ -828,62 +1348,1873 @@ ABS(fabs, float)
 ABS(abs, int)
 
 #define IN(_name, _type, _spec) \
-bool cpu_t_ ## _name (cpu_t* This)\
+bool cpu_t_ ## _name (cpu_t* This, const insn_t* insn)\
 {\
-    ASSERT_OK(cpu_t, This);\
+    CPU_T_ASSERT_OK(This);\
     _type input = 0;\
+    bool is_read = false;\
 \
-    printf (ANSI_COLOR_YELLOW "IN" ANSI_COLOR_GREEN "[" #_type "]" ANSI_COLOR_YELLOW ">" ANSI_COLOR_RESET);\
-    if (!scanf (_spec, &input))\
+    if (!This->io){\
+        printf (ANSI_COLOR_YELLOW "IN" ANSI_COLOR_GREEN "[" #_type "]" ANSI_COLOR_YELLOW ">" ANSI_COLOR_RESET);\
+        is_read = scanf (_spec, &input) != 0;\
+    }\
+    else if (This->io->is_binary)\
+        is_read = stream_t_read(&This->io->input, &input, sizeof(_type));\
+    else\
+        is_read = stream_t_scan_ ## _type(&This->io->input, &input);\
+    if (!is_read)\
         printf (ANSI_COLOR_RED "*BEEP-BEEP-BEEP*" ANSI_COLOR_RESET "[scanning error]\n");\
-    if (!stack_t_push(&This->stack, &input, sizeof(_type))){\
+    if (!stack_t_can_push(&This->stack, sizeof(_type))){\
         cpu_t_destruct(This);\
-        ASSERT_OK(cpu_t, This);\
+        CPU_T_ASSERT_OK(This);\
         return false;\
     }\
+    stack_t_put_ ## _type(&This->stack, input);\
     *(unsigned*)(This->registers+ESP) -= sizeof(_type);\
-    ASSERT_OK(cpu_t, This);\
+    CPU_T_ASSERT_OK(This);\
     return true;\
 }\
 
 IN(in, int, "%d")
 IN(fin, float, "%f")
 IN(cin, char , "%c")
-// TODO: all functions are written in processor, we are only calling them
-//from define of each CMD_INFO with right argument
-bool cpu_t_run (cpu_t* This)
+//^^^^^^^^^^^^^^^^^^^^^^^^
+// SUPERINSTRUCTIONS
+//^^^^^^^^^^^^^^^^^^^^^^^^
+// The records of the fused instructions stay in the decoded program after the first one,
+// so the handler of the superinstruction reads their operands from insn[1], insn[2]...
+
+/// Moves to the instruction that follows the last of the fused ones
+#define FUSED_END(_length) \
+    This->position = insn[(_length) - 1].next;\
+    This->pc += (_length) - 1;
+
+/**
+*@brief Executes the fused instructions one by one.
+*
+*The slow path of the superinstructions: used when the stack can't hold the operands,
+*so the errors are reported exactly by the same instruction as without the fusion.
+*@param This Pointer to the cpu_t to perform operation on.
+*@param insn The first of the fused instructions.
+*@return true if no error has occured, false otherwise.
+*/
+bool cpu_t_fused_parts (cpu_t* This, const insn_t* insn)
 {
-    if (!This->state){
-        printf (ANSI_COLOR_RED "*BEEP-BEEP*"ANSI_COLOR_RESET"[cpu is corrupted]\n");
-        return false;
+    const cpu_t_fusion* fusion = CPU_T_FUSIONS + (insn->code - CPU_T_FUSED_BASE);
+    unsigned first = This->pc - 1;
+    for (unsigned i = 0; i < fusion->length; i++){
+        This->position = insn[i].next;
+        This->pc = first + i + 1;
+        if (!CPU_T_COMMANDS[fusion->codes[i]].handler (This, insn + i))
+            return false;
+        // A jump was taken
+        if (This->pc != first + i + 1)
+            return true;
     }
-    while (This->memory.storage[This->position])
-    {
-        bool is_done = false;
-        if (This->is_debug) printf("\n[%u] ", This->position);
-        #define CMD(name, key, shift, arguments) \
-        if (!is_done && This->memory.storage[This->position] == key){\
-            if (This->is_debug) printf (#name "\n");\
-            if (!cpu_t_ ## name (This))\
-                return false;\
-            This->position += shift;\
-            is_done = true;\
-        }
-        #include "commands.h"
-        #undef CMD
-        if (This->is_debug && !is_done){
-            printf ("cpu_t_run: Command is not recognized!\n");
-        }
-        if (This->is_debug){
-            cpu_t_show_info (This);
-            getchar();
+    return true;
+}
+
+#define FUSED_PUSH_INT_ARITHM(_name, _op) \
+bool cpu_t_fused_ ## _name (cpu_t* This, const insn_t* insn)\
+{\
+    CPU_T_ASSERT_OK(This);\
+    if (This->stack.size < sizeof(int))\
+        return cpu_t_fused_parts (This, insn);\
+    int b = 0;\
+    memcpy (&b, This->stack.top + 1, sizeof(int));\
+    int res = insn->imm.i _op b;\
+    memcpy (This->stack.top + 1, &res, sizeof(int));\
+    FUSED_END(2)\
+    return true;\
+}
+
+FUSED_PUSH_INT_ARITHM(push_int_add, +)
+FUSED_PUSH_INT_ARITHM(push_int_sub, -)
+
+bool cpu_t_fused_push_int_pop_reg (cpu_t* This, const insn_t* insn)
+{
+    CPU_T_ASSERT_OK(This);
+    if (This->stack.size + sizeof(int) > This->stack.max_size)
+        return cpu_t_fused_parts (This, insn);
+    memcpy (This->registers + insn[1].reg, insn->imm.bytes, sizeof(int));
+    FUSED_END(2)
+    return true;
+}
+
+bool cpu_t_fused_push_reg_pop_reg (cpu_t* This, const insn_t* insn)
+{
+    CPU_T_ASSERT_OK(This);
+    if (This->stack.size + sizeof(int) > This->stack.max_size)
+        return cpu_t_fused_parts (This, insn);
+    memmove (This->registers + insn[1].reg, This->registers + insn->reg, sizeof(int));
+    FUSED_END(2)
+    return true;
+}
+
+bool cpu_t_fused_push_reg_push_reg_add_pop_reg (cpu_t* This, const insn_t* insn)
+{
+    CPU_T_ASSERT_OK(This);
+    if (This->stack.size + 2*sizeof(int) > This->stack.max_size)
+        return cpu_t_fused_parts (This, insn);
+    int a = 0, b = 0;
+    memcpy (&b, This->registers + insn[0].reg, sizeof(int));
+    memcpy (&a, This->registers + insn[1].reg, sizeof(int));
+    int res = a + b;
+    memcpy (This->registers + insn[3].reg, &res, sizeof(int));
+    FUSED_END(4)
+    return true;
+}
+
+bool cpu_t_fused_dworddup_push_int_je (cpu_t* This, const insn_t* insn)
+{
+    CPU_T_ASSERT_OK(This);
+    if (This->stack.size < sizeof(int) || This->stack.size + 2*sizeof(int) > This->stack.max_size)
+        return cpu_t_fused_parts (This, insn);
+    stack_t_put_dword (&This->stack, This->stack.top + 1);
+    stack_t_put_dword (&This->stack, insn[1].imm.bytes);
+    *(unsigned*)(This->registers+ESP) -= 2*sizeof(int);
+    if ((This->flags & 0x3) == ZRO_FLAG){
+        This->position = insn[2].imm.u;
+        This->pc = insn[2].target;
+    }
+    else{
+        FUSED_END(3)
+    }
+    return true;
+}
+
+// Compares the top two elements and jumps without the round trip through the flags register.
+// The flags are still written if somebody may read them later (see cpu_t_fuse)
+#define FUSED_CMP_JUMP(_cmp, _type, _jump, _flags1, _flags2) \
+bool cpu_t_fused_ ## _cmp ## _ ## _jump (cpu_t* This, const insn_t* insn)\
+{\
+    CPU_T_ASSERT_OK(This);\
+    if (This->stack.size < 2*sizeof(_type))\
+        return cpu_t_fused_parts (This, insn);\
+    _type top = stack_t_take_ ## _type(&This->stack);\
+    _type prev = stack_t_take_ ## _type(&This->stack);\
+    *(unsigned*)(This->registers+ESP) += 2*sizeof(_type);\
+    char flags = ((top < prev)? NEG_FLAG : NO_FLAG) | ((top == prev)? ZRO_FLAG : NO_FLAG);\
+    if (insn->keep_flags)\
+        This->flags = (This->flags & (0xFF ^ 0x3)) | flags;\
+    if (flags == _flags1 || flags == _flags2){\
+        This->position = insn[1].imm.u;\
+        This->pc = insn[1].target;\
+    }\
+    else{\
+        FUSED_END(2)\
+    }\
+    return true;\
+}
+
+#define FUSED_CMP(_cmp, _type) \
+FUSED_CMP_JUMP(_cmp, _type, ja,  NO_FLAG,  NO_FLAG)\
+FUSED_CMP_JUMP(_cmp, _type, jae, NO_FLAG,  ZRO_FLAG)\
+FUSED_CMP_JUMP(_cmp, _type, jb,  NEG_FLAG, NEG_FLAG)\
+FUSED_CMP_JUMP(_cmp, _type, jbe, NEG_FLAG, ZRO_FLAG)\
+FUSED_CMP_JUMP(_cmp, _type, je,  ZRO_FLAG, ZRO_FLAG)\
+FUSED_CMP_JUMP(_cmp, _type, jne, NEG_FLAG, NO_FLAG)
+
+FUSED_CMP(cmp, int)
+FUSED_CMP(fcmp, float)
+
+const cpu_t_command CPU_T_COMMANDS[256] =
+{
+    #define CMD(name, key, shift, arguments, pops, pushes) \
+    [key] = {cpu_t_ ## name, #name},
+    #include "commands.h"
+    #undef CMD
+    #define FUSE(name, length, code_1, code_2, code_3, code_4) \
+    [CPU_T_FUSED_BASE + fused_ ## name] = {cpu_t_fused_ ## name, #name},
+    #include "fusions.h"
+    #undef FUSE
+};
+
+/**
+*@brief Finishes the step of the execution.
+*
+*Shows the debug info if needed and checks the instruction pointer.
+*@param This Pointer to the cpu_t to perform operation on.
+*@return true if the execution may be continued, false otherwise. In case of fail invalidates cpu_t.
+*/
+bool cpu_t_step_end (cpu_t* This)
+{
+    if (This->is_debug){
+        cpu_t_show_info (This);
+        getchar();
+    }
+    if (This->position >= This->memory.max_size){
+        printf (ANSI_COLOR_RED "*BEEP-BEEP*"ANSI_COLOR_RESET"[instruction address is out of range]\n");
+        This->state = false;
+        return false;
+    }
+    return true;
+}
+
+/**
+*@brief Reports the instruction that can't be executed.
+*
+*@param This Pointer to the cpu_t to perform operation on.
+*@param insn The instruction.
+*@return false. Invalidates cpu_t.
+*/
+bool cpu_t_unknown (cpu_t* This, const insn_t* insn)
+{
+    printf (ANSI_COLOR_RED "*BEEP-BEEP*"ANSI_COLOR_RESET"[unknown instruction %02X at %u]\n",
+            (unsigned)insn->code, insn->address);
+    This->state = false;
+    return false;
+}
+
+/**
+*@brief Decodes one instruction.
+*
+*Reads the instruction code and its operand from the memory. The branch target index is not resolved.
+*@param This Pointer to the cpu_t to read the memory of.
+*@param address Address of the instruction.
+*@param insn The record to be filled.
+*@return true if the instruction is known and fits into the memory, false otherwise.
+*/
+bool cpu_t_decode_insn (const cpu_t* This, unsigned address, insn_t* insn)
+{
+    assert (This);
+    assert (insn);
+    const char* storage = This->memory.storage;
+    insn->code = (unsigned char)storage[address];
+    insn->handler = CPU_T_COMMANDS[insn->code].handler;
+    insn->reg = 0;
+    insn->imm.u = 0;
+    insn->target = UINT_MAX;
+    insn->address = address;
+
+    unsigned operand = 0;
+    switch (insn->code)
+    {
+    case cmd_push_int:
+    case cmd_push_float:
+    case cmd_push_mem_byte:
+    case cmd_push_mem_word:
+    case cmd_push_mem_dword:
+    case cmd_pop_mem_byte:
+    case cmd_pop_mem_word:
+    case cmd_pop_mem_dword:
+    case cmd_ja:
+    case cmd_jae:
+    case cmd_jb:
+    case cmd_jbe:
+    case cmd_je:
+    case cmd_jne:
+    case cmd_jmp:
+    case cmd_call:
+        operand = sizeof(unsigned);
+        break;
+    case cmd_push_char:
+    case cmd_push_reg_byte:
+    case cmd_push_reg_word:
+    case cmd_push_reg_dword:
+    case cmd_pop_reg_byte:
+    case cmd_pop_reg_word:
+    case cmd_pop_reg_dword:
+        operand = sizeof(char);
+        break;
+    }
+    insn->next = address + 1 + operand;
+    if (!insn->handler || insn->next > This->memory.max_size || insn->next <= address){
+        insn->handler = cpu_t_unknown;
+        insn->next = address + 1;
+        return false;
+    }
+    // The operand may be unaligned, so it is copied
+    memcpy (insn->imm.bytes, storage + address + 1, operand);
+    if (operand == sizeof(char))
+        insn->reg = (unsigned char)insn->imm.c;
+
+    return true;
+}
+
+/**
+*@brief Finds the decoded instruction with the given address.
+*
+*@param This Pointer to the cpu_t with the decoded program.
+*@param address Address of the instruction.
+*@return Index of the instruction. Index of the end-of-program record if the address is out of the program
+*and the memory there is empty, index of the bad address record otherwise.
+*/
+unsigned cpu_t_find_insn (const cpu_t* This, unsigned address)
+{
+    if (address < This->program_size && This->map[address] != UINT_MAX)
+        return This->map[address];
+    if (address >= This->program_size && address < This->memory.max_size && !This->memory.storage[address])
+        return This->code_size;
+    return This->code_size + 1;
+}
+
+/**
+*@brief Decodes the loaded program.
+*
+*The first instruction must be the jump to the entry point, the data section lies between them.
+*The code section is decoded up to the end of the program, then the branch targets are resolved.
+*@param This Pointer to the cpu_t with the loaded program.
+*@param size Size of the program in bytes.
+*@return true if success, false otherwise.
+*@warning The program must not modify its own code, as it won't be decoded again.
+*/
+bool cpu_t_decode_program (cpu_t* This, unsigned size)
+{
+    assert (This);
+    if (!This->is_code_shared){
+        free (This->code);
+        free (This->map);
+    }
+    This->is_code_shared = false;
+    This->is_verified = false;
+    This->code_size = 0;
+    This->program_size = size;
+    // Every byte may be the beginning of an instruction; two records are reserved for the special ones
+    This->code = (insn_t*)calloc (size + 2, sizeof(insn_t));
+    This->map = (unsigned*)malloc ((size + 1) * sizeof(unsigned));
+    if (!This->code || !This->map){
+        printf ("cpu_t_decode_program: Can't allocate memory!\n");
+        return false;
+    }
+    memset (This->map, 0xFF, (size + 1) * sizeof(unsigned));
+
+    unsigned address = 0;
+    while (address < size){
+        insn_t* insn = This->code + This->code_size;
+        cpu_t_decode_insn (This, address, insn);
+        This->map[address] = This->code_size++;
+        // Skipping the data section
+        address = (address == 0 && insn->code == cmd_jmp && insn->imm.u > insn->next && insn->imm.u < size)? insn->imm.u : insn->next;
+    }
+    // End of the program: behaves like the zero code in memory
+    insn_t* end = This->code + This->code_size;
+    end->code = 0;
+    end->address = end->next = size;
+    end->handler = cpu_t_unknown;
+    end->target = UINT_MAX;
+    // Jump to the middle of an instruction or into the data
+    insn_t* bad = end + 1;
+    bad->code = cmd_err;
+    bad->address = bad->next = size;
+    bad->handler = cpu_t_err;
+    bad->target = UINT_MAX;
+
+    for (unsigned i = 0; i < This->code_size; i++){
+        insn_t* insn = This->code + i;
+        if (insn->code == cmd_call || (insn->code >= cmd_ja && insn->code <= cmd_jmp))
+            insn->target = cpu_t_find_insn (This, insn->imm.u);
+    }
+    This->pc = 0;
+
+    return true;
+}
+
+/**
+*@brief Gets the original code of the decoded instruction.
+*
+*@param insn The instruction, may be the first one of a superinstruction.
+*@return Code from commands.h.
+*/
+unsigned char cpu_t_insn_code (const insn_t* insn)
+{
+    if (insn->code >= CPU_T_FUSED_BASE)
+        return CPU_T_FUSIONS[insn->code - CPU_T_FUSED_BASE].codes[0];
+    return insn->code;
+}
+
+/// Depth of the stack at the instruction that isn't reached yet
+#define CPU_T_NO_DEPTH INT_MIN
+
+/**
+@brief Effect of the function on the stack, found by cpu_t_verify.
+
+The depths are counted in bytes from the depth at the entry, where the return address is on the top.
+*/
+typedef struct cpu_t_function cpu_t_function;
+struct cpu_t_function
+{
+    char state; /**< 0 if not verified yet, 1 while being verified, 2 if verified */
+    int low; /**< Lowest depth: the arguments of the caller are below zero */
+    int high; /**< Highest depth */
+    int exit; /**< Depth after ret */
+};
+
+/// State of cpu_t_verify
+typedef struct cpu_t_verifier cpu_t_verifier;
+struct cpu_t_verifier
+{
+    const cpu_t* cpu;
+    cpu_t_function* functions; /**< Effect of the function for every entry (call target) */
+    unsigned data_size; /**< The memory operands must be below it: the stack follows */
+    unsigned bad; /**< Index of the instruction that can't be proved safe, UINT_MAX if none */
+    const char* reason; /**< Why it can't */
+};
+
+// Follows every path from the entry, checking the instructions and the depths of the stack.
+// The effect of the function is saved to function. Returns false if something can't be proved
+bool cpu_t_verify_function (cpu_t_verifier* This, unsigned entry, bool is_main, cpu_t_function* function)
+{
+    const cpu_t* cpu = This->cpu;
+    int* depth = (int*)malloc ((cpu->code_size + 2) * sizeof(int));
+    unsigned* queue = (unsigned*)malloc ((cpu->code_size + 2) * sizeof(unsigned));
+    if (!depth || !queue){
+        free (depth);
+        free (queue);
+        This->bad = entry;
+        This->reason = "out of memory";
+        return false;
+    }
+    for (unsigned i = 0; i < cpu->code_size + 2; i++)
+        depth[i] = CPU_T_NO_DEPTH;
+    function->low = function->high = 0;
+    function->exit = CPU_T_NO_DEPTH;
+    unsigned queued = 0;
+    depth[entry] = 0;
+    queue[queued++] = entry;
+    // Every instruction is queued once: when it is reached for the first time
+    #define VERIFY_EDGE(_index, _depth) \
+        if (depth[_index] == CPU_T_NO_DEPTH){\
+            depth[_index] = (_depth);\
+            queue[queued++] = (_index);\
+        }\
+        else if (depth[_index] != (_depth)){\
+            This->bad = (_index);\
+            This->reason = "the depths of the stack differ at the merge point";\
+            break;\
+        }
+    #define VERIFY_FAIL(_reason) \
+        This->bad = i;\
+        This->reason = (_reason);\
+        break;
+    while (queued){
+        unsigned i = queue[--queued];
+        // The end of the program
+        if (i == cpu->code_size)
+            continue;
+        const insn_t* insn = cpu->code + i;
+        int d = depth[i];
+        unsigned char code = cpu_t_insn_code (insn);
+        unsigned pops = 0, pushes = 0;
+        // The next instruction must follow this one in the decoded program
+        unsigned next = (i + 1 < cpu->code_size && cpu->code[i + 1].address == insn->next)? i + 1 : cpu->code_size;
+        if (i > cpu->code_size || insn->handler == cpu_t_unknown || insn->handler == cpu_t_err){
+            VERIFY_FAIL("unknown instruction")
+        }
+        if (next == cpu->code_size && insn->next != cpu->program_size &&
+            code != cmd_jmp && code != cmd_ret && code != cmd_stop){
+            VERIFY_FAIL("the next instruction isn't decoded")
+        }
+        if (code == cmd_stop)
+            continue;
+        if (code == cmd_ret){
+            if (is_main){
+                VERIFY_FAIL("ret outside of the function")
+            }
+            if (function->exit != CPU_T_NO_DEPTH && function->exit != d - (int)sizeof(unsigned)){
+                VERIFY_FAIL("the function returns with different depths of the stack")
+            }
+            function->exit = d - (int)sizeof(unsigned);
+            if (function->exit < function->low)
+                function->low = function->exit;
+            continue;
+        }
+        if (code == cmd_call){
+            unsigned target = insn->target;
+            if (target >= cpu->code_size){
+                VERIFY_FAIL("call target isn't an instruction")
+            }
+            cpu_t_function* callee = This->functions + target;
+            if (callee->state == 1){
+                VERIFY_FAIL("recursive call: the depth of the stack can't be bounded")
+            }
+            if (!callee->state){
+                callee->state = 1;
+                if (!cpu_t_verify_function (This, target, false, callee))
+                    break;
+                callee->state = 2;
+            }
+            if (callee->exit == CPU_T_NO_DEPTH){
+                // The function never returns
+                if (d + (int)sizeof(unsigned) + callee->low < function->low)
+                    function->low = d + (int)sizeof(unsigned) + callee->low;
+                if (d + (int)sizeof(unsigned) + callee->high > function->high)
+                    function->high = d + (int)sizeof(unsigned) + callee->high;
+                continue;
+            }
+            if (d + (int)sizeof(unsigned) + callee->low < function->low)
+                function->low = d + (int)sizeof(unsigned) + callee->low;
+            if (d + (int)sizeof(unsigned) + callee->high > function->high)
+                function->high = d + (int)sizeof(unsigned) + callee->high;
+            VERIFY_EDGE(next, d + (int)sizeof(unsigned) + callee->exit)
+            continue;
+        }
+        if (code >= cmd_ja && code <= cmd_jmp){
+            if (insn->target > cpu->code_size){
+                VERIFY_FAIL("jump target isn't an instruction")
+            }
+            VERIFY_EDGE(insn->target, d)
+            if (code != cmd_jmp){
+                VERIFY_EDGE(next, d)
+            }
+            continue;
+        }
+        if (!command_stack_effect (code, &pops, &pushes)){
+            VERIFY_FAIL("unknown instruction")
+        }
+        switch (code)
+        {
+        #define VAR(_name, _nbytes) \
+        case cmd_push_mem_ ## _name:\
+        case cmd_pop_mem_ ## _name:\
+            if (insn->imm.u > This->data_size || This->data_size - insn->imm.u < _nbytes)\
+                pushes = UINT_MAX;\
+            break;\
+        case cmd_push_reg_ ## _name:\
+        case cmd_pop_reg_ ## _name:\
+            if (insn->reg + _nbytes > REG_SIZE * REG_NUMBER)\
+                pushes = UINT_MAX;\
+            break;
+        #include "var_sizes.h"
+        #undef VAR
+        }
+        if (pushes == UINT_MAX){
+            VERIFY_FAIL("operand is out of range")
+        }
+        if (d - (int)pops < function->low)
+            function->low = d - (int)pops;
+        d += (int)pushes - (int)pops;
+        if (d > function->high)
+            function->high = d;
+        VERIFY_EDGE(next, d)
+    }
+    #undef VERIFY_EDGE
+    #undef VERIFY_FAIL
+    bool is_ok = This->bad == UINT_MAX;
+    free (depth);
+    free (queue);
+    return is_ok;
+}
+
+/**
+*@brief Proves that the decoded program is safe and turns off the checks of the handlers.
+*
+*Every path from the entry is followed once: the codes must be known, the targets of the branches and
+*the calls must be instructions, the memory operands must lie below the stack and the depth of
+*the stack must be the same on all the paths that meet. The stack must never underflow or overflow,
+*so the recursive functions are not verified. The verified program runs without CPU_T_ASSERT_OK
+*and the bounds checks of the memory; the others run with all the checks.
+*The program is verified on load (see cpu_t_load_program).
+*@param This Pointer to the cpu_t with the decoded program.
+*@param is_verbose Print the reason if the program isn't verified.
+*@return true if the program is verified, false otherwise.
+*/
+bool cpu_t_verify (cpu_t* This, bool is_verbose)
+{
+    assert (This);
+    This->is_verified = false;
+    if (!This->code || !This->code_size)
+        return false;
+    cpu_t_verifier verifier = {This, NULL, This->memory.max_size - (unsigned)This->stack.max_size, UINT_MAX, NULL};
+    verifier.functions = (cpu_t_function*)calloc (This->code_size, sizeof(cpu_t_function));
+    if (!verifier.functions){
+        printf ("cpu_t_verify: Can't allocate memory!\n");
+        return false;
+    }
+    cpu_t_function program = {};
+    bool is_ok = cpu_t_verify_function (&verifier, 0, true, &program);
+    if (is_ok && (program.low < 0 || program.high > (int)This->stack.max_size)){
+        is_ok = false;
+        verifier.reason = (program.low < 0)? "the stack underflows" : "the stack overflows";
+    }
+    free (verifier.functions);
+    if (!is_ok && is_verbose){
+        if (verifier.bad < This->code_size)
+            printf ("#Program isn't verified: %s at %u\n", verifier.reason, This->code[verifier.bad].address);
+        else
+            printf ("#Program isn't verified: %s\n", verifier.reason);
+    }
+    This->is_verified = is_ok;
+    return is_ok;
+}
+
+/// Maximum number of instructions looked through to find out if the flags are read
+#define CPU_T_FLAGS_LOOKUP 32
+
+/**
+*@brief Checks if the flags may be read before they are overwritten.
+*
+*Follows the program from the given instruction until the flags are read or written.
+*@param This Pointer to the cpu_t with the decoded program.
+*@param index Index of the instruction to start from.
+*@return false if the flags are surely overwritten first, true otherwise.
+*/
+bool cpu_t_flags_live (const cpu_t* This, unsigned index)
+{
+    for (unsigned i = 0; i < CPU_T_FLAGS_LOOKUP && index < This->code_size; i++){
+        const insn_t* insn = This->code + index;
+        switch (cpu_t_insn_code (insn))
+        {
+        case cmd_cmp:
+        case cmd_fcmp:
+        case cmd_ccmp:
+            return false;
+        case cmd_jmp:
+            index = insn->target;
+            break;
+        case cmd_ja:
+        case cmd_jae:
+        case cmd_jb:
+        case cmd_jbe:
+        case cmd_je:
+        case cmd_jne:
+        case cmd_call:
+        case cmd_ret:
+        case cmd_stop:
+        case cmd_err:
+        case cmd_debug:
+            return true;
+        default:
+            index++;
+        }
+    }
+    return true;
+}
+
+/**
+*@brief Checks if the register can be used by a superinstruction.
+*
+*The register must be a whole dword that is not modified by the stack operations (ESP).
+*/
+bool cpu_t_fusable_reg (unsigned char reg)
+{
+    return reg + sizeof(int) <= REG_SIZE * REG_NUMBER && (reg + sizeof(int) <= ESP || reg >= ESP + REG_SIZE);
+}
+
+/**
+*@brief Replaces the common sequences of instructions with superinstructions.
+*
+*The patterns are listed in fusions.h. A sequence is not fused if any instruction
+*but the first one may be jumped to.
+*@param This Pointer to the cpu_t with the decoded program.
+*@param is_verbose Print the number of fused sites for every pattern.
+*@return Number of the fused sites.
+*/
+unsigned cpu_t_fuse (cpu_t* This, bool is_verbose)
+{
+    assert (This);
+    unsigned counters[CPU_T_FUSED_NUMBER] = {};
+    unsigned total = 0;
+    bool* is_target = (bool*)calloc (This->code_size + 2, sizeof(bool));
+    if (!is_target){
+        printf ("cpu_t_fuse: Can't allocate memory!\n");
+        return 0;
+    }
+    // Jump targets, return addresses and pushed addresses (they may be used by ret)
+    for (unsigned i = 0; i < This->code_size; i++){
+        const insn_t* insn = This->code + i;
+        if (insn->target != UINT_MAX)
+            is_target[insn->target] = true;
+        if (insn->code == cmd_call)
+            is_target[i + 1] = true;
+        if (insn->code == cmd_push_int)
+            is_target[cpu_t_find_insn (This, insn->imm.u)] = true;
+    }
+
+    for (unsigned i = 0; i < This->code_size; i++){
+        insn_t* insn = This->code + i;
+        for (unsigned f = 0; f < CPU_T_FUSED_NUMBER; f++){
+            const cpu_t_fusion* fusion = CPU_T_FUSIONS + f;
+            bool is_match = i + fusion->length <= This->code_size;
+            for (unsigned k = 0; is_match && k < fusion->length; k++){
+                unsigned char code = insn[k].code;
+                is_match = code == fusion->codes[k] && (k == 0 || !is_target[i + k]);
+                if (code == cmd_push_reg_dword || code == cmd_pop_reg_dword)
+                    is_match = is_match && cpu_t_fusable_reg (insn[k].reg);
+            }
+            if (!is_match)
+                continue;
+            const insn_t* last = insn + fusion->length - 1;
+            insn->keep_flags = last->target != UINT_MAX &&
+                               (cpu_t_flags_live (This, last->target) || cpu_t_flags_live (This, i + fusion->length));
+            insn->code = CPU_T_FUSED_BASE + f;
+            insn->handler = CPU_T_COMMANDS[insn->code].handler;
+            counters[f]++;
+            total++;
+            i += fusion->length - 1;
+            break;
+        }
+    }
+    free (is_target);
+
+    if (is_verbose){
+        printf ("#Superinstructions: %u sites fused\n", total);
+        for (unsigned f = 0; f < CPU_T_FUSED_NUMBER; f++)
+            if (counters[f])
+                printf ("#\t%-32s %u\n", CPU_T_FUSIONS[f].name, counters[f]);
+    }
+    return total;
+}
+
+bool cpu_t_load_program (cpu_t* This, const buffer_t* program)
+{
+    if (program->size > This->memory.max_size - This->stack.max_size){
+        printf (ANSI_COLOR_RED "*BEEP-BEEP*"ANSI_COLOR_RESET"[program of %lu bytes doesn't fit into memory, %u bytes are free]\n",
+                (unsigned long)program->size, (unsigned)(This->memory.max_size - This->stack.max_size));
+        return false;
+    }
+    memory_t_erase(&This->memory, This->memory.max_size - This->stack.max_size);
+    COMMENT ("Loading program...");
+    if (!memory_t_write(&This->memory, 0, program->data, program->size))
+        return false;
+    This->position = 0;
+    This->is_halted = false;
+    cpu_t_jit_destruct (This);
+    if (!cpu_t_decode_program (This, program->size))
+        return false;
+    cpu_t_verify (This, false);
+    COMMENT ("Running...");
+    return true;
+}
+
+/**
+*@brief Lets cpu_t_load_shared map the loaded program instead of copying it.
+*
+*The program is kept in the file shared by the memories of all the cpu_t loading it:
+*the code is never copied and the data is copied page by page when it is written.
+*@return true if success, false if the program will be copied (the system doesn't support it).
+*/
+bool cpu_t_share_program (cpu_t* This)
+{
+    return memory_t_share(&This->memory, This->program_size);
+}
+
+/**
+*@brief Loads the program of other without decoding it again.
+*
+*The decoded program of other is shared, so other must outlive This and must not load
+*another program or fuse while This runs. Only the bytes of the program are copied to the memory,
+*or mapped copy-on-write if other has shared them (see cpu_t_share_program).
+*@param This Pointer to the cpu_t to load the program to.
+*@param other The cpu_t with the loaded program.
+*@return true if success, false otherwise.
+*/
+bool cpu_t_load_shared (cpu_t* This, const cpu_t* other)
+{
+    if (other->program_size > This->memory.max_size - This->stack.max_size){
+        printf (ANSI_COLOR_RED "*BEEP-BEEP*"ANSI_COLOR_RESET"[program of %u bytes doesn't fit into memory, %u bytes are free]\n",
+                other->program_size, (unsigned)(This->memory.max_size - This->stack.max_size));
+        return false;
+    }
+    memory_t_erase(&This->memory, This->memory.max_size - This->stack.max_size);
+    if (!memory_t_map_segment(&This->memory, &other->memory, other->program_size) &&
+        !memory_t_write(&This->memory, 0, other->memory.storage, other->program_size))
+        return false;
+    This->position = 0;
+    This->is_halted = false;
+    cpu_t_jit_destruct (This);
+    if (!This->is_code_shared){
+        free (This->code);
+        free (This->map);
+    }
+    This->code = other->code;
+    This->map = other->map;
+    This->code_size = other->code_size;
+    This->program_size = other->program_size;
+    This->is_code_shared = true;
+    // The proof depends on the sizes of the memory and the stack
+    This->is_verified = other->is_verified && This->memory.max_size == other->memory.max_size &&
+                        This->stack.max_size == other->stack.max_size;
+    This->pc = 0;
+    return true;
+}
+
+/// Allocates the image of the memory of the snapshot
+bool cpu_t_snapshot_allocate (cpu_t_snapshot* This)
+{
+    This->memory = NULL;
+    This->fd = -1;
+    #if defined(__unix__) && defined(SYS_memfd_create)
+    // The file is sparse: the pages of zeros cost nothing until they are written
+    This->fd = (int)syscall (SYS_memfd_create, "cpu_t_snapshot", 0);
+    if (This->fd >= 0 && !ftruncate (This->fd, This->memory_size)){
+        void* memory = mmap (NULL, This->memory_size, PROT_READ | PROT_WRITE, MAP_SHARED, This->fd, 0);
+        if (memory != MAP_FAILED){
+            This->memory = (char*)memory;
+            return true;
+        }
+    }
+    if (This->fd >= 0)
+        close (This->fd);
+    This->fd = -1;
+    #endif
+    This->memory = (char*)calloc (This->memory_size, 1);
+    if (!This->memory){
+        printf ("cpu_t_snapshot_allocate: Can't allocate memory!\n");
+        return false;
+    }
+    return true;
+}
+
+/// Checks if the bytes are zeros
+bool cpu_t_snapshot_is_zero (const char data[], unsigned nbytes)
+{
+    return !nbytes || (!data[0] && !memcmp (data, data + 1, nbytes - 1));
+}
+
+bool cpu_t_snapshot_construct (cpu_t_snapshot* This, const cpu_t* cpu)
+{
+    assert (This);
+    ASSERT_OK(cpu_t, cpu);
+    memcpy (This->registers, cpu->registers, REG_SIZE * REG_NUMBER);
+    This->flags = cpu->flags;
+    This->is_halted = cpu->is_halted;
+    This->position = cpu->position;
+    This->pc = cpu->pc;
+    This->stack_size = (unsigned)cpu->stack.size;
+    This->stack_max_size = (unsigned)cpu->stack.max_size;
+    This->memory_size = cpu->memory.max_size;
+    This->program_size = cpu->program_size;
+    if (!cpu_t_snapshot_allocate (This))
+        return false;
+    // The pages of zeros are left as they are, so the untouched memory isn't copied
+    for (unsigned address = 0; address < This->memory_size; address += CPU_T_SNAPSHOT_PAGE){
+        unsigned size = (This->memory_size - address < CPU_T_SNAPSHOT_PAGE)? This->memory_size - address : CPU_T_SNAPSHOT_PAGE;
+        if (!cpu_t_snapshot_is_zero (cpu->memory.storage + address, size))
+            memcpy (This->memory + address, cpu->memory.storage + address, size);
+    }
+    return true;
+}
+
+bool cpu_t_snapshot_construct_filename (cpu_t_snapshot* This, const char filename[])
+{
+    assert (This);
+    This->memory = NULL;
+    This->fd = -1;
+    FILE* f = fopen (filename, "rb");
+    if (!f){
+        perror ("cpu_t_snapshot_construct_filename: (can't open file)");
+        return false;
+    }
+    cpu_t_snapshot_header header;
+    bool is_ok = fread (&header, sizeof(header), 1, f) == 1 &&
+                 !memcmp (header.magic, "SPSN", 4) &&
+                 header.version == CPU_T_SNAPSHOT_VERSION &&
+                 header.stack_max_size < header.memory_size &&
+                 header.stack_size <= header.stack_max_size &&
+                 header.program_size <= header.memory_size - header.stack_max_size &&
+                 header.pages <= (header.memory_size + CPU_T_SNAPSHOT_PAGE - 1) / CPU_T_SNAPSHOT_PAGE;
+    if (is_ok){
+        memcpy (This->registers, header.registers, REG_SIZE * REG_NUMBER);
+        This->flags = header.flags;
+        This->is_halted = header.is_halted;
+        This->position = header.position;
+        This->pc = header.pc;
+        This->stack_size = header.stack_size;
+        This->stack_max_size = header.stack_max_size;
+        This->memory_size = header.memory_size;
+        This->program_size = header.program_size;
+        is_ok = cpu_t_snapshot_allocate (This);
+    }
+    for (unsigned i = 0; is_ok && i < header.pages; i++){
+        unsigned page = 0;
+        is_ok = fread (&page, sizeof(page), 1, f) == 1 && page < (This->memory_size + CPU_T_SNAPSHOT_PAGE - 1) / CPU_T_SNAPSHOT_PAGE;
+        if (!is_ok)
+            break;
+        unsigned address = page * CPU_T_SNAPSHOT_PAGE;
+        unsigned size = (This->memory_size - address < CPU_T_SNAPSHOT_PAGE)? This->memory_size - address : CPU_T_SNAPSHOT_PAGE;
+        is_ok = fread (This->memory + address, 1, size, f) == size;
+    }
+    fclose (f);
+    if (!is_ok){
+        printf ("cpu_t_snapshot_construct_filename: Error! %s is corrupted\n", filename);
+        cpu_t_snapshot_destruct (This);
+        return false;
+    }
+    return true;
+}
+
+void cpu_t_snapshot_destruct (cpu_t_snapshot* This)
+{
+    assert (This);
+    #if defined(__unix__)
+    if (This->memory && This->fd >= 0)
+        munmap (This->memory, This->memory_size);
+    else
+    #endif
+    free (This->memory);
+    #if defined(__unix__)
+    if (This->fd >= 0)
+        close (This->fd);
+    #endif
+    This->memory = NULL;
+    This->fd = -1;
+    This->memory_size = 0;
+    This->stack_max_size = 0;
+    This->stack_size = 0;
+    This->program_size = 0;
+}
+
+bool cpu_t_snapshot_OK (const cpu_t_snapshot* This)
+{
+    assert (This);
+    return This->memory && This->stack_max_size < This->memory_size && This->stack_size <= This->stack_max_size &&
+           This->program_size <= This->memory_size - This->stack_max_size;
+}
+
+void cpu_t_snapshot_dump_ (const cpu_t_snapshot* This, const char name[])
+{
+    assert (This);
+    DUMP_INDENT += INDENT_VALUE;
+    printf ("%s = " ANSI_COLOR_BLUE "cpu_t_snapshot" ANSI_COLOR_RESET " (", name);
+    if (cpu_t_snapshot_OK(This))
+        printf (ANSI_COLOR_GREEN "ok" ANSI_COLOR_RESET ")\n");
+    else
+        printf (ANSI_COLOR_RED "ERROR" ANSI_COLOR_RESET ")\n");
+    printf ("%*sposition = %u, pc = %u, flags = %02X, is_halted = %d\n", DUMP_INDENT, "",
+            This->position, This->pc, (unsigned)(This->flags & 0xFF), This->is_halted);
+    printf ("%*sstack = %u of %u\n", DUMP_INDENT, "", This->stack_size, This->stack_max_size);
+    printf ("%*smemory = %p, %u bytes, fd = %d\n", DUMP_INDENT, "", This->memory, This->memory_size, This->fd);
+    printf ("%*sprogram_size = %u\n", DUMP_INDENT, "", This->program_size);
+    DUMP_INDENT -= INDENT_VALUE;
+}
+
+bool cpu_t_snapshot_save (const cpu_t_snapshot* This, const char filename[])
+{
+    ASSERT_OK(cpu_t_snapshot, This);
+    FILE* f = fopen (filename, "wb");
+    if (!f){
+        perror ("cpu_t_snapshot_save: (can't open file)");
+        return false;
+    }
+    cpu_t_snapshot_header header;
+    memset (&header, 0, sizeof(header));
+    memcpy (header.magic, "SPSN", 4);
+    header.version = CPU_T_SNAPSHOT_VERSION;
+    header.memory_size = This->memory_size;
+    header.stack_max_size = This->stack_max_size;
+    header.stack_size = This->stack_size;
+    header.program_size = This->program_size;
+    header.position = This->position;
+    header.pc = This->pc;
+    header.flags = This->flags;
+    header.is_halted = This->is_halted;
+    memcpy (header.registers, This->registers, REG_SIZE * REG_NUMBER);
+    for (unsigned address = 0; address < This->memory_size; address += CPU_T_SNAPSHOT_PAGE){
+        unsigned size = (This->memory_size - address < CPU_T_SNAPSHOT_PAGE)? This->memory_size - address : CPU_T_SNAPSHOT_PAGE;
+        header.pages += !cpu_t_snapshot_is_zero (This->memory + address, size);
+    }
+    bool is_ok = fwrite (&header, sizeof(header), 1, f) == 1;
+    for (unsigned address = 0; is_ok && address < This->memory_size; address += CPU_T_SNAPSHOT_PAGE){
+        unsigned size = (This->memory_size - address < CPU_T_SNAPSHOT_PAGE)? This->memory_size - address : CPU_T_SNAPSHOT_PAGE;
+        unsigned page = address / CPU_T_SNAPSHOT_PAGE;
+        if (!cpu_t_snapshot_is_zero (This->memory + address, size))
+            is_ok = fwrite (&page, sizeof(page), 1, f) == 1 && fwrite (This->memory + address, 1, size, f) == size;
+    }
+    is_ok = !fclose (f) && is_ok;
+    if (!is_ok)
+        perror ("cpu_t_snapshot_save: (can't write file)");
+    return is_ok;
+}
+
+bool cpu_t_restore (cpu_t* This, const cpu_t_snapshot* snapshot)
+{
+    assert (This);
+    ASSERT_OK(cpu_t_snapshot, snapshot);
+    if (!This->state || This->memory.max_size != snapshot->memory_size || This->stack.max_size != snapshot->stack_max_size){
+        printf (ANSI_COLOR_RED "*BEEP-BEEP*"ANSI_COLOR_RESET"[snapshot of %u bytes of memory and %u bytes of stack doesn't fit]\n",
+                snapshot->memory_size, snapshot->stack_max_size);
+        return false;
+    }
+    // The pages written since the last restore are dropped, the others are not touched at all
+    if (!memory_t_map_file (&This->memory, snapshot->fd, snapshot->memory_size))
+        memory_t_copy_pages (&This->memory, snapshot->memory, snapshot->memory_size);
+    This->stack.size = snapshot->stack_size;
+    This->stack.top = This->stack.data + This->stack.max_size - 1 - This->stack.size;
+    memcpy (This->registers, snapshot->registers, REG_SIZE * REG_NUMBER);
+    This->flags = snapshot->flags;
+    This->is_halted = snapshot->is_halted;
+    This->position = snapshot->position;
+    if (!This->code || This->program_size != snapshot->program_size){
+        cpu_t_jit_destruct (This);
+        if (!cpu_t_decode_program (This, snapshot->program_size))
+            return false;
+    }
+    if (snapshot->pc > This->code_size + 1){
+        printf (ANSI_COLOR_RED "*BEEP-BEEP*"ANSI_COLOR_RESET"[snapshot is taken from another program]\n");
+        return false;
+    }
+    This->pc = snapshot->pc;
+    return true;
+}
+
+/**
+*@brief Executes the program comparing the instruction code with every known code.
+*
+*The original dispatch engine: reads the memory and decodes every instruction on the fly.
+*Is kept for comparison with the others.
+*@param This Pointer to the cpu_t to perform operation on.
+*@return true if no error has occured, false otherwise. In case of fail invalidates cpu_t.
+*/
+bool cpu_t_run_chain (cpu_t* This)
+{
+    while (!This->is_halted && This->memory.storage[This->position])
+    {
+        bool is_done = false;
+        insn_t insn;
+        if (This->is_debug) printf("\n[%u] ", This->position);
+        cpu_t_decode_insn (This, This->position, &insn);
+        This->position = insn.next;
+        #define CMD(name, key, shift, arguments, pops, pushes) \
+        if (!is_done && insn.code == key){\
+            if (This->is_debug) printf (#name "\n");\
+            if (!cpu_t_ ## name (This, &insn))\
+                return false;\
+            is_done = true;\
         }
-        if (This->position >= This->memory.max_size){
-            printf (ANSI_COLOR_RED "*BEEP-BEEP*"ANSI_COLOR_RESET"[instruction address is out of range]\n");
-            This->state = false;
+        #include "commands.h"
+        #undef CMD
+        if (This->is_debug && !is_done){
+            printf ("cpu_t_run: Command is not recognized!\n");
+        }
+        if (!cpu_t_step_end (This))
+            return false;
+    }
+    return true;
+}
+
+/**
+*@brief Executes the decoded program calling the handlers resolved at load time.
+*
+*@param This Pointer to the cpu_t to perform operation on.
+*@return true if no error has occured, false otherwise. In case of fail invalidates cpu_t.
+*/
+bool cpu_t_run_table (cpu_t* This)
+{
+    const insn_t* insn = This->code + This->pc;
+    while (insn->code)
+    {
+        if (This->is_debug) printf("\n[%u] %s\n", insn->address, CPU_T_COMMANDS[insn->code].name);
+        This->position = insn->next;
+        This->pc++;
+        if (!insn->handler (This, insn))
+            return false;
+        if (This->is_debug && !cpu_t_step_end (This))
             return false;
+        insn = This->code + This->pc;
+    }
+    return true;
+}
+
+#if defined(__GNUC__)
+/**
+*@brief Executes the decoded program jumping straight to the code of the handler (computed goto).
+*
+*Every handler gets its own indirect jump, so the branch predictor can learn the
+*sequences of instructions. Requires GCC or Clang.
+*@param This Pointer to the cpu_t to perform operation on.
+*@return true if no error has occured, false otherwise. In case of fail invalidates cpu_t.
+*/
+bool cpu_t_run_goto (cpu_t* This)
+{
+    // The unknown codes are left to the handler of the instruction (cpu_t_unknown)
+    void* labels[256];
+    for (unsigned i = 0; i < 256; i++)
+        labels[i] = &&unknown;
+    labels[0] = &&done;
+    #define CMD(name, key, shift, arguments, pops, pushes) \
+    labels[key] = &&do_ ## name;
+    #include "commands.h"
+    #undef CMD
+    #define FUSE(name, length, code_1, code_2, code_3, code_4) \
+    labels[CPU_T_FUSED_BASE + fused_ ## name] = &&do_fused_ ## name;
+    #include "fusions.h"
+    #undef FUSE
+    const insn_t* insn = This->code + This->pc;
+    #define DISPATCH() goto *labels[insn->code]
+
+    DISPATCH();
+    #define CMD(name, key, shift, arguments, pops, pushes) \
+    do_ ## name:\
+        if (This->is_debug) printf("\n[%u] " #name "\n", insn->address);\
+        This->position = insn->next;\
+        This->pc++;\
+        if (!cpu_t_ ## name (This, insn))\
+            return false;\
+        if (This->is_debug && !cpu_t_step_end (This))\
+            return false;\
+        insn = This->code + This->pc;\
+        DISPATCH();
+    #include "commands.h"
+    #define FUSE(name, length, code_1, code_2, code_3, code_4) CMD(fused_ ## name, 0, 0, 0, 0, 0)
+    #include "fusions.h"
+    #undef FUSE
+    #undef CMD
+    #undef DISPATCH
+unknown:
+    return insn->handler (This, insn);
+done:
+    return true;
+}
+#endif // __GNUC__
+
+#if defined(__GNUC__)
+/**
+*@brief Executes the decoded program keeping the top of the stack in a local variable.
+*
+*The top dword lives in the cache and is neither in the stack memory nor counted in ESP,
+*the stack pointer and the index of the instruction are kept in the locals as well.
+*The common dword instructions work with them directly, dispatched by computed goto as in
+*cpu_t_run_goto; any other instruction gets them written back first, so the handlers always
+*see the consistent cpu_t. Superinstructions are executed by their parts. Once the debug
+*mode is on, the program goes on with cpu_t_run.
+*@param This Pointer to the cpu_t to perform operation on.
+*@return true if no error has occured, false otherwise. In case of fail invalidates cpu_t.
+*/
+bool cpu_t_run_cached (cpu_t* This)
+{
+    if (!This->state){
+        printf (ANSI_COLOR_RED "*BEEP-BEEP*"ANSI_COLOR_RESET"[cpu is corrupted]\n");
+        return false;
+    }
+    if (This->is_debug)
+        return cpu_t_run (This);
+    // The instructions without the cached version go to their handlers
+    void* labels[256];
+    for (unsigned i = 0; i < 256; i++)
+        labels[i] = &&generic;
+    labels[0] = &&done;
+    labels[cmd_push_int] = &&do_push_imm;
+    labels[cmd_push_float] = &&do_push_imm;
+    labels[cmd_push_reg_dword] = &&do_push_reg_dword;
+    labels[cmd_pop_reg_dword] = &&do_pop_reg_dword;
+    labels[cmd_push_mem_dword] = &&do_push_mem_dword;
+    labels[cmd_pop_mem_dword] = &&do_pop_mem_dword;
+    labels[cmd_dworddup] = &&do_dworddup;
+    labels[cmd_add] = &&do_add;
+    labels[cmd_sub] = &&do_sub;
+    labels[cmd_mul] = &&do_mul;
+    labels[cmd_div] = &&do_div;
+    labels[cmd_mod] = &&do_mod;
+    labels[cmd_fadd] = &&do_fadd;
+    labels[cmd_fsub] = &&do_fsub;
+    labels[cmd_fmul] = &&do_fmul;
+    labels[cmd_fdiv] = &&do_fdiv;
+    labels[cmd_cmp] = &&do_cmp;
+    labels[cmd_fcmp] = &&do_fcmp;
+    labels[cmd_ja] = &&do_ja;
+    labels[cmd_jae] = &&do_jae;
+    labels[cmd_jb] = &&do_jb;
+    labels[cmd_jbe] = &&do_jbe;
+    labels[cmd_je] = &&do_je;
+    labels[cmd_jne] = &&do_jne;
+    labels[cmd_jmp] = &&do_jmp;
+    for (unsigned f = 0; f < CPU_T_FUSED_NUMBER; f++)
+        labels[CPU_T_FUSED_BASE + f] = labels[CPU_T_FUSIONS[f].codes[0]];
+
+    stack_t* stack = &This->stack;
+    unsigned* esp = (unsigned*)(This->registers + ESP);
+    // The stack memory is [stack->data, end], the top dword of it is at top + 1
+    char* const end = stack->data + stack->max_size - 1;
+    char* top = stack->top;
+    union
+    {
+        int i;
+        float f;
+        unsigned u;
+    } cache = {0}, a, b;
+    // If the top of the stack is in the cache
+    bool cached = false;
+    const insn_t* insn = This->code + This->pc;
+
+    // The cache counts as a dword of the stack, so it can always be written back
+    #define CACHE_CAN_PUSH(_n) ((size_t)(top + 1 - stack->data) >= (cached + (_n))*sizeof(unsigned))
+    #define CACHE_CAN_POP(_n) ((size_t)(end - top) + cached*sizeof(unsigned) >= (_n)*sizeof(unsigned))
+
+    #define CACHE_SPILL() \
+    if (cached){\
+        top -= sizeof(unsigned);\
+        memcpy (top + 1, &cache, sizeof(unsigned));\
+        cached = false;\
+    }
+
+    // The top dword of the stack memory is taken
+    #define CACHE_TAKE(_dest) \
+    memcpy (&(_dest), top + 1, sizeof(unsigned));\
+    top += sizeof(unsigned);
+
+    // Writes the stack and the instruction back to cpu_t
+    #define CACHE_SYNC() \
+    CACHE_SPILL()\
+    *esp -= (unsigned)(end - top) - stack->size;\
+    stack->size = end - top;\
+    stack->top = top;\
+    This->pc = insn - This->code;\
+    This->position = insn->address;
+
+    #define DISPATCH() goto *labels[insn->code]
+    #define NEXT() insn++; DISPATCH();
+
+    #define CACHE_ARITHM(_name, _member, _op) \
+    do_ ## _name:\
+        if (!CACHE_CAN_POP(2))\
+            goto generic;\
+        if (cached)\
+            a = cache;\
+        else{\
+            CACHE_TAKE(a)\
+        }\
+        CACHE_TAKE(b)\
+        cache._member = a._member _op b._member;\
+        cached = true;\
+        NEXT()
+
+    #define CACHE_CMP(_name, _member) \
+    do_ ## _name:\
+        if (!CACHE_CAN_POP(2))\
+            goto generic;\
+        if (cached)\
+            a = cache;\
+        else{\
+            CACHE_TAKE(a)\
+        }\
+        CACHE_TAKE(b)\
+        cached = false;\
+        This->flags &= (0xFF ^ 0x3);\
+        if (a._member < b._member)\
+            This->flags |= NEG_FLAG;\
+        if (a._member == b._member)\
+            This->flags |= ZRO_FLAG;\
+        NEXT()
+
+    #define CACHE_JUMP(_name, _flags1, _flags2) \
+    do_ ## _name:\
+        if (!((This->flags & 0x3) ^ _flags1) | !((This->flags & 0x3) ^ _flags2)){\
+            insn = This->code + insn->target;\
+            DISPATCH();\
+        }\
+        NEXT()
+
+    DISPATCH();
+do_push_imm:
+    if (!CACHE_CAN_PUSH(1))
+        goto generic;
+    CACHE_SPILL()
+    cache.u = insn->imm.u;
+    cached = true;
+    NEXT()
+do_push_reg_dword:
+    if (!CACHE_CAN_PUSH(1) || !cpu_t_fusable_reg (insn->reg))
+        goto generic;
+    CACHE_SPILL()
+    memcpy (&cache, This->registers + insn->reg, sizeof(unsigned));
+    cached = true;
+    NEXT()
+do_pop_reg_dword:
+    if (!CACHE_CAN_POP(1) || !cpu_t_fusable_reg (insn->reg))
+        goto generic;
+    if (cached)
+        a = cache;
+    else{
+        CACHE_TAKE(a)
+    }
+    cached = false;
+    memcpy (This->registers + insn->reg, &a, sizeof(unsigned));
+    NEXT()
+do_push_mem_dword:
+    if (!CACHE_CAN_PUSH(1) || insn->imm.u + sizeof(unsigned) > This->memory.max_size)
+        goto generic;
+    CACHE_SPILL()
+    memcpy (&cache, This->memory.storage + insn->imm.u, sizeof(unsigned));
+    cached = true;
+    NEXT()
+do_pop_mem_dword:
+    if (!CACHE_CAN_POP(1) || insn->imm.u + sizeof(unsigned) > This->memory.max_size)
+        goto generic;
+    if (cached)
+        a = cache;
+    else{
+        CACHE_TAKE(a)
+    }
+    cached = false;
+    memcpy (This->memory.storage + insn->imm.u, &a, sizeof(unsigned));
+    NEXT()
+do_dworddup:
+    if (!CACHE_CAN_POP(1) || !CACHE_CAN_PUSH(1))
+        goto generic;
+    if (!cached){
+        CACHE_TAKE(cache)
+        cached = true;
+    }
+    top -= sizeof(unsigned);
+    memcpy (top + 1, &cache, sizeof(unsigned));
+    NEXT()
+    CACHE_ARITHM(add, i, +)
+    CACHE_ARITHM(sub, i, -)
+    CACHE_ARITHM(mul, i, *)
+    CACHE_ARITHM(div, i, /)
+    CACHE_ARITHM(mod, i, %)
+    CACHE_ARITHM(fadd, f, +)
+    CACHE_ARITHM(fsub, f, -)
+    CACHE_ARITHM(fmul, f, *)
+    CACHE_ARITHM(fdiv, f, /)
+    CACHE_CMP(cmp, i)
+    CACHE_CMP(fcmp, f)
+    CACHE_JUMP(ja,  NO_FLAG,  NO_FLAG)
+    CACHE_JUMP(jae, NO_FLAG,  ZRO_FLAG)
+    CACHE_JUMP(jb,  NEG_FLAG, NEG_FLAG)
+    CACHE_JUMP(jbe, NEG_FLAG, ZRO_FLAG)
+    CACHE_JUMP(je,  ZRO_FLAG, ZRO_FLAG)
+    CACHE_JUMP(jne, NEG_FLAG, NO_FLAG)
+do_jmp:
+    insn = This->code + insn->target;
+    DISPATCH();
+generic:
+    CACHE_SYNC()
+    This->position = insn->next;
+    This->pc++;
+    if (!insn->handler (This, insn))
+        return false;
+    // The debug command turns the debug mode on
+    if (This->is_debug)
+        return cpu_t_step_end (This) && cpu_t_run (This);
+    top = stack->top;
+    insn = This->code + This->pc;
+    DISPATCH();
+done:
+    CACHE_SYNC()
+    return true;
+
+    #undef CACHE_CAN_PUSH
+    #undef CACHE_CAN_POP
+    #undef CACHE_SPILL
+    #undef CACHE_TAKE
+    #undef CACHE_SYNC
+    #undef DISPATCH
+    #undef NEXT
+    #undef CACHE_ARITHM
+    #undef CACHE_CMP
+    #undef CACHE_JUMP
+}
+#else
+bool cpu_t_run_cached (cpu_t* This)
+{
+    return cpu_t_run_table (This);
+}
+#endif // __GNUC__
+
+//^^^^^^^^^^^^^^^^^^^^^^^^
+// JIT TIER
+//^^^^^^^^^^^^^^^^^^^^^^^^
+// cpu_t_run_tiered interprets the program and counts the taken backward jumps and calls.
+// When a target gets hot, the region starting there is compiled with the image_t emitters
+// and the following jumps to the target run the native code. The region lasts up to the
+// first instruction the native code can't execute (call, ret, I/O, debug...): the native
+// code returns there and the interpreter goes on.
+//
+// The native code runs on the VM stack: rsp is the VM stack pointer (both stacks grow down),
+// r14 is the base of the VM memory, r12b keeps the VM flags and the VM registers live in the
+// host registers with the same numbers. r9 points to the cpu_t_jit_frame.
+// Inside a basic block the top of the VM stack is modeled while compiling: the dwords pushed
+// stay in r8, r10, r11, r13, r15 (or are folded as constants) and the stack pointer is moved
+// only when they are spilled before a jump, a jump target or an instruction without the model.
+
+#if defined(__x86_64__) && defined(__unix__)
+/// Native code is generated for the hot regions. Otherwise cpu_t_run_tiered only interprets
+#define CPU_T_JIT
+#endif
+/// Number of the taken jumps (calls) to the instruction that makes its region compiled
+#if !defined(CPU_T_JIT_THRESHOLD)
+#define CPU_T_JIT_THRESHOLD 64
+#endif
+/// Maximum number of the instructions in the region
+#define CPU_T_JIT_REGION 256
+/// Free VM stack space left to the signal handlers, as they use the stack of the native code
+#define CPU_T_JIT_HEADROOM (16*1024)
+/// Address of the esp register: the host rsp is busy with the VM stack
+#define CPU_T_JIT_RSP (4 * REG_SIZE)
+/// Size of the stack check emitted before the backward jumps
+#define CPU_T_JIT_CHECK_SIZE 25
+
+/**
+@brief State passed to the native code.
+
+The native code addresses the fields by their offsets, so the layout must not change.
+*/
+typedef struct cpu_t_jit_frame cpu_t_jit_frame;
+struct cpu_t_jit_frame
+{
+    char* host_sp; /**< Host stack pointer to return with (0x00) */
+    char* stack_sp; /**< The first used byte of the VM stack (0x08) */
+    char* low; /**< The native code leaves if the stack pointer is below (0x10) */
+    char* high; /**< The native code leaves if the stack pointer is above (0x18) */
+    unsigned registers[REG_NUMBER]; /**< VM registers (0x20) */
+    unsigned flags; /**< VM flags (0x40) */
+};
+
+/// Native code of the region: returns index of the instruction to go on with
+typedef unsigned (*cpu_t_native) (cpu_t_jit_frame* frame, char* memory);
+
+/// Compiled region
+typedef struct cpu_t_region cpu_t_region;
+struct cpu_t_region
+{
+    char* code; /**< Native code, NULL if not compiled */
+    size_t size; /**< Size of the native code */
+    unsigned popped; /**< Upper bound of the stack bytes used below the level of the last stack check */
+    unsigned pushed; /**< Upper bound of the bytes pushed between two stack checks */
+};
+
+/// Jump of the native code to be resolved when the region is emitted
+typedef struct cpu_t_jit_fixup cpu_t_jit_fixup;
+struct cpu_t_jit_fixup
+{
+    unsigned at; /**< Offset of rel32 in the native code */
+    unsigned target; /**< Index of the target instruction */
+    bool is_exit; /**< true if the jump must leave the native code even if the target is in the region */
+};
+
+struct cpu_t_jit
+{
+    unsigned* hits; /**< Number of the taken jumps to every instruction, UINT_MAX if it can't be compiled */
+    cpu_t_region* regions; /**< Region starting at every instruction */
+    image_t image; /**< Output of the emitters */
+    arena_t arena; /**< Native code of all the regions */
+    unsigned compiled; /**< Number of the compiled regions */
+};
+
+/**
+*@brief Frees all the native code of cpu_t.
+*@param This Pointer to the cpu_t to perform operation on.
+*/
+void cpu_t_jit_destruct (cpu_t* This)
+{
+    cpu_t_jit* jit = This->jit;
+    if (!jit)
+        return;
+    arena_t_destruct (&jit->arena);
+    free (jit->hits);
+    free (jit->regions);
+    image_t_destruct (&jit->image);
+    free (jit);
+    This->jit = NULL;
+}
+
+/**
+*@brief Prepares cpu_t for the tiered execution of the loaded program.
+*@param This Pointer to the cpu_t to perform operation on.
+*@return true if success, false otherwise.
+*/
+bool cpu_t_jit_construct (cpu_t* This)
+{
+    This->jit = (cpu_t_jit*)calloc (1, sizeof(cpu_t_jit));
+    if (!This->jit){
+        printf ("cpu_t_jit_construct: Can't allocate memory!\n");
+        return false;
+    }
+    This->jit->hits = (unsigned*)calloc (This->code_size + 1, sizeof(unsigned));
+    This->jit->regions = (cpu_t_region*)calloc (This->code_size + 1, sizeof(cpu_t_region));
+    // The regions are small, so they share the slabs
+    if (!This->jit->hits || !This->jit->regions || !image_t_construct_empty (&This->jit->image) ||
+        !arena_t_construct (&This->jit->arena, ARENA_SLAB_SIZE, ARENA_AUTO)){
+        printf ("cpu_t_jit_construct: Can't allocate memory!\n");
+        cpu_t_jit_destruct (This);
+        return false;
+    }
+    return true;
+}
+
+/**
+*@brief Tells if the native code can execute the instruction and how it uses the stack.
+*
+*Jumps are not included, they are emitted by cpu_t_jit_compile itself.
+*@param This Pointer to the cpu_t with the decoded program.
+*@param insn The instruction.
+*@param popped Where to save the number of bytes the instruction may pop.
+*@param pushed Where to save the number of bytes the instruction may push.
+*@return true if the instruction can be compiled, false otherwise.
+*/
+bool cpu_t_jit_supports (const cpu_t* This, const insn_t* insn, unsigned* popped, unsigned* pushed)
+{
+    bool is_reg = insn->reg % REG_SIZE == 0 && insn->reg < REG_SIZE * REG_NUMBER && insn->reg != CPU_T_JIT_RSP && insn->reg != ESP;
+    unsigned char code = cpu_t_insn_code (insn);
+    if (!command_stack_effect (code, popped, pushed))
+        return false;
+    switch (code)
+    {
+    #define VAR(_name, _nbytes) \
+    case cmd_push_mem_ ## _name:\
+    case cmd_pop_mem_ ## _name:\
+        return insn->imm.u < INT_MAX && insn->imm.u + _nbytes <= This->memory.max_size;\
+    case cmd_push_reg_ ## _name:\
+    case cmd_pop_reg_ ## _name:\
+        return is_reg;\
+    case cmd_ ## _name ## dup:\
+    case cmd_ ## _name ## dupd:\
+        return true;
+    #include "var_sizes.h"
+    #undef VAR
+    case cmd_push_int:
+    case cmd_push_float:
+    case cmd_push_char:
+    case cmd_add:
+    case cmd_sub:
+    case cmd_mul:
+    case cmd_div:
+    case cmd_mod:
+    case cmd_fadd:
+    case cmd_fsub:
+    case cmd_fmul:
+    case cmd_fdiv:
+    case cmd_abs:
+    case cmd_fabs:
+    case cmd_cmp:
+    case cmd_fcmp:
+    case cmd_ccmp:
+        return true;
+    // The debug commands and the I/O go back to the interpreter
+    default:
+        return false;
+    }
+}
+
+/// The native code keeps the top of the VM stack in the host registers inside the basic blocks.
+/// 0 makes every instruction go through the memory (the image_t emitters as they are)
+#if !defined(CPU_T_JIT_CACHE)
+#define CPU_T_JIT_CACHE 1
+#endif
+/// Host registers r8...r15 available for the stack items of image_t_stack: r9, r12 and r14 are busy
+static const char CPU_T_JIT_POOL[] = {0x0, 0x2, 0x3, 0x5, 0x7};
+
+/**
+*@brief Compiles the region starting at the instruction.
+*
+*Jumps inside the region become the native ones, the others leave the native code.
+*Every backward jump checks that the stack has enough space for the next pass. Between
+*the checks the code goes only forward, so every instruction is executed once at most.
+*@param This Pointer to the cpu_t with the decoded program.
+*@param first Index of the first instruction of the region.
+*@return true if the region is compiled, false if it is empty or can't be mapped.
+*/
+bool cpu_t_jit_compile (cpu_t* This, unsigned first)
+{
+    cpu_t_jit* jit = This->jit;
+    buffer_t* binary = &jit->image.binary;
+    unsigned offsets[CPU_T_JIT_REGION + 1];
+    cpu_t_jit_fixup fixups[3*CPU_T_JIT_REGION];
+    unsigned fixups_size = 0;
+    char rel32[sizeof(int)] = {};
+
+    // Looking for the end of the region and the targets of the backward jumps
+    unsigned insn_popped[CPU_T_JIT_REGION] = {}, insn_pushed[CPU_T_JIT_REGION] = {};
+    bool is_start[CPU_T_JIT_REGION] = {true};
+    unsigned last = first;
+    for (; last < This->code_size && last - first < CPU_T_JIT_REGION; last++){
+        const insn_t* insn = This->code + last;
+        unsigned char code = cpu_t_insn_code (insn);
+        if (code >= cmd_ja && code <= cmd_jmp){
+            if (insn->target >= This->code_size)
+                break;
+            if (insn->target >= first && insn->target <= last)
+                is_start[insn->target - first] = true;
         }
+        else if (!cpu_t_jit_supports (This, insn, insn_popped + last - first, insn_pushed + last - first))
+            break;
+    }
+    if (last == first)
+        return false;
+    // The modeled stack is written to the memory before every jump and jump target
+    bool is_target[CPU_T_JIT_REGION + 1] = {};
+    for (unsigned index = first; index < last; index++){
+        const insn_t* insn = This->code + index;
+        unsigned char code = cpu_t_insn_code (insn);
+        if (code >= cmd_ja && code <= cmd_jmp && insn->target >= first && insn->target < last)
+            is_target[insn->target - first] = true;
     }
+    image_t_stack stack;
+    image_t_stack_construct (&stack, &jit->image, CPU_T_JIT_POOL, sizeof(CPU_T_JIT_POOL));
+
+    // Stack depth relative to the last check: the lowest one over all the ways to the instruction
+    int depth[CPU_T_JIT_REGION + 1];
+    int lowest = 0;
+    unsigned pushed = 0;
+    for (unsigned i = 0; i <= last - first; i++)
+        depth[i] = INT_MAX;
+    for (unsigned i = 0; i < last - first; i++){
+        const insn_t* insn = This->code + first + i;
+        unsigned char code = cpu_t_insn_code (insn);
+        if (is_start[i] || depth[i] == INT_MAX)
+            depth[i] = MIN(depth[i], 0);
+        int after = depth[i] - (int)insn_popped[i];
+        lowest = MIN(lowest, after);
+        after += (int)insn_pushed[i];
+        pushed += insn_pushed[i];
+        if (code >= cmd_ja && code <= cmd_jmp && insn->target > first + i && insn->target < last)
+            depth[insn->target - first] = MIN(depth[insn->target - first], after);
+        if (code != cmd_jmp)
+            depth[i + 1] = MIN(depth[i + 1], after);
+    }
+    unsigned popped = (unsigned)(-lowest);
+    #define FIXUP(_target, _is_exit) \
+        fixups[fixups_size].at = binary->size;\
+        fixups[fixups_size].target = (_target);\
+        fixups[fixups_size++].is_exit = (_is_exit);\
+        buffer_t_append (binary, rel32, sizeof(rel32));
+
+    binary->size = 0;
+    //53 55 41 54 41 55 41 56 41 57    push   %rbx, %rbp, %r12...%r15
+    //49 89 f9                         mov    %rdi,%r9
+    //49 89 f6                         mov    %rsi,%r14
+    //49 89 21                         mov    %rsp,(%r9)
+    //49 8b 61 08                      mov    0x8(%r9),%rsp
+    //45 8b 61 40                      mov    0x40(%r9),%r12d
+    char entry[] = {0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57, 0x49, 0x89, 0xf9, 0x49, 0x89, 0xf6,
+                    0x49, 0x89, 0x21, 0x49, 0x8b, 0x61, 0x08, 0x45, 0x8b, 0x61, 0x40};
+    buffer_t_append (binary, entry, sizeof(entry));
+    //41 8b .. ..                      mov    0x..(%r9),%e..
+    for (unsigned reg = 0; reg < REG_NUMBER; reg++)
+        if (reg * REG_SIZE != CPU_T_JIT_RSP){
+            char load[] = {0x41, 0x8b, 0x41 | (reg << 3), 0x20 + reg * REG_SIZE};
+            buffer_t_append (binary, load, sizeof(load));
+        }
+
+    for (unsigned index = first; index < last; index++){
+        const insn_t* insn = This->code + index;
+        unsigned char code = cpu_t_insn_code (insn);
+        bool is_jump = code >= cmd_ja && code <= cmd_jmp;
+        if (is_target[index - first] || is_jump)
+            image_t_stack_flush (&stack);
+        offsets[index - first] = binary->size;
+        if (is_jump){
+            bool is_backward = insn->target >= first && insn->target <= index;
+            if (code != cmd_jmp){
+                char taken = image_t_get_condition (&jit->image, code);
+                //7. ..                    jz/jnz over the stack check
+                //0f 8. .. .. .. ..        jz/jnz target
+                char skip[] = {taken ^ 0x1, CPU_T_JIT_CHECK_SIZE};
+                char jcc[] = {0x0f, taken + 0x10};
+                if (is_backward)
+                    buffer_t_append (binary, skip, sizeof(skip));
+                else{
+                    buffer_t_append (binary, jcc, sizeof(jcc));
+                    FIXUP(insn->target, false)
+                }
+            }
+            if (is_backward){
+                //49 3b 61 10              cmp    0x10(%r9),%rsp
+                //0f 82 .. .. .. ..        jb     exit
+                //49 3b 61 18              cmp    0x18(%r9),%rsp
+                //0f 87 .. .. .. ..        ja     exit
+                //e9 .. .. .. ..           jmp    target
+                char check_low[] = {0x49, 0x3b, 0x61, 0x10, 0x0f, 0x82};
+                char check_high[] = {0x49, 0x3b, 0x61, 0x18, 0x0f, 0x87};
+                char jmp[] = {0xe9};
+                buffer_t_append (binary, check_low, sizeof(check_low));
+                FIXUP(insn->target, true)
+                buffer_t_append (binary, check_high, sizeof(check_high));
+                FIXUP(insn->target, true)
+                buffer_t_append (binary, jmp, sizeof(jmp));
+                FIXUP(insn->target, false)
+            }
+            else if (code == cmd_jmp){
+                char jmp[] = {0xe9};
+                buffer_t_append (binary, jmp, sizeof(jmp));
+                FIXUP(insn->target, false)
+            }
+        }
+        else if (!CPU_T_JIT_CACHE || !image_t_stack_emit (&stack, code, insn->imm.bytes)){
+            image_t_stack_flush (&stack);
+            switch (code)
+            {
+            #define CMD(name, key, shift_to_the_right, arguments_type, pops, pushes) \
+            case cmd_ ## name:\
+                image_t_get_ ## name (&jit->image, insn->imm.bytes);\
+                break;
+            #include "commands.h"
+            #undef CMD
+            }
+        }
+    }
+    #undef FIXUP
+
+    // The end of the region: leaving with the index of the next instruction
+    image_t_stack_flush (&stack);
+    //41 bd .. .. .. ..                mov    $0x..,%r13d
+    char leave[] = {0x41, 0xbd};
+    buffer_t_append (binary, leave, sizeof(leave));
+    buffer_t_append (binary, (char*)&last, sizeof(unsigned));
+    unsigned exit = binary->size;
+    //41 89 .. ..                      mov    %e..,0x..(%r9)
+    for (unsigned reg = 0; reg < REG_NUMBER; reg++)
+        if (reg * REG_SIZE != CPU_T_JIT_RSP){
+            char store[] = {0x41, 0x89, 0x41 | (reg << 3), 0x20 + reg * REG_SIZE};
+            buffer_t_append (binary, store, sizeof(store));
+        }
+    //45 89 61 40                      mov    %r12d,0x40(%r9)
+    //49 89 61 08                      mov    %rsp,0x8(%r9)
+    //49 8b 21                         mov    (%r9),%rsp
+    //44 89 e8                         mov    %r13d,%eax
+    //41 5f 41 5e 41 5d 41 5c 5d 5b    pop    %r15...%r12, %rbp, %rbx
+    //c3                               retq
+    char epilogue[] = {0x45, 0x89, 0x61, 0x40, 0x49, 0x89, 0x61, 0x08, 0x49, 0x8b, 0x21, 0x44, 0x89, 0xe8,
+                       0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5d, 0x5b, 0xc3};
+    buffer_t_append (binary, epilogue, sizeof(epilogue));
+
+    // Jumps out of the region go through the stubs: mov $index,%r13d; jmp exit
+    for (unsigned i = 0; i < fixups_size; i++){
+        unsigned target = fixups[i].target;
+        unsigned destination = 0;
+        if (!fixups[i].is_exit && target >= first && target < last)
+            destination = offsets[target - first];
+        else{
+            destination = binary->size;
+            char jmp[] = {0xe9};
+            int to_exit = (int)exit - (int)(destination + sizeof(leave) + sizeof(unsigned) + sizeof(jmp) + sizeof(int));
+            buffer_t_append (binary, leave, sizeof(leave));
+            buffer_t_append (binary, (char*)&target, sizeof(unsigned));
+            buffer_t_append (binary, jmp, sizeof(jmp));
+            buffer_t_append (binary, (char*)&to_exit, sizeof(int));
+        }
+        int relative = (int)destination - (int)(fixups[i].at + sizeof(int));
+        memcpy (binary->data + fixups[i].at, &relative, sizeof(int));
+    }
+
+    // The code is never writable and executable at the same time
+    size_t size = binary->size;
+    char* code = arena_t_allocate (&jit->arena, size);
+    if (!code)
+        return false;
+    if (!arena_t_write (&jit->arena, code, binary->data, size)){
+        arena_t_free (&jit->arena, code, size);
+        return false;
+    }
+    cpu_t_region* region = jit->regions + first;
+    region->code = code;
+    region->size = size;
+    region->popped = popped;
+    region->pushed = pushed;
+    jit->compiled++;
+    return true;
+}
+
+/**
+*@brief Runs the native code of the region starting at the current instruction.
+*
+*Counts the jumps to the instruction and compiles the region when it gets hot. The native
+*code is not entered if the stack may overflow or underflow there, so the interpreter reports it.
+*@param This Pointer to the cpu_t to perform operation on.
+*/
+void cpu_t_jit_enter (cpu_t* This)
+{
+    cpu_t_jit* jit = This->jit;
+    unsigned first = This->pc;
+    if (first >= This->code_size || jit->hits[first] == UINT_MAX)
+        return;
+    cpu_t_region* region = jit->regions + first;
+    if (!region->code){
+        if (++jit->hits[first] < CPU_T_JIT_THRESHOLD)
+            return;
+        if (!cpu_t_jit_compile (This, first)){
+            jit->hits[first] = UINT_MAX;
+            return;
+        }
+    }
+    stack_t* stack = &This->stack;
+    cpu_t_jit_frame frame;
+    frame.stack_sp = stack->top + 1;
+    frame.low = stack->data + region->pushed + CPU_T_JIT_HEADROOM;
+    frame.high = stack->data + stack->max_size - region->popped;
+    if (frame.stack_sp < frame.low || frame.stack_sp > frame.high)
+        return;
+    memcpy (frame.registers, This->registers, sizeof(frame.registers));
+    frame.flags = (unsigned char)This->flags;
+
+    size_t size = stack->size;
+    unsigned next = ((cpu_t_native)region->code) (&frame, This->memory.storage);
+
+    memcpy (This->registers, frame.registers, sizeof(frame.registers));
+    This->flags = (char)frame.flags;
+    stack->top = frame.stack_sp - 1;
+    stack->size = stack->data + stack->max_size - frame.stack_sp;
+    // ESP is not used by the native code, so it just follows the stack
+    *(unsigned*)(This->registers+ESP) += (unsigned)(size - stack->size);
+    This->pc = next;
+    This->position = This->code[next].address;
+}
+
+/**
+*@brief Executes the program interpreting it and running the native code of the hot regions.
+*
+*The native code is not used in the debug mode.
+*@param This Pointer to the cpu_t to perform operation on.
+*@return true if no error has occured, false otherwise. In case of fail invalidates cpu_t.
+*/
+bool cpu_t_run_tiered (cpu_t* This)
+{
+    if (!This->state){
+        printf (ANSI_COLOR_RED "*BEEP-BEEP*"ANSI_COLOR_RESET"[cpu is corrupted]\n");
+        return false;
+    }
+    #if defined(CPU_T_JIT)
+    if (!This->jit && !cpu_t_jit_construct (This))
+        return false;
+    #endif
+    const insn_t* insn = This->code + This->pc;
+    while (insn->code)
+    {
+        unsigned index = This->pc;
+        if (This->is_debug) printf("\n[%u] %s\n", insn->address, CPU_T_COMMANDS[insn->code].name);
+        This->position = insn->next;
+        This->pc++;
+        if (!insn->handler (This, insn))
+            return false;
+        if (This->is_debug){
+            if (!cpu_t_step_end (This))
+                return false;
+        }
+        #if defined(CPU_T_JIT)
+        // A backward jump or a call was taken
+        else if (This->pc <= index || (This->pc != index + 1 && cpu_t_insn_code (insn) == cmd_call))
+            cpu_t_jit_enter (This);
+        #endif
+        insn = This->code + This->pc;
+    }
+    return true;
+}
+
+bool cpu_t_run (cpu_t* This)
+{
+    if (!This->state){
+        printf (ANSI_COLOR_RED "*BEEP-BEEP*"ANSI_COLOR_RESET"[cpu is corrupted]\n");
+        return false;
+    }
+    #if CPU_T_DISPATCH == CPU_T_DISPATCH_CHAIN
+    return cpu_t_run_chain (This);
+    #elif CPU_T_DISPATCH == CPU_T_DISPATCH_TABLE
+    return cpu_t_run_table (This);
+    #else
+    return cpu_t_run_goto (This);
+    #endif
+}
+
+bool cpu_t_run_to (cpu_t* This, unsigned address)
+{
+    unsigned index = (This->code)? cpu_t_find_insn (This, address) : UINT_MAX;
+    if (This->is_code_shared || index >= This->code_size){
+        printf (ANSI_COLOR_RED "*BEEP-BEEP*"ANSI_COLOR_RESET"[there is no instruction at %u]\n", address);
+        return false;
+    }
+    // The zero code ends the program for every dispatch engine
+    unsigned char code = This->code[index].code;
+    char byte = This->memory.storage[address];
+    This->code[index].code = 0;
+    This->memory.storage[address] = 0;
+    bool is_ok = cpu_t_run (This);
+    This->code[index].code = code;
+    This->memory.storage[address] = byte;
+    if (!is_ok || This->is_halted || This->position != address)
+        return false;
+    This->pc = index;
     return true;
 }
 
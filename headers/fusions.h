@@ -0,0 +1,21 @@
+// Superinstructions of cpu_t. Right way to define: FUSE(name, length, code_1, code_2, code_3, code_4)
+// 'length' is the number of fused instructions, the codes of the unused ones must be 0.
+// The patterns are tried in the given order, so the longer ones go first.
+FUSE(push_reg_push_reg_add_pop_reg, 4, cmd_push_reg_dword, cmd_push_reg_dword, cmd_add, cmd_pop_reg_dword)
+FUSE(dworddup_push_int_je, 3, cmd_dworddup, cmd_push_int, cmd_je, 0)
+FUSE(push_int_add,     2, cmd_push_int, cmd_add, 0, 0)
+FUSE(push_int_sub,     2, cmd_push_int, cmd_sub, 0, 0)
+FUSE(push_int_pop_reg, 2, cmd_push_int, cmd_pop_reg_dword, 0, 0)
+FUSE(push_reg_pop_reg, 2, cmd_push_reg_dword, cmd_pop_reg_dword, 0, 0)
+FUSE(cmp_ja,   2, cmd_cmp, cmd_ja,  0, 0)
+FUSE(cmp_jae,  2, cmd_cmp, cmd_jae, 0, 0)
+FUSE(cmp_jb,   2, cmd_cmp, cmd_jb,  0, 0)
+FUSE(cmp_jbe,  2, cmd_cmp, cmd_jbe, 0, 0)
+FUSE(cmp_je,   2, cmd_cmp, cmd_je,  0, 0)
+FUSE(cmp_jne,  2, cmd_cmp, cmd_jne, 0, 0)
+FUSE(fcmp_ja,  2, cmd_fcmp, cmd_ja,  0, 0)
+FUSE(fcmp_jae, 2, cmd_fcmp, cmd_jae, 0, 0)
+FUSE(fcmp_jb,  2, cmd_fcmp, cmd_jb,  0, 0)
+FUSE(fcmp_jbe, 2, cmd_fcmp, cmd_jbe, 0, 0)
+FUSE(fcmp_je,  2, cmd_fcmp, cmd_je,  0, 0)
+FUSE(fcmp_jne, 2, cmd_fcmp, cmd_jne, 0, 0)
@@ -1,7 +1,13 @@
 #include "mylib.h"
 #include "buffer_t.h"
 #include "list_t.h"
+#include "arena_t.h"
 #include "commands_enum.h"
+#include "ir_t.h"
+#include "stream_t.h"
+#include <sys/mman.h>
+#include <inttypes.h>
+#include <unistd.h>
 
 #define _GNU_SOURCE
 #define _BSD_SOURCE
@@ -10,37 +16,228 @@
 #define IMAGE_T_H_INCLUDED
 
 #define image_t_dump(This) image_t_dump_(This, #This)
-#define OFFSET (This->binary.data)
+#define DEFINES_ONLY
+#include "reg_address.h"
+#undef DEFINES_ONLY
 //###################################
 //#####     Storage policy     ######
 //###################################
 //Breaf info:                       #
-//    (0) Offset is stored in R14   #
+//    (0) Base of the memory is in  #
+//        R14                       #
 //    (1) RDI->RSI->RDX->RCX->R8->R9#
-//    (2) R10 and R11 will be broken#
+//    (2) R11 will be broken        #
 //    (3) Others will be saved      #
 //    (4) Temporary data register is#
 //        R13                       #
+//    (5) VM flags are kept in R12B #
+//    (6) R10 is the pointer of the #
+//        return stack              #
+//    (7) VM registers are in the   #
+//        host ones with the same   #
+//        numbers, but esp is in R8 #
+//    (8) Inside the basic blocks   #
+//        R9, R11, R13, R15 may hold#
+//        the top of the VM stack   #
 //###################################
 enum IMAGE_T_STATE {RUNNING, STOPPED, INTERRUPTED};
 enum IMAGE_T_SIGNAL {SIG_STOP, SIG_OUT, SIG_IN};
 enum IMAGE_T_TYPE {INT, FLOAT, CHAR};
+// Map entry of the instruction that is not translated yet, fixup target of the return stub
+#define IMAGE_T_UNKNOWN UINT_MAX
+// Size of the code before the translated program: the loader of the registers
+#define IMAGE_T_HEADER_SIZE 55
+// Place of the base of the memory in the loader, it is written by image_t_execute
+#define IMAGE_T_MEMORY_AT 3
+// Size of the stack of the return addresses of the translated program
+#define IMAGE_T_RETURN_STACK (256*1024)
+// Size of the memory of the program by default, the same as MEM_SIZE of the processor
+#define IMAGE_T_MEMORY_SIZE (1024*1024)
+// Number of the output values that are kept by the translated program before it calls the host
+#define IMAGE_T_OUTPUT_SIZE 4096
+// Number of the input values the host parses ahead for the translated program at once
+#define IMAGE_T_INPUT_SIZE 4096
+// IMAGE_T_EMITTER(name, max_size): every command of commands.h and every instruction of IR_T_INSNS
+// must be here with the maximum size of its translation (used to allocate the binary once),
+// or IMAGE_T_COVERAGE doesn't compile
+#define IMAGE_T_EMITTERS \
+IMAGE_T_EMITTER(debug, 64) IMAGE_T_EMITTER(ndebug, 0) IMAGE_T_EMITTER(stop, 16) IMAGE_T_EMITTER(err, 91)\
+IMAGE_T_EMITTER(out, 110) IMAGE_T_EMITTER(fout, 110) IMAGE_T_EMITTER(cout, 111)\
+IMAGE_T_EMITTER(add, 17) IMAGE_T_EMITTER(sub, 17) IMAGE_T_EMITTER(mul, 18) IMAGE_T_EMITTER(div, 30) IMAGE_T_EMITTER(mod, 30)\
+IMAGE_T_EMITTER(fadd, 19) IMAGE_T_EMITTER(fsub, 19) IMAGE_T_EMITTER(fmul, 19) IMAGE_T_EMITTER(fdiv, 19)\
+IMAGE_T_EMITTER(ret, 33)\
+IMAGE_T_EMITTER(bytedup, 12) IMAGE_T_EMITTER(worddup, 14) IMAGE_T_EMITTER(dworddup, 12)\
+IMAGE_T_EMITTER(bytedupd, 14) IMAGE_T_EMITTER(worddupd, 12) IMAGE_T_EMITTER(dworddupd, 12)\
+IMAGE_T_EMITTER(in, 128) IMAGE_T_EMITTER(fin, 128) IMAGE_T_EMITTER(cin, 128)\
+IMAGE_T_EMITTER(abs, 13) IMAGE_T_EMITTER(fabs, 7)\
+IMAGE_T_EMITTER(cmp, 37) IMAGE_T_EMITTER(fcmp, 40) IMAGE_T_EMITTER(ccmp, 37)\
+IMAGE_T_EMITTER(push, 0)\
+IMAGE_T_EMITTER(push_mem_byte, 19) IMAGE_T_EMITTER(push_mem_word, 21) IMAGE_T_EMITTER(push_mem_dword, 19)\
+IMAGE_T_EMITTER(push_reg_byte, 8) IMAGE_T_EMITTER(push_reg_word, 9) IMAGE_T_EMITTER(push_reg_dword, 8)\
+IMAGE_T_EMITTER(push_int, 11) IMAGE_T_EMITTER(push_float, 11) IMAGE_T_EMITTER(push_char, 8)\
+IMAGE_T_EMITTER(pop, 0)\
+IMAGE_T_EMITTER(pop_mem_byte, 19) IMAGE_T_EMITTER(pop_mem_word, 21) IMAGE_T_EMITTER(pop_mem_dword, 19)\
+IMAGE_T_EMITTER(pop_reg_byte, 8) IMAGE_T_EMITTER(pop_reg_word, 9) IMAGE_T_EMITTER(pop_reg_dword, 8)\
+IMAGE_T_EMITTER(ja, 10) IMAGE_T_EMITTER(jae, 10) IMAGE_T_EMITTER(jb, 10) IMAGE_T_EMITTER(jbe, 10)\
+IMAGE_T_EMITTER(je, 10) IMAGE_T_EMITTER(jne, 10) IMAGE_T_EMITTER(jmp, 5) IMAGE_T_EMITTER(call, 37)\
+IMAGE_T_EMITTER(nop, 0) IMAGE_T_EMITTER(shl, 4) IMAGE_T_EMITTER(div_pow2, 26)
+
+enum IMAGE_T_MAX_SIZE
+{
+    #define IMAGE_T_EMITTER(_name, _max_size) IMAGE_T_MAX_SIZE_ ## _name = _max_size,
+    IMAGE_T_EMITTERS
+    #undef IMAGE_T_EMITTER
+};
+// The biggest of IMAGE_T_MAX_SIZE
+#define IMAGE_T_INSN_MAX_SIZE 128
+// IMAGE_T_PEEPHOLE(name, code_1, code_2): image_t_peephole_<name> translates the pair if it can
+#define IMAGE_T_PEEPHOLES \
+IMAGE_T_PEEPHOLE(push_int_add,     cmd_push_int, cmd_add)\
+IMAGE_T_PEEPHOLE(push_int_sub,     cmd_push_int, cmd_sub)\
+IMAGE_T_PEEPHOLE(push_int_mul,     cmd_push_int, cmd_mul)\
+IMAGE_T_PEEPHOLE(push_int_cmp,     cmd_push_int, cmd_cmp)\
+IMAGE_T_PEEPHOLE(push_int_pop_reg, cmd_push_int, cmd_pop_reg_dword)\
+IMAGE_T_PEEPHOLE(push_reg_add,     cmd_push_reg_dword, cmd_add)\
+IMAGE_T_PEEPHOLE(push_reg_sub,     cmd_push_reg_dword, cmd_sub)\
+IMAGE_T_PEEPHOLE(push_reg_cmp,     cmd_push_reg_dword, cmd_cmp)\
+IMAGE_T_PEEPHOLE(push_reg_pop_reg, cmd_push_reg_dword, cmd_pop_reg_dword)\
+IMAGE_T_PEEPHOLE(push_mem_pop_reg, cmd_push_mem_dword, cmd_pop_reg_dword)\
+IMAGE_T_PEEPHOLE(push_reg_pop_mem, cmd_push_reg_dword, cmd_pop_mem_dword)\
+IMAGE_T_PEEPHOLE(pop_mem_push_mem, cmd_pop_mem_dword, cmd_push_mem_dword)\
+IMAGE_T_PEEPHOLE(pop_reg_push_reg, cmd_pop_reg_dword, cmd_push_reg_dword)\
+IMAGE_T_PEEPHOLE(ja_jmp,           cmd_ja,  cmd_jmp)\
+IMAGE_T_PEEPHOLE(jae_jmp,          cmd_jae, cmd_jmp)\
+IMAGE_T_PEEPHOLE(jb_jmp,           cmd_jb,  cmd_jmp)\
+IMAGE_T_PEEPHOLE(jbe_jmp,          cmd_jbe, cmd_jmp)\
+IMAGE_T_PEEPHOLE(je_jmp,           cmd_je,  cmd_jmp)\
+IMAGE_T_PEEPHOLE(jne_jmp,          cmd_jne, cmd_jmp)
+// Index of every pair of IMAGE_T_PEEPHOLES in image_t::peepholes
+enum IMAGE_T_PEEPHOLE_INDEX
+{
+    #define IMAGE_T_PEEPHOLE(_name, _code_1, _code_2) IMAGE_T_PEEPHOLE_ ## _name,
+    IMAGE_T_PEEPHOLES
+    #undef IMAGE_T_PEEPHOLE
+    IMAGE_T_PEEPHOLES_NUMBER
+};
+// Must be increased after every change of the translation: the cached images of the older versions are ignored
+#define IMAGE_T_VERSION 12
+// The translation keeps the top of the VM stack in the host registers inside the basic blocks.
+// 0 makes every instruction go through the memory (the emitters as they are)
+#if !defined(IMAGE_T_STACK_CACHE)
+#define IMAGE_T_STACK_CACHE 1
+#endif
+// Maximum number of the stack items kept out of the memory (in the registers and as constants)
+#define IMAGE_T_STACK_ITEMS 16
+// Host registers r8...r15 of the translator available for the stack items: esp is in r8,
+// the return stack in r10, the flags in r12 and the memory in r14. The temporaries r11, r13
+// and r15 of the emitters are free, as the stack is written to the memory before them
+static const char IMAGE_T_POOL[] = {0x1, 0x3, 0x5, 0x7};
+// Absolute addresses in the translation, they are different in every run
+enum IMAGE_T_ADDRESS {ADDR_IMAGE, ADDR_HANDLER, ADDR_OUT_STREAM, ADDR_INPUT, ADDR_RETURN_STACK, ADDR_MAP,
+                      ADDR_OUTPUT, ADDR_FLUSH, ADDR_HOST_SP, ADDR_DEBUG, ADDR_NUMBER};
+// Place of the absolute address that must be written when the translation is loaded from the cache
+typedef struct image_t_reloc image_t_reloc;
+struct image_t_reloc
+{
+    unsigned at; // Offset of the address in the binary
+    unsigned kind; // IMAGE_T_ADDRESS
+};
+// Beginning of the file of the cached translation.
+// It is followed by the source, the map, the relocations and the binary.
+typedef struct image_t_cache_header image_t_cache_header;
+struct image_t_cache_header
+{
+    char magic[4];
+    unsigned version;
+    uint64_t hash;
+    uint64_t source_size;
+    uint64_t binary_size;
+    uint64_t relocs_size;
+    unsigned return_stub;
+};
+// Place of the address of the jump (call) that must be written when the target is translated
+typedef struct image_t_fixup image_t_fixup;
+struct image_t_fixup
+{
+    unsigned at; // Offset of the address in the binary
+    unsigned target; // Position of the target in the source
+};
+// Output values written by the translated program itself, they are printed by image_t_flush_output
+typedef struct image_t_output image_t_output;
+struct image_t_output
+{
+    unsigned size;
+    unsigned reserved; // Aligns the values
+    struct
+    {
+        unsigned value;
+        unsigned type; // IMAGE_T_TYPE
+    } values[IMAGE_T_OUTPUT_SIZE];
+};
+// Input values parsed ahead, the translated program takes them itself while the ones of its type last.
+// The native code addresses the fields by their offsets, so the layout must not change
+typedef struct image_t_input image_t_input;
+struct image_t_input
+{
+    unsigned sizes[3]; // Number of the values of every IMAGE_T_TYPE (0x0), only the type of the batch has them
+    unsigned position; // Next value to take (0xc)
+    unsigned values[IMAGE_T_INPUT_SIZE]; // (0x10)
+    size_t ends[IMAGE_T_INPUT_SIZE]; // Position of the stream after every value
+    stream_t stream; // The standard input
+};
 typedef struct image_t image_t;
 //Resizable image of source code that can be run
 struct image_t
 {
     char state;
     bool is_mapped; // If the map is fully loaded
+    bool is_optimized; // If the passes of ir_t_optimize run before the translation
+    bool is_peephole; // If the pairs of IMAGE_T_PEEPHOLES are translated together
+    unsigned peepholes[IMAGE_T_PEEPHOLES_NUMBER]; // Number of the pairs of every peephole in the translation
+    unsigned memory_size; // Size of the memory of the program: the data section and the memory operands are in it
     unsigned* map; // The map provides connections between the source code and the the translation
     char* resume_pos;
-    buffer_t source; // Source binary
+    buffer_t source; // Source binary, a view of the buffer given to the constructor
     buffer_t binary; // Translated binary
-    char in_stream[8];
+    image_t_fixup* fixups; // Jumps to the instructions that were not translated yet
+    size_t fixups_size;
+    image_t_reloc* relocs; // Absolute addresses in the binary
+    size_t relocs_size;
+    size_t relocs_max_size;
+    char* return_stack; // Return addresses of the calls for the host ret
+    image_t_output* output; // Output values that are not printed yet
+    image_t_input* input; // Input values parsed ahead
+    unsigned return_stub; // Offset of the code returning to the address that is not on the return stack
+    char* host_sp; // Stack pointer of the host saved by the loader, stop returns with it
     char out_stream[8]; // First byte signals the size or error
 };
 
-// Constructs the image
+// Dword of the VM stack that is not written to the memory yet
+typedef struct image_t_stack_item image_t_stack_item;
+struct image_t_stack_item
+{
+    bool is_const; // If the value is known while translating
+    char reg; // The value is in the host register r8 + reg
+    unsigned value; // The constant value
+};
+// Top of the VM stack modeled while translating (by image_t_iterate and the JIT of cpu_t).
+// The items lie above the real stack pointer: the first one is the deepest. They are written
+// to the memory at the ends of the basic blocks or when the registers run out.
+typedef struct image_t_stack image_t_stack;
+struct image_t_stack
+{
+    image_t* image; // Output of the code
+    const char* pool; // Registers r8 + pool[i] that may hold the items
+    unsigned pool_size;
+    image_t_stack_item items[IMAGE_T_STACK_ITEMS]; // The items, the top one is the last
+    unsigned size; // Number of the items
+    bool is_busy[8]; // Registers r8...r15 holding the items
+};
+
+// Constructs the image, the source isn't copied: it must live until the image is destructed
 bool image_t_construct(image_t* This, const buffer_t* source);
+// Constructs the image without the source: only the emitters can be used
+bool image_t_construct_empty(image_t* This);
 // Destroys the image
 void image_t_destruct (image_t* This);
 // Checks wether the struct is ok
@@ -51,16 +248,78 @@ void image_t_dump_ (const image_t* This, const char name[]);
 size_t image_t_load_data(image_t* This);
 size_t image_t_get_jmp (image_t* This, const char source[]);
 void image_t_write_offset (image_t* This);
-inline void image_t_update_offset (image_t* This);
+int image_t_get_target (image_t* This, const char source[]);
+bool image_t_resolve (image_t* This);
+char* image_t_address (image_t* This, unsigned kind);
+void image_t_get_address (image_t* This, unsigned kind);
+void image_t_relocate (image_t* This);
+uint64_t image_t_hash (const image_t* This);
+bool image_t_cache_path (const image_t* This, const char dir[], char path[]);
+bool image_t_load_cache (image_t* This, const char dir[]);
+bool image_t_save_cache (const image_t* This, const char dir[]);
 void image_t_execute (image_t* This);
-bool image_t_iterate(image_t* This);
+bool image_t_iterate(image_t* This, const ir_t* ir);
 bool image_t_translate(image_t* This);
+size_t image_t_memory_width (unsigned char code);
 void image_t_handle_stream(image_t* This);
+void image_t_read_input(image_t* This, char type);
+void image_t_unread_input(image_t* This);
+bool image_t_input_is_ready(const stream_t* stream, char type);
 void image_t_call_handler(image_t* This);
-#define CMD(name, key, shift_to_the_right, arguments_type) \
+void image_t_call_function(image_t* This, unsigned kind);
+void image_t_debug(image_t* This, const uint64_t saved[]);
+void image_t_get_register_move(image_t* This, char address, char prefix, char opcode, bool is_byte);
+void image_t_print_value(char type, const char value[]);
+void image_t_flush_output(image_t* This);
+void image_t_get_output(image_t* This, char type);
+void image_t_get_input(image_t* This, char type);
+void image_t_get_flags (image_t* This, char set_less);
+void image_t_get_return_stub (image_t* This);
+void image_t_get_flags_in (image_t* This, char set_less, char less, char equal);
+void image_t_get_float_flags_in (image_t* This, char less, char equal);
+void image_t_merge_flags (image_t* This, char less, char equal);
+char image_t_get_condition (image_t* This, unsigned char code);
+char image_t_host_register (char address);
+void image_t_get_memory_move (image_t* This, char reg, char opcode, const char address[]);
+size_t image_t_peephole (image_t* This, const ir_t* ir, size_t index);
+void image_t_stack_construct (image_t_stack* stack, image_t* image, const char pool[], unsigned pool_size);
+void image_t_stack_store (image_t_stack* stack, const image_t_stack_item* item, char offset);
+void image_t_stack_spill (image_t_stack* stack);
+void image_t_stack_flush (image_t_stack* stack);
+char image_t_stack_alloc (image_t_stack* stack);
+image_t_stack_item* image_t_stack_push (image_t_stack* stack, bool is_const, unsigned value);
+void image_t_stack_drop (image_t_stack* stack);
+void image_t_stack_take (image_t_stack* stack, unsigned nitems);
+char image_t_stack_to_reg (image_t_stack* stack, unsigned depth);
+bool image_t_stack_emit (image_t_stack* stack, unsigned char code, const char source[]);
+#define CMD(name, key, shift_to_the_right, arguments_type, pops, pushes) \
 size_t image_t_get_##name(image_t* This, const char source[]);
 #include "commands.h"
-#undef CMD//*/
+#undef CMD
+#define IR_T_INSN(name, code) \
+size_t image_t_get_##name(image_t* This, const char source[]);
+IR_T_INSNS
+#undef IR_T_INSN
+
+// Emitter and the maximum size of the translation of every command
+typedef struct image_t_emitter image_t_emitter;
+struct image_t_emitter
+{
+    size_t (*get)(image_t* This, const char source[]); // Appends the translation, returns the size of the arguments
+    unsigned char max_size;
+};
+static const image_t_emitter IMAGE_T_COVERAGE[UCHAR_MAX + 1] =
+{
+    #define CMD(name, key, shift_to_the_right, arguments_type, pops, pushes) \
+    [key] = {image_t_get_##name, IMAGE_T_MAX_SIZE_##name},
+    #include "commands.h"
+    #undef CMD
+    #define IR_T_INSN(name, code) \
+    [code] = {image_t_get_##name, IMAGE_T_MAX_SIZE_##name},
+    IR_T_INSNS
+    #undef IR_T_INSN
+};
+
 void image_t_handle_stream(image_t* This)
 {
     /*int counter = 0;
@@ -68,44 +327,16 @@ void image_t_handle_stream(image_t* This)
     for (char* i = This->out_stream; counter < 8; i++, counter++){
         printf ("%02X ", (unsigned int)((*i) & 0xFF));
     }
-    printf ("Info:\n");
-    counter = 0;
-    for (char* i = This->in_stream; counter < 8; i++, counter++){
-        printf ("%02X ", (unsigned int)((*i) & 0xFF));
-    }
     printf ("Info:\n");//*/
+    // The values written before must be printed first
+    image_t_flush_output(This);
     switch (This->out_stream[0])
     {
     case SIG_IN:
-        switch (This->out_stream[1])
-        {
-        case INT:
-            printf (ANSI_COLOR_YELLOW "IN" ANSI_COLOR_GREEN "[" "int" "]" ANSI_COLOR_YELLOW ">" ANSI_COLOR_RESET);
-            scanf ("%d", (int*)This->in_stream);
-            break;
-        case FLOAT:
-            printf (ANSI_COLOR_YELLOW "IN" ANSI_COLOR_GREEN "[" "float" "]" ANSI_COLOR_YELLOW ">" ANSI_COLOR_RESET);
-            scanf ("%f", (float*)This->in_stream);
-            break;
-        case CHAR:
-            printf (ANSI_COLOR_YELLOW "IN" ANSI_COLOR_GREEN "[" "char" "]" ANSI_COLOR_YELLOW ">" ANSI_COLOR_RESET);
-            scanf ("%c", (char*)This->in_stream);
-            break;
-        }
+        image_t_read_input(This, This->out_stream[1]);
         break;
     case SIG_OUT:
-        switch (This->out_stream[1])
-        {
-        case INT:
-            printf (ANSI_COLOR_YELLOW "OUT" ANSI_COLOR_GREEN "[" "int" "]"ANSI_COLOR_YELLOW">" ANSI_COLOR_RESET "%d" "\n", *((int*)(This->out_stream + 2)));
-            break;
-        case FLOAT:
-            printf (ANSI_COLOR_YELLOW "OUT" ANSI_COLOR_GREEN "[" "float" "]"ANSI_COLOR_YELLOW">" ANSI_COLOR_RESET "%f" "\n", *((float*)(This->out_stream + 2)));
-            break;
-        case CHAR:
-            printf (ANSI_COLOR_YELLOW "OUT" ANSI_COLOR_GREEN "[" "char" "]"ANSI_COLOR_YELLOW">" ANSI_COLOR_RESET "%c" "\n", *((char*)(This->out_stream + 2)));
-            break;
-        }
+        image_t_print_value(This->out_stream[1], This->out_stream + 2);
         break;
     case SIG_STOP:
         This->state = INTERRUPTED;
@@ -114,12 +345,360 @@ void image_t_handle_stream(image_t* This)
     }
     //__asm__ ("int $0x3;");
 }
+void image_t_print_value(char type, const char value[])
+{
+    switch (type)
+    {
+    case INT:
+        printf (ANSI_COLOR_YELLOW "OUT" ANSI_COLOR_GREEN "[" "int" "]"ANSI_COLOR_YELLOW">" ANSI_COLOR_RESET "%d" "\n", *((int*)value));
+        break;
+    case FLOAT:
+        printf (ANSI_COLOR_YELLOW "OUT" ANSI_COLOR_GREEN "[" "float" "]"ANSI_COLOR_YELLOW">" ANSI_COLOR_RESET "%f" "\n", *((float*)value));
+        break;
+    case CHAR:
+        printf (ANSI_COLOR_YELLOW "OUT" ANSI_COLOR_GREEN "[" "char" "]"ANSI_COLOR_YELLOW">" ANSI_COLOR_RESET "%c" "\n", *value);
+        break;
+    }
+}
+
+// Prints the values written by the translated program, it is called when the buffer is full
+void image_t_flush_output(image_t* This)
+{
+    if (!This->output)
+        return;
+    for (unsigned i = 0; i < This->output->size; i++)
+        image_t_print_value(This->output->values[i].type, (char*)&This->output->values[i].value);
+    This->output->size = 0;
+}
+
+// Parses the next batch of the values of the type for the translated program. Only the first value may wait
+// for the input (and gets the prompt), the others are the ones that are read already
+void image_t_read_input(image_t* This, char type)
+{
+    static const char* names[] = {"int", "float", "char"};
+    image_t_input* input = This->input;
+    stream_t* stream = &input->stream;
+    image_t_unread_input(This);
+    printf (ANSI_COLOR_YELLOW "IN" ANSI_COLOR_GREEN "[%s]" ANSI_COLOR_YELLOW ">" ANSI_COLOR_RESET, names[(int)type]);
+    fflush(stdout);
+    unsigned size = 0;
+    do{
+        unsigned value = 0;
+        bool is_read = (type == INT)? stream_t_scan_int(stream, (int*)&value) :
+                       (type == FLOAT)? stream_t_scan_float(stream, (float*)&value) :
+                       stream_t_scan_char(stream, (char*)&value);
+        if (!is_read && size){
+            // The word is read again by the next batch
+            stream->position = input->ends[size - 1];
+            break;
+        }
+        // As in the processor, the value that can't be read is zero
+        if (!is_read){
+            printf (ANSI_COLOR_RED "*BEEP-BEEP-BEEP*" ANSI_COLOR_RESET "[scanning error]\n");
+            value = 0;
+        }
+        input->values[size] = value;
+        input->ends[size] = stream->position;
+        size++;
+    } while (size < IMAGE_T_INPUT_SIZE && image_t_input_is_ready(stream, type));
+    input->sizes[(int)type] = size;
+}
+
+// Gives the values of the batch that are not taken back to the stream
+void image_t_unread_input(image_t* This)
+{
+    image_t_input* input = This->input;
+    unsigned size = input->sizes[INT] + input->sizes[FLOAT] + input->sizes[CHAR];
+    if (input->position && input->position < size)
+        input->stream.position = input->ends[input->position - 1];
+    memset(input->sizes, 0, sizeof(input->sizes));
+    input->position = 0;
+}
+
+// If the next value is in the buffer of the stream as a whole, so it is parsed without reading the file
+bool image_t_input_is_ready(const stream_t* stream, char type)
+{
+    size_t i = stream->position;
+    if (type == CHAR)
+        return i < stream->size;
+    while (i < stream->size && isspace((unsigned char)stream->data[i]))
+        i++;
+    if (i == stream->size)
+        return false;
+    while (i < stream->size && !isspace((unsigned char)stream->data[i]))
+        i++;
+    return i < stream->size || stream->is_eof;
+}
+
+// Shows the registers saved by image_t_get_debug and waits for Enter, as the processor does in the debug mode
+void image_t_debug(image_t* This, const uint64_t saved[])
+{
+    // Places of the host registers of eax...edi among the saved ones (see image_t_call_function)
+    static const unsigned places[REG_NUMBER] = {8, 7, 6, 5, 2, 9, 4, 3};
+    // Then the flags are in r12
+    const unsigned flags_place = 10;
+    image_t_flush_output(This);
+    #define ADDRESS(_name, _address, _size, _cmd_offset) \
+    if (_size == 4){\
+        printf (ANSI_COLOR_YELLOW "[" #_name "] " ANSI_COLOR_RESET);\
+        for (unsigned i = 0; i < 4; i ++)\
+            printf ("%02X ", (unsigned)((saved[places[_address / REG_SIZE]] >> (8*i)) & 0xFF));\
+        printf ("\n");\
+    }
+    #include "reg_address.h"
+    #undef ADDRESS
+    printf (ANSI_COLOR_YELLOW "[fla]" ANSI_COLOR_RESET " %02X\n", (unsigned)(saved[flags_place] & 0x3));
+    // The input read ahead goes first
+    char symbol = 0;
+    if (This->input){
+        image_t_unread_input(This);
+        stream_t_read(&This->input->stream, &symbol, sizeof(char));
+    }
+    else
+        getchar();
+}
+
 bool image_t_translate(image_t* This)
 {
-    // Loading the map
-    image_t_iterate(This);
-    // Writing all addresses
-    return (image_t_iterate(This));
+    ir_t ir;
+    if (!ir_t_construct(&ir, &This->source))
+        return false;
+    size_t changes = (This->is_optimized)? ir_t_optimize(&ir) : 0;
+    #if defined(VERBOSE)
+    printf ("IR changes: %lu\n", changes);
+    #endif // VERBOSE
+    (void)changes;
+    // Translating in one pass
+    bool is_ok = image_t_iterate(This, &ir);
+    ir_t_destruct(&ir);
+    if (!is_ok)
+        return false;
+    // Writing the addresses of the forward jumps
+    return (image_t_resolve(This));
+}
+
+// Returns the number of the bytes accessed by the memory operand of the command, 0 if it has no such operand
+size_t image_t_memory_width (unsigned char code)
+{
+    switch (code)
+    {
+    case cmd_push_mem_byte:
+    case cmd_pop_mem_byte:
+        return sizeof(char);
+    case cmd_push_mem_word:
+    case cmd_pop_mem_word:
+        return sizeof(short);
+    case cmd_push_mem_dword:
+    case cmd_pop_mem_dword:
+        return sizeof(int);
+    default:
+        return 0;
+    }
+}
+
+// Returns rel32 of the jump to the target: it must be appended to the binary right after the call.
+// If the target is not translated yet, rel32 will be written by image_t_resolve.
+int image_t_get_target (image_t* This, const char source[])
+{
+    unsigned target = *((unsigned*)source);
+    if (target < This->source.size && This->map[target] != IMAGE_T_UNKNOWN)
+        return (int)This->map[target] - (int)(This->binary.size + sizeof(int) - IMAGE_T_HEADER_SIZE);
+    This->fixups[This->fixups_size].at = This->binary.size;
+    This->fixups[This->fixups_size].target = target;
+    This->fixups_size++;
+    return 0;
+}
+
+bool image_t_resolve (image_t* This)
+{
+    for (size_t i = 0; i < This->fixups_size; i++){
+        unsigned target = This->fixups[i].target;
+        unsigned destination = This->return_stub;
+        if (target != IMAGE_T_UNKNOWN){
+            if (target >= This->source.size || This->map[target] == IMAGE_T_UNKNOWN){
+                printf ("image_t_resolve: Error! Jump to %u is not at the instruction\n", target);
+                return false;
+            }
+            destination = This->map[target];
+        }
+        int relative = (int)destination - (int)(This->fixups[i].at + sizeof(int) - IMAGE_T_HEADER_SIZE);
+        memcpy(This->binary.data + This->fixups[i].at, &relative, sizeof(int));
+    }
+    This->fixups_size = 0;
+    return true;
+}
+
+char* image_t_address (image_t* This, unsigned kind)
+{
+    switch (kind)
+    {
+    case ADDR_IMAGE:
+        return (char*)This;
+    case ADDR_HANDLER:
+        return (char*)&image_t_handle_stream;
+    case ADDR_OUT_STREAM:
+        return This->out_stream;
+    case ADDR_INPUT:
+        return (char*)This->input;
+    case ADDR_RETURN_STACK:
+        return This->return_stack + IMAGE_T_RETURN_STACK;
+    case ADDR_MAP:
+        return (char*)This->map;
+    case ADDR_OUTPUT:
+        return (char*)This->output;
+    case ADDR_FLUSH:
+        return (char*)&image_t_flush_output;
+    case ADDR_HOST_SP:
+        return (char*)&This->host_sp;
+    case ADDR_DEBUG:
+        return (char*)&image_t_debug;
+    default:
+        return NULL;
+    }
+}
+
+// Appends the absolute address and remembers its place for image_t_relocate
+void image_t_get_address (image_t* This, unsigned kind)
+{
+    if (This->relocs_size == This->relocs_max_size){
+        size_t max_size = (This->relocs_max_size)? 2*This->relocs_max_size : 16;
+        image_t_reloc* relocs = (image_t_reloc*)realloc(This->relocs, max_size*sizeof(image_t_reloc));
+        if (relocs){
+            This->relocs = relocs;
+            This->relocs_max_size = max_size;
+        }
+    }
+    if (This->relocs_size < This->relocs_max_size){
+        This->relocs[This->relocs_size].at = This->binary.size;
+        This->relocs[This->relocs_size].kind = kind;
+        This->relocs_size++;
+    }
+    char* address = image_t_address(This, kind);
+    buffer_t_append(&This->binary, (char*)&address, sizeof(char*));
+}
+
+// Writes the addresses of this run to the binary
+void image_t_relocate (image_t* This)
+{
+    for (size_t i = 0; i < This->relocs_size; i++){
+        char* address = image_t_address(This, This->relocs[i].kind);
+        memcpy(This->binary.data + This->relocs[i].at, (char*)&address, sizeof(char*));
+    }
+}
+
+// FNV-1a of the source, the version of the translation and the switches of the optimizations
+uint64_t image_t_hash (const image_t* This)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    unsigned version = (IMAGE_T_VERSION*2 + IMAGE_T_STACK_CACHE)*4 + This->is_optimized*2 + This->is_peephole;
+    for (size_t i = 0; i < sizeof(version); i++)
+        hash = (hash ^ ((unsigned char*)&version)[i]) * 1099511628211ULL;
+    // The memory operands are checked against the size of the memory
+    for (size_t i = 0; i < sizeof(This->memory_size); i++)
+        hash = (hash ^ ((unsigned char*)&This->memory_size)[i]) * 1099511628211ULL;
+    for (size_t i = 0; i < This->source.size; i++)
+        hash = (hash ^ (unsigned char)This->source.data[i]) * 1099511628211ULL;
+    return hash;
+}
+
+bool image_t_cache_path (const image_t* This, const char dir[], char path[])
+{
+    int length = snprintf(path, PATH_MAX, "%s/%016" PRIx64 ".tr", dir, image_t_hash(This));
+    return (length > 0 && length < PATH_MAX);
+}
+
+// Loads the translation made by image_t_save_cache.
+// Returns false if there is no translation of the source in the cache.
+bool image_t_load_cache (image_t* This, const char dir[])
+{
+    ASSERT_OK(image_t, This);
+    char path[PATH_MAX];
+    if (!image_t_cache_path(This, dir, path))
+        return false;
+    FILE* f = fopen(path, "rb");
+    if (!f)
+        return false;
+    image_t_cache_header header;
+    bool is_ok = fread(&header, sizeof(header), 1, f) == 1 &&
+                 !memcmp(header.magic, "SPTR", 4) &&
+                 header.version == IMAGE_T_VERSION &&
+                 header.hash == image_t_hash(This) &&
+                 header.source_size == This->source.size &&
+                 header.binary_size >= IMAGE_T_HEADER_SIZE &&
+                 header.return_stub < header.binary_size;
+    // The source is compared as the hash can collide
+    char* source = (is_ok)? (char*)malloc(This->source.size) : NULL;
+    is_ok = is_ok && source &&
+            fread(source, 1, This->source.size, f) == This->source.size &&
+            !memcmp(source, This->source.data, This->source.size);
+    free(source);
+    is_ok = is_ok && fread(This->map, sizeof(unsigned), This->source.size, f) == This->source.size;
+    if (is_ok && header.relocs_size > This->relocs_max_size){
+        image_t_reloc* relocs = (image_t_reloc*)realloc(This->relocs, header.relocs_size*sizeof(image_t_reloc));
+        if (relocs){
+            This->relocs = relocs;
+            This->relocs_max_size = header.relocs_size;
+        }
+        is_ok = relocs;
+    }
+    is_ok = is_ok && fread(This->relocs, sizeof(image_t_reloc), header.relocs_size, f) == header.relocs_size;
+    This->binary.size = 0;
+    is_ok = is_ok && buffer_t_reserve(&This->binary, header.binary_size) &&
+            fread(This->binary.data, 1, header.binary_size, f) == header.binary_size;
+    fclose(f);
+    for (size_t i = 0; is_ok && i < header.relocs_size; i++)
+        is_ok = This->relocs[i].at + sizeof(char*) <= header.binary_size && This->relocs[i].kind < ADDR_NUMBER;
+    if (!is_ok){
+        printf ("image_t_load_cache: Error! %s is corrupted\n", path);
+        This->relocs_size = 0;
+        memset(This->map, 0xFF, This->source.size*sizeof(unsigned));
+        return false;
+    }
+    This->binary.size = header.binary_size;
+    This->relocs_size = header.relocs_size;
+    This->return_stub = header.return_stub;
+    image_t_relocate (This);
+    This->is_mapped = true;
+    return true;
+}
+
+// Saves the translation to the directory, the name of the file is the hash of the source
+bool image_t_save_cache (const image_t* This, const char dir[])
+{
+    ASSERT_OK(image_t, This);
+    if (!This->is_mapped)
+        return false;
+    char path[PATH_MAX];
+    char temp_path[PATH_MAX + 32];
+    if (!image_t_cache_path(This, dir, path))
+        return false;
+    // The file appears at once: the other translators never read a half of it
+    snprintf(temp_path, sizeof(temp_path), "%s.%d", path, (int)getpid());
+    FILE* f = fopen(temp_path, "wb");
+    if (!f){
+        perror("image_t_save_cache: (can't open file)");
+        return false;
+    }
+    image_t_cache_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "SPTR", 4);
+    header.version = IMAGE_T_VERSION;
+    header.hash = image_t_hash(This);
+    header.source_size = This->source.size;
+    header.binary_size = This->binary.size;
+    header.relocs_size = This->relocs_size;
+    header.return_stub = This->return_stub;
+    bool is_ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+                 fwrite(This->source.data, 1, This->source.size, f) == This->source.size &&
+                 fwrite(This->map, sizeof(unsigned), This->source.size, f) == This->source.size &&
+                 fwrite(This->relocs, sizeof(image_t_reloc), This->relocs_size, f) == This->relocs_size &&
+                 fwrite(This->binary.data, 1, This->binary.size, f) == This->binary.size;
+    is_ok = !fclose(f) && is_ok && !rename(temp_path, path);
+    if (!is_ok){
+        perror("image_t_save_cache: (can't write file)");
+        remove(temp_path);
+    }
+    return is_ok;
 }
 
 void image_t_destruct (image_t* This)
@@ -127,8 +706,25 @@ void image_t_destruct (image_t* This)
     assert (This);
     if (This->map)
         free(This->map);
+    This->map = NULL;
+    free(This->fixups);
+    This->fixups = NULL;
+    This->fixups_size = 0;
+    free(This->relocs);
+    This->relocs = NULL;
+    This->relocs_size = 0;
+    This->relocs_max_size = 0;
+    free(This->return_stack);
+    This->return_stack = NULL;
+    free(This->output);
+    This->output = NULL;
+    if (This->input)
+        stream_t_destruct(&This->input->stream);
+    free(This->input);
+    This->input = NULL;
     This->resume_pos = NULL;
     This->is_mapped = false;
+    buffer_t_destruct(&This->source);
     buffer_t_destruct(&This->binary);
 }
 
@@ -148,6 +744,9 @@ void image_t_dump_ (const image_t* This, const char name[])
         printf (ANSI_COLOR_RED "ERROR" ANSI_COLOR_RESET ")\n");
     printf(ANSI_COLOR_YELLOW "-----------------------------------------------------" ANSI_COLOR_RESET "\n");
     printf ("%*sis_mapped = %d\n", DUMP_INDENT, "", This->is_mapped);
+    printf ("%*sis_optimized = %d\n", DUMP_INDENT, "", This->is_optimized);
+    printf ("%*sis_peephole = %d\n", DUMP_INDENT, "", This->is_peephole);
+    printf ("%*smemory_size = %u\n", DUMP_INDENT, "", This->memory_size);
     printf ("%*smap = %p\n", DUMP_INDENT, "", This->map);
     printf ("%*ssource: ", DUMP_INDENT, "");
     //buffer_t_dump(&This->source);
@@ -162,52 +761,150 @@ bool image_t_construct(image_t* This, const buffer_t* source)
     assert(This);
     This->state = STOPPED;
     This->resume_pos = NULL;
-    if (!buffer_t_construct_copy(&This->source, source))
+    if (!buffer_t_construct_view(&This->source, source))
         return false;
     This->map = (unsigned*)malloc(This->source.size*sizeof(unsigned));
-    if (!This->map){
+    // One fixup for an instruction at most
+    This->fixups = (image_t_fixup*)malloc((This->source.size + 1)*sizeof(image_t_fixup));
+    This->fixups_size = 0;
+    This->relocs = NULL;
+    This->relocs_size = 0;
+    This->relocs_max_size = 0;
+    This->return_stack = (char*)malloc(IMAGE_T_RETURN_STACK);
+    This->output = (image_t_output*)malloc(sizeof(image_t_output));
+    This->input = (image_t_input*)malloc(sizeof(image_t_input));
+    if (!This->map || !This->fixups || !This->return_stack || !This->output || !This->input){
         perror("image_t_construct: Can't allocate map!");
         return false;
     }
-    memset(This->map, 0x0, This->source.size*sizeof(unsigned));
-    memset(This->in_stream, 0x0, 8);
+    memset(This->map, 0xFF, This->source.size*sizeof(unsigned));
+    This->output->size = 0;
+    memset(This->input->sizes, 0, sizeof(This->input->sizes));
+    This->input->position = 0;
+    if (!stream_t_construct(&This->input->stream, STDIN_FILENO, STREAM_SIZE))
+        return false;
     memset(This->out_stream, 0x0, 8);
     This->is_mapped = false;
+    This->is_optimized = true;
+    This->is_peephole = true;
+    This->memory_size = IMAGE_T_MEMORY_SIZE;
+    memset(This->peepholes, 0, sizeof(This->peepholes));
     return (buffer_t_construct(&This->binary, source->size, true));
 }
 
+bool image_t_construct_empty(image_t* This)
+{
+    assert(This);
+    This->state = STOPPED;
+    This->resume_pos = NULL;
+    This->map = NULL;
+    This->fixups = NULL;
+    This->fixups_size = 0;
+    This->relocs = NULL;
+    This->relocs_size = 0;
+    This->relocs_max_size = 0;
+    This->return_stack = NULL;
+    This->output = NULL;
+    This->input = NULL;
+    This->is_mapped = false;
+    This->is_optimized = false;
+    This->is_peephole = false;
+    This->memory_size = IMAGE_T_MEMORY_SIZE;
+    memset(This->peepholes, 0, sizeof(This->peepholes));
+    memset(This->out_stream, 0x0, 8);
+    if (!buffer_t_construct(&This->source, 1, true))
+        return false;
+    return (buffer_t_construct(&This->binary, 256, true));
+}
+
 // In case you want some checks :)
 /*if (This->is_mapped){ \
                 printf ("Translating: " #name "\n"); \
 }//*/
-bool image_t_iterate(image_t* This)
+// Lowers the IR: every instruction is mapped to the start of its translation
+bool image_t_iterate(image_t* This, const ir_t* ir)
 {
     ASSERT_OK(image_t, This);
     ASSERT_OK(buffer_t, &This->source);
-    buffer_t_destruct(&This->binary);
-    buffer_t_construct(&This->binary, 2, 1);
-    // Load data section into the image
-    size_t pos = image_t_load_data(This);
-    while (pos < This->source.size){
-        bool is_done = false;
-        This->map[pos] = This->binary.size - 14;
-        //if (This->is_mapped) printf ("This->source.data[%lu] == %hu\n", pos, This->source.data[pos]);
-        #define CMD(name, key, shift_to_the_right, arguments_type) \
-        if (!is_done && This->source.data[pos] == key){ \
-            pos++;\
-            pos += image_t_get_##name(This, This->source.data+pos); \
-            is_done = true; \
+    ASSERT_OK(ir_t, ir);
+    This->binary.size = 0;
+    This->fixups_size = 0;
+    This->relocs_size = 0;
+    // Every instruction takes a byte at least
+    if (!buffer_t_reserve(&This->binary, IMAGE_T_HEADER_SIZE + IMAGE_T_INSN_MAX_SIZE*This->source.size))
+        return false;
+    // The data section stays in the memory of the program, the code goes after the loader
+    if (!image_t_load_data(This))
+        return false;
+    if (This->source.size > This->memory_size){
+        printf ("image_t_iterate: Error! The program of %lu bytes doesn't fit into the memory of %u bytes\n",
+                (unsigned long)This->source.size, This->memory_size);
+        return false;
+    }
+    memset(This->peepholes, 0, sizeof(This->peepholes));
+    // The stack is in the memory at the beginnings of the blocks, before the jumps, the calls,
+    // the I/O and every instruction that isn't modeled
+    image_t_stack stack;
+    image_t_stack_construct(&stack, This, IMAGE_T_POOL, sizeof(IMAGE_T_POOL));
+    for (size_t i = 0; i < ir->size;){
+        const ir_t_insn* insn = ir->insns + i;
+        // The memory operands are checked once here, the translation accesses them as they are
+        size_t width = image_t_memory_width(insn->code);
+        unsigned address = 0;
+        memcpy(&address, insn->operand, sizeof(unsigned));
+        if (width && (address > This->memory_size || This->memory_size - address < width)){
+            printf ("image_t_iterate: Error! The address %u at %u is out of the memory of %u bytes\n",
+                    address, insn->pos, This->memory_size);
+            return false;
+        }
+        if (insn->is_leader)
+            image_t_stack_flush(&stack);
+        This->map[insn->pos] = This->binary.size - IMAGE_T_HEADER_SIZE;
+        // The pairs of IMAGE_T_PEEPHOLES work on the stack in the memory: the empty model hands
+        // them to image_t_peephole and takes only the instructions that aren't paired
+        size_t next = (This->is_peephole && !stack.size)? image_t_peephole(This, ir, i) : 0;
+        if (!next && IMAGE_T_STACK_CACHE && image_t_stack_emit(&stack, insn->code, insn->operand)){
+            i++;
+            continue;
+        }
+        if (!next && stack.size){
+            image_t_stack_flush(&stack);
+            next = (This->is_peephole)? image_t_peephole(This, ir, i) : 0;
+        }
+        if (next){
+            i = next;
+            continue;
         }
-        #include "commands.h"
-        #undef CMD
-        /*if (This->is_mapped){
-            buffer_t_dump(&This->binary);
-            getchar();
-        }//*/
+        if (!IMAGE_T_COVERAGE[insn->code].get){
+            printf ("image_t_iterate: Error! Unknown command %u at %u\n", insn->code, insn->pos);
+            return false;
+        }
+        #if defined(DEBUG)
+        size_t begin = This->binary.size;
+        #endif // DEBUG
+        IMAGE_T_COVERAGE[insn->code].get(This, insn->operand);
+        #if defined(DEBUG)
+        if (This->binary.size - begin > IMAGE_T_COVERAGE[insn->code].max_size)
+            printf ("image_t_iterate: Error! IMAGE_T_MAX_SIZE[%u] is too small\n", insn->code);
+        #endif // DEBUG
+        i++;
     }
+    image_t_stack_flush(&stack);
     //*/
+    #if defined(VERBOSE)
+    unsigned peepholes = 0;
+    for (unsigned i = 0; i < IMAGE_T_PEEPHOLES_NUMBER; i++)
+        peepholes += This->peepholes[i];
+    printf ("Peephole pairs: %u\n", peepholes);
+    #define IMAGE_T_PEEPHOLE(_name, _code_1, _code_2) \
+    if (This->peepholes[IMAGE_T_PEEPHOLE_ ## _name])\
+        printf ("    " #_name ": %u\n", This->peepholes[IMAGE_T_PEEPHOLE_ ## _name]);
+    IMAGE_T_PEEPHOLES
+    #undef IMAGE_T_PEEPHOLE
+    #endif // VERBOSE
+    This->return_stub = This->binary.size - IMAGE_T_HEADER_SIZE;
+    image_t_get_return_stub (This);
     This->is_mapped = true;
-    image_t_update_offset (This);
     return true;
 }
 
@@ -215,198 +912,362 @@ size_t image_t_load_data(image_t* This)
 {
     ASSERT_OK(image_t, This);
     #if defined(VERBOSE)
-    if (This->is_mapped) printf ("Loading data section...\n");
+    printf ("Loading data section...\n");
     #endif // VERBOSE
+    // The base of the memory is written by image_t_execute.
+    // rbp is the ebp of the program, so the stack pointer to return with is saved to the image
     //55                   	push   %rbp
-    //48 89 e5             	mov    %rsp,%rbp
-
-    char offset_loader[] = {0x55, 0x48, 0x89, 0xe5, 0x49, 0xBE, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0};
-    buffer_t_append(&This->binary, offset_loader, 14);
-    if (*This->source.data != cmd_jmp){
+    //49 be .. .. .. .. .. .. .. .. 	movabs $0x...,%r14
+    //49 ba .. .. .. .. .. .. .. .. 	movabs $0x...,%r10
+    //49 bd .. .. .. .. .. .. .. .. 	movabs $0x...,%r13
+    //49 89 65 00          	mov    %rsp,0x0(%r13)
+    // The registers and the flags are zeros, as in the processor
+    //31 c0 31 c9 31 d2 31 db 	xor    %eax,%eax ... %ebx,%ebx
+    //45 31 c0 31 ed 31 f6 31 ff 	xor    %r8d,%r8d ... %edi,%edi
+    //45 31 e4             	xor    %r12d,%r12d
+
+    char offset_loader[] = {0x55, 0x49, 0xBE, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x49, 0xBA};
+    buffer_t_append(&This->binary, offset_loader, sizeof(offset_loader));
+    image_t_get_address(This, ADDR_RETURN_STACK);
+    char load_host_sp[] = {0x49, 0xbd};
+    buffer_t_append(&This->binary, load_host_sp, sizeof(load_host_sp));
+    image_t_get_address(This, ADDR_HOST_SP);
+    char save_host_sp[] = {0x49, 0x89, 0x65, 0x00};
+    buffer_t_append(&This->binary, save_host_sp, sizeof(save_host_sp));
+    char clear[] = {0x31, 0xc0, 0x31, 0xc9, 0x31, 0xd2, 0x31, 0xdb, 0x45, 0x31, 0xc0, 0x31, 0xed, 0x31, 0xf6, 0x31, 0xff,
+                    0x45, 0x31, 0xe4};
+    buffer_t_append(&This->binary, clear, sizeof(clear));
+    unsigned jmp_pos = 0;
+    if (This->source.size >= 1 + sizeof(unsigned) && *This->source.data == cmd_jmp)
+        jmp_pos = *((unsigned*)(This->source.data+1));
+    if (jmp_pos < 1 + sizeof(unsigned) || jmp_pos > This->source.size){
         printf ("image_t_load_data: Error! The data section is corrupted!\n");
         return 0;
     }
-    unsigned jmp_pos = *((unsigned*)(This->source.data+1));
-    // Substract first 2 bytes
-    size_t nbytes = jmp_pos - 2;
-    // Loading the jump
-    image_t_get_jmp (This, This->source.data+1);
-    // Loading the data itself
-    buffer_t_append(&This->binary, This->source.data+2, nbytes);
+    // The data is in the memory given to the program, so the code pages are never written
+    // while the program runs: the stores near the code would be taken for the self-modifying code
     return (size_t)jmp_pos;
 }
 
-inline void image_t_update_offset (image_t* This)
+// Arena of the executed images: the code of the finished image is reused by the next one
+arena_t* image_t_arena ()
 {
-    // Program begins after first 10 bytes of the This->binary
-    char* prog_offset = This->binary.data + 14;
-    // Loading offset
-    memcpy(This->binary.data + 6, (char*)(&prog_offset), sizeof(char*));
+    static arena_t arena;
+    static bool is_constructed = false;
+    if (!is_constructed)
+        is_constructed = arena_t_construct(&arena, ARENA_SLAB_SIZE, ARENA_AUTO);
+    return (is_constructed)? &arena : NULL;
 }
 
 void image_t_execute (image_t* This)
 {
     //buffer_t_dump(&This->binary);
-     //uint8_t secret_place = mmap (NULL, nbytes, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    char* executable = mmap (NULL, This->binary.size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    // For debugging
-    //memset(executable, This->binary.size, 0xC3);
-    memcpy(executable, This->binary.data, This->binary.size);
-    // Program begins after first 10 bytes of the This->binary
-    char* prog_offset = executable + 14;
-    // Loading offset
-    memcpy(executable + 6, (char*)(&prog_offset), sizeof(char*));
-    void (*inject)() = (void(*)())executable;
+    arena_t* arena = image_t_arena();
+    char* executable = (arena)? arena_t_allocate(arena, This->binary.size) : NULL;
+    // The program works with its own copy of the memory, the addresses are the same as in the source.
+    // The rest of it is zeros, as in the processor
+    char* memory = (This->source.size <= This->memory_size)? (char*)calloc(This->memory_size, 1) : NULL;
+    if (!executable || !memory){
+        printf ("image_t_execute: Error! Can't allocate memory\n");
+        if (executable)
+            arena_t_free(arena, executable, This->binary.size);
+        free(memory);
+        return;
+    }
+    memcpy(memory, This->source.data, This->source.size);
+    // Loading the base of the memory
+    memcpy(This->binary.data + IMAGE_T_MEMORY_AT, (char*)(&memory), sizeof(char*));
+    if (!arena_t_write(arena, executable, This->binary.data, This->binary.size)){
+        arena_t_free(arena, executable, This->binary.size);
+        free(memory);
+        return;
+    }
     //__asm__ ("int $0x3;");
     This->state = RUNNING;
-    inject();
-    munmap(executable, This->binary.size);
+    // The translated program spoils the registers that must be saved by the callee (RBX, R12-R15)
+    __asm__ volatile ("call *%0" : : "m"(executable)
+                      : "rax", "rbx", "rcx", "rdx", "rsi", "rdi", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+                        "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7", "memory", "cc");
+    image_t_flush_output(This);
+    arena_t_free(arena, executable, This->binary.size);
+    free(memory);
     //printf ("Done!\n");
 }
 
-// Some magic: (This->flags & (0xFF ^ 0x3)) resets last 2 bits of flags (cmp flags)
-// Then we can set them again with (This->flags | FLAG)
-#define CMP(_name, _intel_codes) \
-bool image_t_get_ ## _name (image_t* This, const char source[]) \
-{\
-    char intel_opcodes[] = {_intel_codes}; \
-    buffer_t_append(&This->binary, intel_opcodes, sizeof(intel_opcodes));\
-    return 0; \
+// The compared values are popped only after the flags are saved: add spoils them.
+// The VM flags live in r12b (NEG_FLAG 0x2 if top < prev, ZRO_FLAG 0x1 if equal),
+// so they survive the pushes and arithmetics between the cmp and the conditional jump.
+//41 0f .. c5             setl/setb %r13b
+//41 0f 94 c7             sete   %r15b
+//45 00 ed                add    %r13b,%r13b
+//45 08 fd                or     %r15b,%r13b
+//41 80 e4 fc             and    $0xfc,%r12b
+//45 08 ec                or     %r13b,%r12b
+void image_t_get_flags (image_t* This, char set_less)
+{
+    image_t_get_flags_in (This, set_less, 0x5, 0x7);
+}
+
+// The same with any two of r8...r15 spoiled instead of r13 and r15
+void image_t_get_flags_in (image_t* This, char set_less, char less, char equal)
+{
+    char intel_opcodes[] = {0x41, 0x0f, set_less, 0xc0 | less, 0x41, 0x0f, 0x94, 0xc0 | equal};
+    buffer_t_append(&This->binary, intel_opcodes, sizeof(intel_opcodes));
+    image_t_merge_flags(This, less, equal);
 }
 
-//44 8b 6c 24 04        mov    0x4(%rsp),%r13d
-//44 39 2c 24           cmp    %r13d,(%rsp)
-//48 83 c4 08           add    $0x8,%rsp
+// The flags of ucomiss of prev with top: the unordered result (a NaN) sets CF, ZF and PF,
+// so neither flag is set for it, as the comparisons of the processor are false with a NaN
+//41 0f 97 c0+.           seta   %r..b
+//41 0f 94 c0+.           sete   %r..b
+//7b 03                   jnp    <merge>
+//45 31 ..                xor    %r..d,%r..d
+void image_t_get_float_flags_in (image_t* This, char less, char equal)
+{
+    char intel_opcodes[] = {0x41, 0x0f, 0x97, 0xc0 | less, 0x41, 0x0f, 0x94, 0xc0 | equal,
+                            0x7b, 0x03, 0x45, 0x31, 0xc0 | (equal << 3) | equal};
+    buffer_t_append(&This->binary, intel_opcodes, sizeof(intel_opcodes));
+    image_t_merge_flags(This, less, equal);
+}
+
+// Moves the set results from the two registers to r12b
+//45 00 ..                add    %r..b,%r..b
+//45 08 ..                or     %r..b,%r..b
+//41 80 e4 fc             and    $0xfc,%r12b
+//45 08 ..                or     %r..b,%r12b
+void image_t_merge_flags (image_t* This, char less, char equal)
+{
+    char intel_opcodes[] = {0x45, 0x00, 0xc0 | (less << 3) | less, 0x45, 0x08, 0xc0 | (equal << 3) | less,
+                            0x41, 0x80, 0xe4, 0xfc, 0x45, 0x08, 0xc4 | (less << 3)};
+    buffer_t_append(&This->binary, intel_opcodes, sizeof(intel_opcodes));
+}
+
+//44 8b 2c 24             mov    (%rsp),%r13d
+//44 8b 7c 24 04          mov    0x4(%rsp),%r15d
+//45 39 fd                cmp    %r15d,%r13d
+//flags (setl)
+//48 83 c4 08             add    $0x8,%rsp
 size_t image_t_get_cmp (image_t* This, const char source[])
 {
-    char intel_opcodes[] = {0x44, 0x8b, 0x6c, 0x24, 0x04, 0x44, 0x39, 0x2c, 0x24, 0x48, 0x83, 0xc4, 0x08};
+    char intel_opcodes[] = {0x44, 0x8b, 0x2c, 0x24, 0x44, 0x8b, 0x7c, 0x24, 0x04, 0x45, 0x39, 0xfd};
     buffer_t_append(&This->binary, intel_opcodes, sizeof(intel_opcodes));
+    image_t_get_flags(This, 0x9c);
+    char intel_pop[] = {0x48, 0x83, 0xc4, 0x08};
+    buffer_t_append(&This->binary, intel_pop, sizeof(intel_pop));
     return 0;
 }
-//49 89 ed             	mov    %rbp,%r13
-//48 89 e5             	mov    %rsp,%rbp
-//f3 0f 10 45 00       	movss  0x0(%rbp),%xmm0
-//48 83 c4 08          	add    $0x8,%rsp
-//0f 2e 45 fc          	ucomiss -0x4(%rbp),%xmm0
-//4c 89 ed             	mov    %r13,%rbp
+//f3 0f 10 44 24 04       movss  0x4(%rsp),%xmm0
+//0f 2e 04 24             ucomiss (%rsp),%xmm0
+//float flags
+//48 83 c4 08             add    $0x8,%rsp
 size_t image_t_get_fcmp (image_t* This, const char source[])
 {
-    char intel_opcodes[] = {0x49, 0x89, 0xed, 0x48, 0x89, 0xe5, 0xf3, 0x0f, 0x10, 0x45, 0x00, 0x48, 0x83, 0xc4, 0x08, 0x0f, 0x2e, 0x45, 0xfc, 0x4c, 0x89, 0xed};
+    char intel_opcodes[] = {0xf3, 0x0f, 0x10, 0x44, 0x24, 0x04, 0x0f, 0x2e, 0x04, 0x24};
     buffer_t_append(&This->binary, intel_opcodes, sizeof(intel_opcodes));
+    image_t_get_float_flags_in(This, 0x5, 0x7);
+    char intel_pop[] = {0x48, 0x83, 0xc4, 0x08};
+    buffer_t_append(&This->binary, intel_pop, sizeof(intel_pop));
     return 0;
 }
-//44 8a 2c 24          	mov    (%rsp),%r13b
-//44 3a 6c 24 01       	cmp    0x1(%rsp),%r13b
-//48 83 c4 02          	add    $0x2,%rsp
+//44 8a 2c 24             mov    (%rsp),%r13b
+//44 8a 7c 24 01          mov    0x1(%rsp),%r15b
+//45 38 fd                cmp    %r15b,%r13b
+//flags (setl)
+//48 83 c4 02             add    $0x2,%rsp
 size_t image_t_get_ccmp (image_t* This, const char source[])
 {
-    char intel_opcodes[] = {0x44, 0x8a, 0x2c, 0x24, 0x44, 0x3a, 0x6c, 0x24, 0x01, 0x48, 0x83, 0xc4, 0x02};
+    char intel_opcodes[] = {0x44, 0x8a, 0x2c, 0x24, 0x44, 0x8a, 0x7c, 0x24, 0x01, 0x45, 0x38, 0xfd};
     buffer_t_append(&This->binary, intel_opcodes, sizeof(intel_opcodes));
+    image_t_get_flags(This, 0x9c);
+    char intel_pop[] = {0x48, 0x83, 0xc4, 0x02};
+    buffer_t_append(&This->binary, intel_pop, sizeof(intel_pop));
     return 0;
 }
 
+// IMAGE_T_CONDITION(name, mask, is_zero): the jump is taken if (flags & mask) is zero (is_zero) or not
+#define IMAGE_T_CONDITIONS \
+IMAGE_T_CONDITION(ja,  0x3, true)\
+IMAGE_T_CONDITION(jae, 0x2, true)\
+IMAGE_T_CONDITION(jb,  0x2, false)\
+IMAGE_T_CONDITION(jbe, 0x3, false)\
+IMAGE_T_CONDITION(je,  0x1, false)\
+IMAGE_T_CONDITION(jne, 0x1, true)
+
+//41 f6 c4 ..             test   $0x..,%r12b
+/**
+*@brief Emits the test of the VM flags for the conditional jump.
+*@param This Pointer to the image to emit to.
+*@param code Code of the conditional jump.
+*@return Opcode of the short jcc (jz or jnz) that jumps if the VM jump is taken, 0 if the code is not a conditional jump.
+*/
+char image_t_get_condition (image_t* This, unsigned char code)
+{
+    char mask = 0;
+    bool is_zero = false;
+    switch (code)
+    {
+    #define IMAGE_T_CONDITION(_name, _mask, _is_zero) \
+    case cmd_ ## _name:\
+        mask = _mask;\
+        is_zero = _is_zero;\
+        break;
+    IMAGE_T_CONDITIONS
+    #undef IMAGE_T_CONDITION
+    default:
+        return 0;
+    }
+    char intel_test[] = {0x41, 0xf6, 0xc4, mask};
+    buffer_t_append(&This->binary, intel_test, sizeof(intel_test));
+    return is_zero? 0x74 : 0x75;
+}
+
+//e9 .. .. .. ..          jmpq   ...
 size_t image_t_get_jmp (image_t* This, const char source[])
 {
-    // The offset is stored in r11. We'll load effective addresses using it
-    char intel_load[] = {0x4D, 0x8D, 0xAE}; // lea    0x...(%r14),%r13
-    char intel_jmp[] = {0x41, 0xFF, 0xE5}; // jmpq   *%r13
-    // Loading the position
-    unsigned jmp_pos = This->map[*((unsigned*)source)];
-    // Loading offset into
-    buffer_t_append(&This->binary, intel_load, sizeof(intel_load));
-    buffer_t_append(&This->binary, (char*)(&jmp_pos), sizeof(unsigned));
+    char intel_jmp[] = {0xE9};
     buffer_t_append(&This->binary, intel_jmp, sizeof(intel_jmp));
+    // Loading the position
+    int jmp_pos = image_t_get_target(This, source);
+    buffer_t_append(&This->binary, (char*)(&jmp_pos), sizeof(int));
 
     // We've moved 4 bytes forward
     return (sizeof(unsigned));
 }
 
-//4d 8d ae ff ff ff 0f    lea    0x.......(%r14),%r13
-//41 ff e5                jmpq   *%r13
-#define CON_JUMP(_name, _jmp_code) \
+//41 f6 c4 ..             test   $0x..,%r12b
+//0f 8. .. .. .. ..       jz/jnz ...
+#define CON_JUMP(_name) \
 size_t image_t_get_ ## _name (image_t* This, const char source[])\
 {\
-    char intel_con_jump[] = {_jmp_code, 0x0a}; \
-    char intel_load[] = {0x4D, 0x8D, 0xAE}; \
-    char intel_jmp[] = {0x41, 0xFF, 0xE5}; \
-    unsigned jmp_pos = This->map[*((unsigned*)source)];\
+    /* Short jz/jnz becomes the near one */\
+    char intel_con_jump[] = {0x0f, image_t_get_condition(This, cmd_ ## _name) + 0x10}; \
     buffer_t_append(&This->binary, intel_con_jump, sizeof(intel_con_jump));\
-    buffer_t_append(&This->binary, intel_load, sizeof(intel_load));\
-    buffer_t_append(&This->binary, (char*)(&jmp_pos), sizeof(unsigned));\
-    buffer_t_append(&This->binary, intel_jmp, sizeof(intel_jmp));\
+    int jmp_pos = image_t_get_target(This, source);\
+    buffer_t_append(&This->binary, (char*)(&jmp_pos), sizeof(int));\
 \
     return (sizeof(unsigned));\
 }
-// 0x0a is to jump over the jmp command
-//77 0a                   ja    ...+10
-CON_JUMP (ja, 0x77)
-//73 0a                   jae    ...+10
-CON_JUMP (jae, 0x73)
-//72 0a                   jb    ...+10
-CON_JUMP (jb, 0x72)
-//76 0a                   jae    ...+10
-CON_JUMP (jbe, 0x76)
-//74 0a                   je    ...+10
-CON_JUMP (je, 0x74)
-//75 0a                   jne    ...+10
-CON_JUMP (jne, 0x75)
-
-//4D 8D AE                lea    0x...(%r14),%r13
+CON_JUMP (ja)
+CON_JUMP (jae)
+CON_JUMP (jb)
+CON_JUMP (jbe)
+CON_JUMP (je)
+CON_JUMP (jne)
+#undef CON_JUMP
+
+// As in the processor, the call pushes the return address (position in the source) to the VM stack.
+// The host call pushes it to the return stack as well, so the processor predicts the ret.
+// The stacks are swapped around the host call and ret.
 //48 83 ec 04             sub    $0x4,%rsp
-//c7 04 24 .. .. .. ..    movl   $0x...,(%rsp)
-//41`FF E5                jmpq   *%r13
+//c7 04 24 .. .. .. ..    movl   $0x........,(%rsp)
+//4c 87 d4                xchg   %rsp,%r10
+//68 .. .. .. ..          pushq  $0x........
+//e8 05 00 00 00          callq  <enter>
+//4c 87 d4                xchg   %rsp,%r10
+//eb 08                   jmp    <next>
+//enter:
+//4c 87 d4                xchg   %rsp,%r10
+//e9 .. .. .. ..          jmpq   ...
+//next:
 size_t image_t_get_call(image_t* This, const char source[])
 {
-    // The offset is stored in r11. We'll load effective addresses using it
-    char intel_load[] = {0x4D, 0x8D, 0xAE}; // lea    0x...(%r14),%r13
-    char intel_jmp[] = {0x41, 0xFF, 0xE5}; // jmpq   *%r13
-    // Loading the position
-    unsigned jmp_pos = This->map[*((unsigned*)source)];
-    // Loading offset into
-    buffer_t_append(&This->binary, intel_load, sizeof(intel_load));
-    buffer_t_append(&This->binary, (char*)(&jmp_pos), sizeof(unsigned));
+    unsigned ret_pos = (unsigned)(source - This->source.data) + sizeof(unsigned);
     char intel_push_addr[] = {0x48, 0x83, 0xec, 0x04, 0xc7, 0x04, 0x24};
     buffer_t_append(&This->binary, intel_push_addr, sizeof(intel_push_addr));
-    // Pushing the return position
-    unsigned ret_pos = (unsigned)This->binary.size - 15 + 3 + 5;
     buffer_t_append(&This->binary, (char*)(&ret_pos), sizeof(unsigned));
-    buffer_t_append(&This->binary, intel_jmp, sizeof(intel_jmp));
+    char intel_push_ret[] = {0x4c, 0x87, 0xd4, 0x68};
+    buffer_t_append(&This->binary, intel_push_ret, sizeof(intel_push_ret));
+    buffer_t_append(&This->binary, (char*)(&ret_pos), sizeof(unsigned));
+    char intel_call[] = {0xe8, 0x05, 0x00, 0x00, 0x00, 0x4c, 0x87, 0xd4, 0xeb, 0x08, 0x4c, 0x87, 0xd4, 0xe9};
+    buffer_t_append(&This->binary, intel_call, sizeof(intel_call));
+    // Loading the position
+    int jmp_pos = image_t_get_target(This, source);
+    buffer_t_append(&This->binary, (char*)(&jmp_pos), sizeof(int));
     // We've moved 4 bytes forward
     return (sizeof(unsigned));
 }
 
+// The handler reports the error, then the native code ends as the stop does
 size_t image_t_get_err(image_t* This, const char source[])
 {
     char load_out_stream[] = {0x49, 0xbd};
     buffer_t_append(&This->binary, load_out_stream, sizeof(load_out_stream));
-    buffer_t_append(&This->binary, (char*)(&This->out_stream), sizeof(char*));
+    image_t_get_address(This, ADDR_OUT_STREAM);
     char load_mod[] = {0x66, 0x41, 0xc7, 0x45, 0x00};
     buffer_t_append(&This->binary, load_mod, sizeof(load_mod));
     char mod[] = {SIG_STOP, 0x0};
     buffer_t_append(&This->binary, mod, sizeof(mod));
     image_t_call_handler(This);
+    image_t_get_stop(This, source);
 
     return 0;
 }
 
-//4d 31 ed                xor    %r13,%r13
+// The host ret is used if the return stack has the same address as the VM stack
 //44 8b 2c 24             mov    (%rsp),%r13d
 //48 83 c4 04             add    $0x4,%rsp
-//4f 8d 6c 35 00          lea    0x0(%r13,%r14,1),%r13
-//41 ff e5                jmpq   *%r13
-
+//4c 87 d4                xchg   %rsp,%r10
+//44 39 6c 24 08          cmp    %r13d,0x8(%rsp)
+//75 03                   jne    <other>
+//c2 08 00                retq   $0x8
+//other:
+//48 83 c4 10             add    $0x10,%rsp
+//4c 87 d4                xchg   %rsp,%r10
+//e9 .. .. .. ..          jmpq   <return stub>
 size_t image_t_get_ret(image_t* This, const char source[])
 {
-    char intel_opcodes[] = {0x4d, 0x31, 0xed, 0x44, 0x8b, 0x2c, 0x24, 0x48, 0x83, 0xc4, 0x04, 0x4f, 0x8d, 0x6c, 0x35, 0x00, 0x41, 0xff, 0xe5};
+    char intel_opcodes[] = {0x44, 0x8b, 0x2c, 0x24, 0x48, 0x83, 0xc4, 0x04, 0x4c, 0x87, 0xd4, 0x44, 0x39, 0x6c, 0x24, 0x08,
+                            0x75, 0x03, 0xc2, 0x08, 0x00, 0x48, 0x83, 0xc4, 0x10, 0x4c, 0x87, 0xd4, 0xe9};
     buffer_t_append(&This->binary, intel_opcodes, sizeof(intel_opcodes));
+    This->fixups[This->fixups_size].at = This->binary.size;
+    This->fixups[This->fixups_size].target = IMAGE_T_UNKNOWN;
+    This->fixups_size++;
+    int stub_pos = 0;
+    buffer_t_append(&This->binary, (char*)(&stub_pos), sizeof(int));
 
     return 0;
 }
+
+// Jumps to the instruction at the position in r13d. If there is no instruction, fails with err
+//41 81 fd .. .. .. ..    cmp    $0x........,%r13d
+//73 1a                   jae    <bad>
+//49 bf .. .. .. .. .. .. .. .. 	movabs $0x...,%r15
+//47 8b 2c af             mov    (%r15,%r13,4),%r13d
+//41 83 fd ff             cmp    $0xffffffff,%r13d
+//74 0d                   je     <bad>
+//4c 8d 3d .. .. .. ..    lea    <program>(%rip),%r15
+//4d 01 fd                add    %r15,%r13
+//41 ff e5                jmpq   *%r13
+//bad:
+void image_t_get_return_stub (image_t* This)
+{
+    char check_pos[] = {0x41, 0x81, 0xfd};
+    buffer_t_append(&This->binary, check_pos, sizeof(check_pos));
+    unsigned size = This->source.size;
+    buffer_t_append(&This->binary, (char*)(&size), sizeof(unsigned));
+    char load_map[] = {0x73, 0x21, 0x49, 0xbf};
+    buffer_t_append(&This->binary, load_map, sizeof(load_map));
+    image_t_get_address(This, ADDR_MAP);
+    char load_position[] = {0x47, 0x8b, 0x2c, 0xaf, 0x41, 0x83, 0xfd, 0xff, 0x74, 0x0d, 0x4c, 0x8d, 0x3d};
+    buffer_t_append(&This->binary, load_position, sizeof(load_position));
+    // The map is relative to the beginning of the program, r14 is the base of the memory
+    int program = IMAGE_T_HEADER_SIZE - (int)(This->binary.size + sizeof(int));
+    buffer_t_append(&This->binary, (char*)(&program), sizeof(int));
+    char jump[] = {0x4d, 0x01, 0xfd, 0x41, 0xff, 0xe5};
+    buffer_t_append(&This->binary, jump, sizeof(jump));
+    image_t_get_err(This, NULL);
+}
+
+//49 bd .. .. .. .. .. .. .. .. 	movabs $0x...,%r13
+//49 8b 65 00          	mov    0x0(%r13),%rsp
+//5d                   	pop    %rbp
+//c3                   	retq
 size_t image_t_get_stop(image_t* This, const char source[])
 {
-    //8 89 ec             	mov    %rbp,%rsp
-    //5d                   	pop    %rbp
-    char stop[] = {0x48, 0x89, 0xec, 0x5d, 0xc3};
+    char load_host_sp[] = {0x49, 0xbd};
+    buffer_t_append(&This->binary, load_host_sp, sizeof(load_host_sp));
+    image_t_get_address(This, ADDR_HOST_SP);
+    char stop[] = {0x49, 0x8b, 0x65, 0x00, 0x5d, 0xc3};
     buffer_t_append(&This->binary, stop, sizeof(stop));
     return 0;
 }
@@ -600,12 +1461,12 @@ size_t image_t_get_bytedup (image_t* This, const char source[])
     return 0;
 }
 
-//44 8b 2c 24             mov    (%rsp),%r13
+//4c 8b 2c 24             mov    (%rsp),%r13
 //48 83 ec 08             sub    $0x8,%rsp
-//44 89 2c 24             mov    %r13d,(%rsp)
+//4c 89 2c 24             mov    %r13,(%rsp)
 size_t image_t_get_dworddupd (image_t* This, const char source[])
 {
-    char intel_opcode[] = {0x44, 0x8b, 0x2c, 0x24, 0x48, 0x83, 0xec, 0x08, 0x44, 0x89, 0x2c, 0x24};
+    char intel_opcode[] = {0x4c, 0x8b, 0x2c, 0x24, 0x48, 0x83, 0xec, 0x08, 0x4c, 0x89, 0x2c, 0x24};
     buffer_t_append(&This->binary, intel_opcode, sizeof(intel_opcode));
     return 0;
 }
@@ -630,14 +1491,38 @@ size_t image_t_get_bytedupd (image_t* This, const char source[])
     return 0;
 }
 
+// Host registers of the VM ones: rsp is the VM stack, so esp is in r8
+static const char IMAGE_T_REGISTERS[REG_NUMBER] = {0x0, 0x1, 0x2, 0x3, 0x8, 0x5, 0x6, 0x7};
+
+// Host register of the VM one at the address
+char image_t_host_register (char address)
+{
+    return IMAGE_T_REGISTERS[((unsigned char)address / REG_SIZE) % REG_NUMBER];
+}
+
+// Moves between the register at the address and the top of the stack
+//66 4. .. .. 24          mov    %..,(%rsp) or mov (%rsp),%..
+void image_t_get_register_move(image_t* This, char address, char prefix, char opcode, bool is_byte)
+{
+    char reg = image_t_host_register(address);
+    if (prefix)
+        buffer_t_append(&This->binary, &prefix, sizeof(char));
+    // The byte registers after bl are spl...dil only with the REX prefix
+    if (reg >= 0x8 || (is_byte && reg >= 0x4)){
+        char rex = (reg >= 0x8)? 0x44 : 0x40;
+        buffer_t_append(&This->binary, &rex, sizeof(char));
+    }
+    char intel_opcodes[] = {opcode, 0x04 | ((reg & 0x7) << 3), 0x24};
+    buffer_t_append(&This->binary, intel_opcodes, sizeof(intel_opcodes));
+}
+
 //8b .. 24                mov    (%rsp),%...
 //48 83 c4 04             add    $0x4,%rsp
 size_t image_t_get_pop_reg_dword(image_t* This, const char source[])
 {
-    char reg_addr = (*source)/4*8 + 4;
-    char intel_opcodes[] = {0x8b, 0x0, 0x24, 0x48, 0x83, 0xc4, 0x04};
-    memcpy(intel_opcodes + 1, &reg_addr, 1);
-    buffer_t_append(&This->binary, intel_opcodes, sizeof(intel_opcodes));
+    image_t_get_register_move(This, *source, 0x0, 0x8b, false);
+    char intel_pop[] = {0x48, 0x83, 0xc4, 0x04};
+    buffer_t_append(&This->binary, intel_pop, sizeof(intel_pop));
 
     return sizeof(char);
 }
@@ -646,10 +1531,9 @@ size_t image_t_get_pop_reg_dword(image_t* This, const char source[])
 //48 83 c4 02             add    $0x2,%rsp
 size_t image_t_get_pop_reg_word(image_t* This, const char source[])
 {
-    char reg_addr = (*source)/4*8 + 4;
-    char intel_opcodes[] = {0x66, 0x8b, 0x0, 0x24, 0x48, 0x83, 0xc4, 0x02};
-    memcpy(intel_opcodes + 2, &reg_addr, 1);
-    buffer_t_append(&This->binary, intel_opcodes, sizeof(intel_opcodes));
+    image_t_get_register_move(This, *source, 0x66, 0x8b, false);
+    char intel_pop[] = {0x48, 0x83, 0xc4, 0x02};
+    buffer_t_append(&This->binary, intel_pop, sizeof(intel_pop));
 
     return sizeof(char);
 }
@@ -659,14 +1543,9 @@ size_t image_t_get_pop_reg_word(image_t* This, const char source[])
 //48 83 c4 01             add    $0x1,%rsp
 size_t image_t_get_pop_reg_byte(image_t* This, const char source[])
 {
-    char reg_addr = (*source)/4*8 + 4;
-    if (reg_addr > 3*8 + 4){
-        char mod[] = {0x40};
-        buffer_t_append(&This->binary, mod, sizeof(mod));
-    }
-    char intel_opcodes[] = {0x8a, 0x0, 0x24, 0x48, 0x83, 0xc4, 0x01};
-    memcpy(intel_opcodes + 1, &reg_addr, 1);
-    buffer_t_append(&This->binary, intel_opcodes, sizeof(intel_opcodes));
+    image_t_get_register_move(This, *source, 0x0, 0x8a, true);
+    char intel_pop[] = {0x48, 0x83, 0xc4, 0x01};
+    buffer_t_append(&This->binary, intel_pop, sizeof(intel_pop));
 
     return sizeof(char);
 }
@@ -675,10 +1554,9 @@ size_t image_t_get_pop_reg_byte(image_t* This, const char source[])
 //89 .. 24                mov    %..,(%rsp)
 size_t image_t_get_push_reg_dword(image_t* This, const char source[])
 {
-    char reg_addr = (*source)/4*8 + 4;
-    char intel_opcodes[] = {0x48, 0x83, 0xec, 0x04, 0x89, 0x0, 0x24};
-    memcpy(intel_opcodes + 5, &reg_addr, 1);
-    buffer_t_append(&This->binary, intel_opcodes, sizeof(intel_opcodes));
+    char intel_push[] = {0x48, 0x83, 0xec, 0x04};
+    buffer_t_append(&This->binary, intel_push, sizeof(intel_push));
+    image_t_get_register_move(This, *source, 0x0, 0x89, false);
 
     return sizeof(char);
 }
@@ -687,10 +1565,9 @@ size_t image_t_get_push_reg_dword(image_t* This, const char source[])
 //66 89 .. 24             mov    %..,(%rsp)
 size_t image_t_get_push_reg_word(image_t* This, const char source[])
 {
-    char reg_addr = (*source)/4*8 + 4;
-    char intel_opcodes[] = {0x48, 0x83, 0xec, 0x04, 0x66, 0x89, 0x0, 0x24};
-    memcpy(intel_opcodes + 6, &reg_addr, 1);
-    buffer_t_append(&This->binary, intel_opcodes, sizeof(intel_opcodes));
+    char intel_push[] = {0x48, 0x83, 0xec, 0x02};
+    buffer_t_append(&This->binary, intel_push, sizeof(intel_push));
+    image_t_get_register_move(This, *source, 0x66, 0x89, false);
 
     return sizeof(char);
 }
@@ -699,42 +1576,13 @@ size_t image_t_get_push_reg_word(image_t* This, const char source[])
 //88 .. 24                mov    %..,(%rsp)
 size_t image_t_get_push_reg_byte(image_t* This, const char source[])
 {
-    char reg_addr = (*source)/4*8 + 4;
-    char first_part[] = {0x48, 0x83, 0xec, 0x01};
-    buffer_t_append(&This->binary, first_part, sizeof(first_part));
-    if (reg_addr > 3*8 + 4){
-        char mod[] = {0x40};
-        buffer_t_append(&This->binary, mod, sizeof(mod));
-    }
-    char intel_opcodes[] = {0x88, 0x0, 0x24};
-    memcpy(intel_opcodes + 1, &reg_addr, 1);
-    buffer_t_append(&This->binary, intel_opcodes, sizeof(intel_opcodes));
+    char intel_push[] = {0x48, 0x83, 0xec, 0x01};
+    buffer_t_append(&This->binary, intel_push, sizeof(intel_push));
+    image_t_get_register_move(This, *source, 0x0, 0x88, true);
 
     return sizeof(char);
 }
 
-#define ARITHM(_name, _op, _type) \
-bool image_t_get_ ## _name (image_t* This, const char source[]) \
-{ \
-    ASSERT_OK(image_t, This); \
-    _type a = 0, b = 0, res = 0; \
-    \
-    if (!stack_t_pop(&This->stack, &a, sizeof(_type))){ \
-        image_t_get_destruct(This); \
-        ASSERT_OK(image_t, This); \
-        return false; \
-    } \
-    if (!stack_t_pop(&This->stack, &b, sizeof(_type))){ \
-        image_t_get_destruct(This); \
-        ASSERT_OK(image_t, This); \
-        return false; \
-    } \
-    res = a _op b; \
-    *(unsigned*)(This->registers+ESP) += sizeof(_type);\
-    ASSERT_OK(image_t, This); \
-    return stack_t_push(&This->stack, &res, sizeof(_type)); \
-}
-
 //44 8b 2c 24             mov    (%rsp),%r13d
 //44 03 6c 24 04          add    0x4(%rsp),%r13d
 //48 83 c4 04             add    $0x4,%rsp
@@ -769,15 +1617,18 @@ size_t image_t_get_mul(image_t* This, const char source[])
 }
 
 //49 89 c5                mov    %rax,%r13
+//49 89 d7                mov    %rdx,%r15
 //48 31 c0                xor    %rax,%rax
 //8b 04 24                mov    (%rsp),%eax
+//99                      cltd
 //f7 7c 24 04             idivl  0x4(%rsp)
 //48 83 c4 04             add    $0x4,%rsp
 //89 04 24                mov    %eax,(%rsp)
+//4c 89 fa                mov    %r15,%rdx
 //4c 89 e8                mov    %r13,%rax
 size_t image_t_get_div(image_t* This, const char source[])
 {
-    char intel_opcode[] = {0x49, 0x89, 0xc5, 0x49, 0x89, 0xd7, 0x48, 0x31, 0xc0, 0x8b, 0x04, 0x24, 0xf7, 0x7c, 0x24, 0x04, 0x48, 0x83, 0xc4, 0x04, 0x89, 0x04, 0x24, 0x4c, 0x89, 0xfa, 0x4c, 0x89, 0xe8};
+    char intel_opcode[] = {0x49, 0x89, 0xc5, 0x49, 0x89, 0xd7, 0x48, 0x31, 0xc0, 0x8b, 0x04, 0x24, 0x99, 0xf7, 0x7c, 0x24, 0x04, 0x48, 0x83, 0xc4, 0x04, 0x89, 0x04, 0x24, 0x4c, 0x89, 0xfa, 0x4c, 0x89, 0xe8};
     buffer_t_append(&This->binary, intel_opcode, sizeof(intel_opcode));
     return 0;
 }
@@ -786,6 +1637,7 @@ size_t image_t_get_div(image_t* This, const char source[])
 //49 89 d7                mov    %rdx,%r15
 //48 31 c0                xor    %rax,%rax
 //8b 04 24                mov    (%rsp),%eax
+//99                      cltd
 //f7 7c 24 04             idivl  0x4(%rsp)
 //48 83 c4 04             add    $0x4,%rsp
 //89 14 24                mov    %edx,(%rsp)
@@ -793,7 +1645,40 @@ size_t image_t_get_div(image_t* This, const char source[])
 //4c 89 e8                mov    %r13,%rax
 size_t image_t_get_mod(image_t* This, const char source[])
 {
-    char intel_opcode[] = {0x49, 0x89, 0xc5, 0x49, 0x89, 0xd7, 0x48, 0x31, 0xc0, 0x8b, 0x04, 0x24, 0xf7, 0x7c, 0x24, 0x04, 0x48, 0x83, 0xc4, 0x04, 0x89, 0x14, 0x24, 0x4c, 0x89, 0xfa, 0x4c, 0x89, 0xe8};
+    char intel_opcode[] = {0x49, 0x89, 0xc5, 0x49, 0x89, 0xd7, 0x48, 0x31, 0xc0, 0x8b, 0x04, 0x24, 0x99, 0xf7, 0x7c, 0x24, 0x04, 0x48, 0x83, 0xc4, 0x04, 0x89, 0x14, 0x24, 0x4c, 0x89, 0xfa, 0x4c, 0x89, 0xe8};
+    buffer_t_append(&This->binary, intel_opcode, sizeof(intel_opcode));
+    return 0;
+}
+
+// Instructions of IR_T_INSNS, their operands are in the IR only
+// Removed by the passes of ir_t_optimize
+size_t image_t_get_nop(image_t* This, const char source[])
+{
+    (void)This;
+    (void)source;
+    return 0;
+}
+
+//c1 24 24 ..             shll   $0x..,(%rsp)
+size_t image_t_get_shl(image_t* This, const char source[])
+{
+    char intel_opcode[] = {0xc1, 0x24, 0x24, *source};
+    buffer_t_append(&This->binary, intel_opcode, sizeof(intel_opcode));
+    return 0;
+}
+
+// Rounds to zero as idiv does: the negative dividend gets 2^n - 1 before the shift
+//44 8b 2c 24             mov    (%rsp),%r13d
+//45 89 ef                mov    %r13d,%r15d
+//41 c1 ff 1f             sar    $0x1f,%r15d
+//41 c1 ef ..             shr    $(32 - n),%r15d
+//45 01 fd                add    %r15d,%r13d
+//41 c1 fd ..             sar    $n,%r13d
+//44 89 2c 24             mov    %r13d,(%rsp)
+size_t image_t_get_div_pow2(image_t* This, const char source[])
+{
+    char intel_opcode[] = {0x44, 0x8b, 0x2c, 0x24, 0x45, 0x89, 0xef, 0x41, 0xc1, 0xff, 0x1f, 0x41, 0xc1, 0xef, 32 - *source,
+                           0x45, 0x01, 0xfd, 0x41, 0xc1, 0xfd, *source, 0x44, 0x89, 0x2c, 0x24};
     buffer_t_append(&This->binary, intel_opcode, sizeof(intel_opcode));
     return 0;
 }
@@ -843,33 +1728,35 @@ size_t image_t_get_fdiv(image_t* This, const char source[])
     return 0;
 }
 
+// The native code stops at every debug, there's no step mode to turn off
 size_t image_t_get_ndebug(image_t* This, const char source[])
 {
-    // Not supported
+    (void)This;
+    (void)source;
     return 0;
 }
 
+// Shows the registers as the processor does in the debug mode, image_t_debug finds them on the stack
+//41 54                   push   %r12
+//55                      push   %rbp
+//call debug
+//5d                      pop    %rbp
+//41 5c                   pop    %r12
 size_t image_t_get_debug(image_t* This, const char source[])
 {
-    char intel_opcode[] = {0xCC};
-    buffer_t_append(&This->binary, intel_opcode, sizeof(intel_opcode));
+    char save[] = {0x41, 0x54, 0x55};
+    buffer_t_append(&This->binary, save, sizeof(save));
+    image_t_call_function(This, ADDR_DEBUG);
+    char load[] = {0x5d, 0x41, 0x5c};
+    buffer_t_append(&This->binary, load, sizeof(load));
     return 0;
 }
 
-//49 89 ef                mov    %rbp,%r15
-//48 83 ec 04             sub    $0x4,%rsp
-//c7 04 24 ff ff ff 7f    movl   $0x7fffffff,(%rsp)
-//48 89 e5                mov    %rsp,%rbp
-//f3 0f 10 45 00       	  movss  0x0(%rbp),%xmm0
-//48 83 c4 04             add    $0x4,%rsp
-//48 89 e5                mov    %rsp,%rbp
-//f3 0f 10 4d 00          movss  0x0(%rbp),%xmm1
-//0f 54 c1                andps  %xmm1,%xmm0
-//f3 0f 11 45 00          movss  %xmm0,0x0(%rbp)
-//4c 89 fd                mov    %r15,%rbp
+// Clears the sign bit in place, the value doesn't go through an xmm register
+//81 24 24 ff ff ff 7f    andl   $0x7fffffff,(%rsp)
 size_t image_t_get_fabs(image_t* This, const char source[])
 {
-    char intel_opcode[] = {0x49, 0x89, 0xef, 0x48, 0x83, 0xec, 0x04, 0xc7, 0x04, 0x24, 0xff, 0xff, 0xff, 0x7f, 0x48, 0x89, 0xe5, 0xf3, 0x0f, 0x10, 0x45, 0x00, 0x48, 0x83, 0xc4, 0x04, 0x48, 0x89, 0xe5, 0xf3, 0x0f, 0x10, 0x4d, 0x00, 0x0f, 0x54, 0xc1, 0xf3, 0x0f, 0x11, 0x45, 0x00, 0x4c, 0x89, 0xfd};
+    char intel_opcode[] = {0x81, 0x24, 0x24, 0xff, 0xff, 0xff, 0x7f};
     buffer_t_append(&This->binary, intel_opcode, sizeof(intel_opcode));
     return 0;
 }
@@ -891,192 +1778,785 @@ size_t image_t_get_abs(image_t* This, const char source[])
 //53                      push   %rbx
 //56                      push   %rsi
 //57                      push   %rdi
+//41 50                   push   %r8
+//41 52                   push   %r10
 //9c                      pushfq
-//ff 75 08                pushq  0x8(%rbp)
-//48 8b 6d 00             mov    0x0(%rbp),%rbp
-//c3                      retq
+//48 89 e3                mov    %rsp,%rbx
+//48 83 e4 f0             and    $0xfffffffffffffff0,%rsp
+//48 89 de                mov    %rbx,%rsi
+//48 bf .. .. .. .. .. .. .. .. 	movabs $image,%rdi
+//49 bd .. .. .. .. .. .. .. .. 	movabs $function,%r13
+//41 ff d5             	  callq  *%r13
+//48 89 dc                mov    %rbx,%rsp
 //9d                      popfq
+//41 5a                   pop    %r10
+//41 58                   pop    %r8
 //5f                      pop    %rdi
 //5e                      pop    %rsi
 //5b                      pop    %rbx
 //5a                      pop    %rdx
 //59                      pop    %rcx
 //58                      pop    %rax
-//49 bd af af af ff fa    movabs $0xfafafaffafafaf,%r13
-//41 ff d5             	  callq  *%r13
-//48 83 ec 08             sub    $0x8,%rsp
-//4c 89 2c 24             mov    %r13,(%rsp)
 
 void image_t_call_handler(image_t* This)
 {
-    char save_flags[] = {0x50, 0x51, 0x52, 0x53, 0x56, 0x57, 0x9c};
+    image_t_call_function(This, ADDR_HANDLER);
+}
+
+// Calls the function of the host taking the image and the saved registers:
+// flags, r10, r8, rdi, rsi, rbx, rdx, rcx, rax and what was pushed before
+void image_t_call_function(image_t* This, unsigned kind)
+{
+    char save_flags[] = {0x50, 0x51, 0x52, 0x53, 0x56, 0x57, 0x41, 0x50, 0x41, 0x52, 0x9c, 0x48, 0x89, 0xe3, 0x48, 0x83, 0xe4, 0xf0,
+                         0x48, 0x89, 0xde};
     buffer_t_append(&This->binary, save_flags, sizeof(save_flags));
     char save_addr[] = {0x48, 0xbf};
     buffer_t_append(&This->binary, save_addr, sizeof(save_addr));
-    image_t* This_p = This;
-    buffer_t_append(&This->binary, (char*)&This_p, sizeof(image_t*));
+    image_t_get_address(This, ADDR_IMAGE);
     char load_call_addr[] = {0x49, 0xbd};
     buffer_t_append(&This->binary, load_call_addr, sizeof(load_call_addr));
-    void (*stream_handler)(image_t*) = &image_t_handle_stream;
-    buffer_t_append(&This->binary, (char*)&stream_handler, sizeof(char*));
+    image_t_get_address(This, kind);
     char call_handler[] = {0x41, 0xff, 0xd5};
     buffer_t_append(&This->binary, call_handler, sizeof(call_handler));
-    char load_flags[] = {0x9d, 0x5f, 0x5e, 0x5b, 0x5a, 0x59, 0x58};
+    char load_flags[] = {0x48, 0x89, 0xdc, 0x9d, 0x41, 0x5a, 0x41, 0x58, 0x5f, 0x5e, 0x5b, 0x5a, 0x59, 0x58};
     buffer_t_append(&This->binary, load_flags, sizeof(load_flags));
 }
 
+// The value is appended to This->output without leaving the translated program,
+// the host is called only when the output is full
+//49 bd .. .. .. .. .. .. .. .. 	movabs $0x...,%r13
+//45 8b 5d 00                   	mov    0x0(%r13),%r11d
+//47 89 7c dd 08                	mov    %r15d,0x8(%r13,%r11,8)
+//43 c7 44 dd 0c .. .. .. ..    	movl   $type,0xc(%r13,%r11,8)
+//41 ff c3                      	inc    %r11d
+//45 89 5d 00                   	mov    %r11d,0x0(%r13)
+//41 81 fb .. .. .. ..          	cmp    $IMAGE_T_OUTPUT_SIZE,%r11d
+//72 ..                         	jb     <done>
+//call flush
+void image_t_get_output(image_t* This, char type)
+{
+    char load_output[] = {0x49, 0xbd};
+    buffer_t_append(&This->binary, load_output, sizeof(load_output));
+    image_t_get_address(This, ADDR_OUTPUT);
+    char store_value[] = {0x45, 0x8b, 0x5d, 0x00, 0x47, 0x89, 0x7c, 0xdd, 0x08, 0x43, 0xc7, 0x44, 0xdd, 0x0c};
+    buffer_t_append(&This->binary, store_value, sizeof(store_value));
+    unsigned type_value = type;
+    buffer_t_append(&This->binary, (char*)&type_value, sizeof(unsigned));
+    char increase_size[] = {0x41, 0xff, 0xc3, 0x45, 0x89, 0x5d, 0x00, 0x41, 0x81, 0xfb};
+    buffer_t_append(&This->binary, increase_size, sizeof(increase_size));
+    unsigned output_size = IMAGE_T_OUTPUT_SIZE;
+    buffer_t_append(&This->binary, (char*)&output_size, sizeof(unsigned));
+    char skip_flush[] = {0x72, 0x00};
+    buffer_t_append(&This->binary, skip_flush, sizeof(skip_flush));
+    size_t flush_begin = This->binary.size;
+    image_t_call_function(This, ADDR_FLUSH);
+    This->binary.data[flush_begin - 1] = (char)(This->binary.size - flush_begin);
+}
+
 //44 8b 3c 24          	            mov    (%rsp),%r15d
 //48 83 c4 04          	            add    $0x4,%rsp
-//49 bd .. .. .. .. .. .. .. .. 	movabs $0xfffffffafffafaff,%r13
-//66 41 c7 45 00 02 00 	            movw   $0x2,0x0(%r13)
-//45 89 7d 02          	            mov    %r15d,0x2(%r13)
+//output
 size_t image_t_get_out(image_t* This, const char source[])
 {
-    char load_r13[] = {0x44, 0x8b, 0x3c, 0x24, 0x48, 0x83, 0xc4, 0x04};
-    buffer_t_append(&This->binary, load_r13, sizeof(load_r13));
-    char load_out_stream[] = {0x49, 0xbd};
-    buffer_t_append(&This->binary, load_out_stream, sizeof(load_out_stream));
-    char* out_stream_address = This->out_stream;
-    buffer_t_append(&This->binary, (char*)&out_stream_address, sizeof(char*));
-    char load_mod[] = {0x66, 0x41, 0xc7, 0x45, 0x00};
-    buffer_t_append(&This->binary, load_mod, sizeof(load_mod));
-    char mod[] = {SIG_OUT, INT};
-    buffer_t_append(&This->binary, mod, sizeof(mod));
-    char load_value[] = {0x45, 0x89, 0x7d, 0x02};
-    buffer_t_append(&This->binary, load_value, sizeof(load_value));
-    image_t_call_handler(This);
+    char load_r15[] = {0x44, 0x8b, 0x3c, 0x24, 0x48, 0x83, 0xc4, 0x04};
+    buffer_t_append(&This->binary, load_r15, sizeof(load_r15));
+    image_t_get_output(This, INT);
 
     return 0;
 }
 
 //44 8b 3c 24          	            mov    (%rsp),%r15d
 //48 83 c4 04          	            add    $0x4,%rsp
-//49 bd .. .. .. .. .. .. .. .. 	movabs $0xfffffffafffafaff,%r13
-//66 41 c7 45 00 02 00 	            movw   $0x2,0x0(%r13)
-//45 89 7d 02          	            mov    %r15d,0x2(%r13)
+//output
 size_t image_t_get_fout(image_t* This, const char source[])
 {
-    char load_r13[] = {0x44, 0x8b, 0x3c, 0x24, 0x48, 0x83, 0xc4, 0x04};
-    buffer_t_append(&This->binary, load_r13, sizeof(load_r13));
-    char load_out_stream[] = {0x49, 0xbd};
-    buffer_t_append(&This->binary, load_out_stream, sizeof(load_out_stream));
-    char* out_stream_address = This->out_stream;
-    buffer_t_append(&This->binary, (char*)&out_stream_address, sizeof(char*));
-    char load_mod[] = {0x66, 0x41, 0xc7, 0x45, 0x00};
-    buffer_t_append(&This->binary, load_mod, sizeof(load_mod));
-    char mod[] = {SIG_OUT, FLOAT};
-    buffer_t_append(&This->binary, mod, sizeof(mod));
-    char load_value[] = {0x45, 0x89, 0x7d, 0x02};
-    buffer_t_append(&This->binary, load_value, sizeof(load_value));
-    image_t_call_handler(This);
+    char load_r15[] = {0x44, 0x8b, 0x3c, 0x24, 0x48, 0x83, 0xc4, 0x04};
+    buffer_t_append(&This->binary, load_r15, sizeof(load_r15));
+    image_t_get_output(This, FLOAT);
 
     return 0;
 }
 
-//44 8a 3c 24          	            mov    (%rsp),%r15b
+//44 0f b6 3c 24       	            movzbl (%rsp),%r15d
 //48 83 c4 01          	            add    $0x1,%rsp
-//49 bd .. .. .. .. .. .. .. .. 	movabs $0xfffffffafffafaff,%r13
-//66 41 c7 45 00 02 00 	            movw   $0x2,0x0(%r13)
-//45 8a 7d 02                    	mov    0x2(%r13),%r15b
+//output
 size_t image_t_get_cout(image_t* This, const char source[])
 {
-    char load_r13[] = {0x44, 0x8a, 0x3c, 0x24, 0x48, 0x83, 0xc4, 0x01};
-    buffer_t_append(&This->binary, load_r13, sizeof(load_r13));
-    char load_out_stream[] = {0x49, 0xbd};
-    buffer_t_append(&This->binary, load_out_stream, sizeof(load_out_stream));
-    char* out_stream_address = This->out_stream;
-    buffer_t_append(&This->binary, (char*)&out_stream_address, sizeof(char*));
-    char load_mod[] = {0x66, 0x41, 0xc7, 0x45, 0x00};
-    buffer_t_append(&This->binary, load_mod, sizeof(load_mod));
-    char mod[] = {SIG_OUT, FLOAT};
-    buffer_t_append(&This->binary, mod, sizeof(mod));
-    char load_value[] = {0x45, 0x8a, 0x7d, 0x02};
-    buffer_t_append(&This->binary, load_value, sizeof(load_value));
-    image_t_call_handler(This);
+    char load_r15[] = {0x44, 0x0f, 0xb6, 0x3c, 0x24, 0x48, 0x83, 0xc4, 0x01};
+    buffer_t_append(&This->binary, load_r15, sizeof(load_r15));
+    image_t_get_output(This, CHAR);
 
     return 0;
 }
 
-//49 bd .. .. .. .. .. .. .. .. 	movabs $0xfffffffafffafaff,%r13
-//66 41 c7 45 00 02 00 	            movw   $0x2,0x0(%r13)
+// The value is taken from This->input without leaving the translated program,
+// the host is called only when there are no values of the type
+//49 bd .. .. .. .. .. .. .. .. 	movabs $input,%r13
+//45 8b 5d 0c                   	mov    0xc(%r13),%r11d
+//45 3b 5d ..                   	cmp    4*type(%r13),%r11d
+//72 ..                         	jb     <take>
+//49 bd .. .. .. .. .. .. .. .. 	movabs $out_stream,%r13
+//66 41 c7 45 00 02 ..          	movw   $SIG_IN,type,0x0(%r13)
 //call handler
-//49 bd .. .. .. .. .. .. .. .. 	movabs $0xfffffffafffafaff,%r13
-//45 8b 6d 00          	            mov    0x0(%r13),%r13d
-//48 83 ec 04          	            sub    $0x4,%rsp
-//44 89 2c 24          	            mov    %r13d,(%rsp)
-size_t image_t_get_in(image_t* This, const char source[])
-{
+//49 bd .. .. .. .. .. .. .. .. 	movabs $input,%r13
+//45 31 db                      	xor    %r11d,%r11d
+//take:
+//47 8b 7c 9d 10                	mov    0x10(%r13,%r11,4),%r15d
+//41 ff c3                      	inc    %r11d
+//45 89 5d 0c                   	mov    %r11d,0xc(%r13)
+void image_t_get_input(image_t* This, char type)
+{
+    char load_input[] = {0x49, 0xbd};
+    buffer_t_append(&This->binary, load_input, sizeof(load_input));
+    image_t_get_address(This, ADDR_INPUT);
+    char check_size[] = {0x45, 0x8b, 0x5d, 0x0c, 0x45, 0x3b, 0x5d, (char)(type*sizeof(unsigned)), 0x72, 0x00};
+    buffer_t_append(&This->binary, check_size, sizeof(check_size));
+    size_t read_begin = This->binary.size;
     char load_out_stream[] = {0x49, 0xbd};
     buffer_t_append(&This->binary, load_out_stream, sizeof(load_out_stream));
-    char* out_stream_address = This->out_stream;
-    buffer_t_append(&This->binary, (char*)&out_stream_address, sizeof(char*));
-    char load_mod[] = {0x66, 0x41, 0xc7, 0x45, 0x00};
+    image_t_get_address(This, ADDR_OUT_STREAM);
+    char load_mod[] = {0x66, 0x41, 0xc7, 0x45, 0x00, SIG_IN, type};
     buffer_t_append(&This->binary, load_mod, sizeof(load_mod));
-    char mod[] = {SIG_IN, INT};
-    buffer_t_append(&This->binary, mod, sizeof(mod));
     image_t_call_handler(This);
-    char load_in_stream[] = {0x49, 0xbd};
-    buffer_t_append(&This->binary, load_in_stream, sizeof(load_in_stream));
-    char* in_stream_address = This->in_stream;
-    buffer_t_append(&This->binary, (char*)&in_stream_address, sizeof(char*));
-    char store_value[] = {0x45, 0x8b, 0x6d, 0x00, 0x48, 0x83, 0xec, 0x04, 0x44, 0x89, 0x2c, 0x24};
-    buffer_t_append(&This->binary, store_value, sizeof(store_value));
+    buffer_t_append(&This->binary, load_input, sizeof(load_input));
+    image_t_get_address(This, ADDR_INPUT);
+    char first[] = {0x45, 0x31, 0xdb};
+    buffer_t_append(&This->binary, first, sizeof(first));
+    This->binary.data[read_begin - 1] = (char)(This->binary.size - read_begin);
+    char take_value[] = {0x47, 0x8b, 0x7c, 0x9d, 0x10, 0x41, 0xff, 0xc3, 0x45, 0x89, 0x5d, 0x0c};
+    buffer_t_append(&This->binary, take_value, sizeof(take_value));
+}
+
+//input
+//48 83 ec 04          	            sub    $0x4,%rsp
+//44 89 3c 24          	            mov    %r15d,(%rsp)
+size_t image_t_get_in(image_t* This, const char source[])
+{
+    image_t_get_input(This, INT);
+    char push_r15[] = {0x48, 0x83, 0xec, 0x04, 0x44, 0x89, 0x3c, 0x24};
+    buffer_t_append(&This->binary, push_r15, sizeof(push_r15));
 
     return 0;
 }
 
-//49 bd .. .. .. .. .. .. .. .. 	movabs $0xfffffffafffafaff,%r13
-//66 41 c7 45 00 02 00 	            movw   $0x2,0x0(%r13)
-//call handler
-//49 bd .. .. .. .. .. .. .. .. 	movabs $0xfffffffafffafaff,%r13
-//45 8b 6d 00          	            mov    0x0(%r13),%r13d
+//input
 //48 83 ec 04          	            sub    $0x4,%rsp
-//44 89 2c 24          	            mov    %r13d,(%rsp)
+//44 89 3c 24          	            mov    %r15d,(%rsp)
 size_t image_t_get_fin(image_t* This, const char source[])
 {
-    char load_out_stream[] = {0x49, 0xbd};
-    buffer_t_append(&This->binary, load_out_stream, sizeof(load_out_stream));
-    char* out_stream_address = This->out_stream;
-    buffer_t_append(&This->binary, (char*)&out_stream_address, sizeof(char*));
-    char load_mod[] = {0x66, 0x41, 0xc7, 0x45, 0x00};
-    buffer_t_append(&This->binary, load_mod, sizeof(load_mod));
-    char mod[] = {SIG_IN, FLOAT};
-    buffer_t_append(&This->binary, mod, sizeof(mod));
-    image_t_call_handler(This);
-    char load_in_stream[] = {0x49, 0xbd};
-    buffer_t_append(&This->binary, load_in_stream, sizeof(load_in_stream));
-    char* in_stream_address = This->in_stream;
-    buffer_t_append(&This->binary, (char*)&in_stream_address, sizeof(char*));
-    char store_value[] = {0x45, 0x8b, 0x6d, 0x00, 0x48, 0x83, 0xec, 0x04, 0x44, 0x89, 0x2c, 0x24};
-    buffer_t_append(&This->binary, store_value, sizeof(store_value));
+    image_t_get_input(This, FLOAT);
+    char push_r15[] = {0x48, 0x83, 0xec, 0x04, 0x44, 0x89, 0x3c, 0x24};
+    buffer_t_append(&This->binary, push_r15, sizeof(push_r15));
 
     return 0;
 }
 
-//49 bd .. .. .. .. .. .. .. .. 	movabs $0xfffffffafffafaff,%r13
-//66 41 c7 45 00 02 00 	            movw   $0x2,0x0(%r13)
-//call handler
-//49 bd .. .. .. .. .. .. .. .. 	movabs $0xfffffffafffafaff,%r13
-//45 8a 6d 00          	            mov    0x0(%r13),%r13b
+//input
 //48 83 ec 01          	            sub    $0x1,%rsp
-//44 88 2c 24          	            mov    %r13b,(%rsp)
+//44 88 3c 24          	            mov    %r15b,(%rsp)
 size_t image_t_get_cin(image_t* This, const char source[])
 {
-    char load_out_stream[] = {0x49, 0xbd};
-    buffer_t_append(&This->binary, load_out_stream, sizeof(load_out_stream));
-    buffer_t_append(&This->binary, (char*)&(This->out_stream), sizeof(char*));
-    char load_mod[] = {0x66, 0x41, 0xc7, 0x45, 0x00};
-    buffer_t_append(&This->binary, load_mod, sizeof(load_mod));
-    char mod[] = {SIG_IN, CHAR};
-    buffer_t_append(&This->binary, mod, sizeof(mod));
-    image_t_call_handler(This);
-    char load_in_stream[] = {0x49, 0xbd};
-    buffer_t_append(&This->binary, load_in_stream, sizeof(load_in_stream));
-    char* in_stream_address = This->in_stream;
-    buffer_t_append(&This->binary, (char*)&in_stream_address, sizeof(char*));
-    char store_value[] = {0x45, 0x8a, 0x6d, 0x00, 0x48, 0x83, 0xec, 0x01, 0x44, 0x88, 0x2c, 0x24};
-    buffer_t_append(&This->binary, store_value, sizeof(store_value));
+    image_t_get_input(This, CHAR);
+    char push_r15b[] = {0x48, 0x83, 0xec, 0x01, 0x44, 0x88, 0x3c, 0x24};
+    buffer_t_append(&This->binary, push_r15b, sizeof(push_r15b));
+
+    return 0;
+}
+
+//^^^^^^^^^^^^^^^^^^^^^^^^
+// STACK CACHE
+//^^^^^^^^^^^^^^^^^^^^^^^^
+// The emitters go through the stack in the memory. Inside the basic blocks image_t_stack_emit
+// keeps the dwords of the top in the registers of the pool or as the constants, so the
+// arithmetics works on the registers and the constants are folded. The model is written
+// to the memory (flushed) before every instruction it doesn't handle.
+
+// Constructs the empty model emitting to the image, the items are kept in r8 + pool[i]
+void image_t_stack_construct (image_t_stack* stack, image_t* image, const char pool[], unsigned pool_size)
+{
+    assert(stack);
+    stack->image = image;
+    stack->pool = pool;
+    stack->pool_size = pool_size;
+    stack->size = 0;
+    memset(stack->is_busy, 0, sizeof(stack->is_busy));
+}
+
+// Writes the item to the VM stack at the offset from the stack pointer
+//c7 44 24 .. .. .. .. ..          movl   $0x........,0x..(%rsp)
+//44 89 .. 24 ..                   mov    %r..d,0x..(%rsp)
+void image_t_stack_store (image_t_stack* stack, const image_t_stack_item* item, char offset)
+{
+    buffer_t* binary = &stack->image->binary;
+    if (item->is_const){
+        char store[] = {0xc7, 0x44, 0x24, offset};
+        buffer_t_append(binary, store, sizeof(store));
+        buffer_t_append(binary, (char*)&item->value, sizeof(unsigned));
+    }
+    else{
+        char store[] = {0x44, 0x89, 0x44 | (item->reg << 3), 0x24, offset};
+        buffer_t_append(binary, store, sizeof(store));
+        stack->is_busy[(int)item->reg] = false;
+    }
+}
+
+// Writes the deepest item to the memory
+//48 83 ec 04                      sub    $0x4,%rsp
+void image_t_stack_spill (image_t_stack* stack)
+{
+    char sub[] = {0x48, 0x83, 0xec, sizeof(int)};
+    buffer_t_append(&stack->image->binary, sub, sizeof(sub));
+    image_t_stack_store(stack, stack->items, 0);
+    stack->size--;
+    memmove(stack->items, stack->items + 1, stack->size * sizeof(image_t_stack_item));
+}
+
+// Writes all the items to the memory, so the stack pointer gets its real value
+//48 83 ec ..                      sub    $0x..,%rsp
+void image_t_stack_flush (image_t_stack* stack)
+{
+    if (!stack->size)
+        return;
+    char sub[] = {0x48, 0x83, 0xec, stack->size * sizeof(int)};
+    buffer_t_append(&stack->image->binary, sub, sizeof(sub));
+    for (unsigned i = 0; i < stack->size; i++)
+        image_t_stack_store(stack, stack->items + i, (stack->size - 1 - i) * sizeof(int));
+    stack->size = 0;
+}
+
+// Returns a free register r8 + returned value of the pool, spills the deepest items if there is none
+char image_t_stack_alloc (image_t_stack* stack)
+{
+    for (;;){
+        for (unsigned i = 0; i < stack->pool_size; i++)
+            if (!stack->is_busy[(int)stack->pool[i]]){
+                stack->is_busy[(int)stack->pool[i]] = true;
+                return stack->pool[i];
+            }
+        image_t_stack_spill(stack);
+    }
+}
+
+// Adds the constant (is_const) or the register item to the top
+image_t_stack_item* image_t_stack_push (image_t_stack* stack, bool is_const, unsigned value)
+{
+    if (stack->size == IMAGE_T_STACK_ITEMS)
+        image_t_stack_spill(stack);
+    image_t_stack_item* item = stack->items + stack->size++;
+    item->is_const = is_const;
+    item->reg = is_const ? 0 : (char)value;
+    item->value = is_const ? value : 0;
+    return item;
+}
+
+// Removes the top item
+void image_t_stack_drop (image_t_stack* stack)
+{
+    image_t_stack_item* item = stack->items + --stack->size;
+    if (!item->is_const)
+        stack->is_busy[(int)item->reg] = false;
+}
 
+// Loads the items from the memory until there are nitems of them
+//44 8b .. 24                      mov    (%rsp),%r..d
+//48 83 c4 04                      add    $0x4,%rsp
+void image_t_stack_take (image_t_stack* stack, unsigned nitems)
+{
+    while (stack->size < nitems){
+        char reg = image_t_stack_alloc(stack);
+        memmove(stack->items + 1, stack->items, stack->size * sizeof(image_t_stack_item));
+        stack->items->is_const = false;
+        stack->items->reg = reg;
+        stack->size++;
+        char load[] = {0x44, 0x8b, 0x04 | (reg << 3), 0x24, 0x48, 0x83, 0xc4, sizeof(int)};
+        buffer_t_append(&stack->image->binary, load, sizeof(load));
+    }
+}
+
+// Moves the item with depth items above it to a register if it is constant.
+// Returns the register r8 + returned value.
+//41 b8+. .. .. .. ..              mov    $0x........,%r..d
+char image_t_stack_to_reg (image_t_stack* stack, unsigned depth)
+{
+    image_t_stack_item* item = stack->items + stack->size - 1 - depth;
+    if (item->is_const){
+        // Spilling moves the items
+        char reg = image_t_stack_alloc(stack);
+        item = stack->items + stack->size - 1 - depth;
+        item->is_const = false;
+        item->reg = reg;
+        char load[] = {0x41, 0xb8 + reg};
+        buffer_t_append(&stack->image->binary, load, sizeof(load));
+        buffer_t_append(&stack->image->binary, (char*)&item->value, sizeof(unsigned));
+    }
+    return item->reg;
+}
+
+// Emits the instruction working with the modeled stack instead of the memory.
+// Only the dword items are modeled. The arithmetics computes "top op prev", the result takes
+// the place of prev. The VM registers are the host ones of image_t_host_register.
+// Returns false if the instruction must be emitted after image_t_stack_flush.
+bool image_t_stack_emit (image_t_stack* stack, unsigned char code, const char source[])
+{
+    buffer_t* binary = &stack->image->binary;
+    unsigned operand = 0;
+    memcpy(&operand, source, sizeof(unsigned));
+    char vm_reg = image_t_host_register(*source);
+    image_t_stack_item* top = NULL;
+    image_t_stack_item* prev = NULL;
+    char reg = 0;
+    switch (code)
+    {
+    case ir_nop:
+        return true;
+    case cmd_push_int:
+    case cmd_push_float:
+        image_t_stack_push(stack, true, operand);
+        return true;
+    case cmd_push_reg_dword:{
+        reg = image_t_stack_alloc(stack);
+        image_t_stack_push(stack, false, reg);
+        //4. 89 ..                         mov    %e..,%r..d
+        char load[] = {0x41 | ((vm_reg & 0x8) >> 1), 0x89, 0xc0 | ((vm_reg & 0x7) << 3) | reg};
+        buffer_t_append(binary, load, sizeof(load));
+        return true;
+    }
+    case cmd_pop_reg_dword:{
+        image_t_stack_take(stack, 1);
+        top = stack->items + stack->size - 1;
+        if (top->is_const){
+            //41 b8+. .. .. .. ..              mov    $0x........,%e.. (%r8d)
+            char rex = 0x41;
+            char load[] = {0xb8 + (vm_reg & 0x7)};
+            if (vm_reg & 0x8)
+                buffer_t_append(binary, &rex, sizeof(char));
+            buffer_t_append(binary, load, sizeof(load));
+            buffer_t_append(binary, (char*)&top->value, sizeof(unsigned));
+        }
+        else{
+            //4. 89 ..                         mov    %r..d,%e..
+            char load[] = {0x44 | ((vm_reg & 0x8) >> 3), 0x89, 0xc0 | (top->reg << 3) | (vm_reg & 0x7)};
+            buffer_t_append(binary, load, sizeof(load));
+        }
+        image_t_stack_drop(stack);
+        return true;
+    }
+    case cmd_push_mem_dword:{
+        reg = image_t_stack_alloc(stack);
+        image_t_stack_push(stack, false, reg);
+        //45 8b .. .. .. .. ..             mov    0x........(%r14),%r..d
+        char load[] = {0x45, 0x8b, 0x86 | (reg << 3)};
+        buffer_t_append(binary, load, sizeof(load));
+        buffer_t_append(binary, (char*)&operand, sizeof(unsigned));
+        return true;
+    }
+    case cmd_pop_mem_dword:{
+        image_t_stack_take(stack, 1);
+        top = stack->items + stack->size - 1;
+        if (top->is_const){
+            //41 c7 86 .. .. .. .. .. .. .. .. movl   $0x........,0x........(%r14)
+            char store[] = {0x41, 0xc7, 0x86};
+            buffer_t_append(binary, store, sizeof(store));
+            buffer_t_append(binary, (char*)&operand, sizeof(unsigned));
+            buffer_t_append(binary, (char*)&top->value, sizeof(unsigned));
+        }
+        else{
+            //45 89 .. .. .. .. ..             mov    %r..d,0x........(%r14)
+            char store[] = {0x45, 0x89, 0x86 | (top->reg << 3)};
+            buffer_t_append(binary, store, sizeof(store));
+            buffer_t_append(binary, (char*)&operand, sizeof(unsigned));
+        }
+        image_t_stack_drop(stack);
+        return true;
+    }
+    case cmd_dworddup:
+    case cmd_dworddupd:{
+        unsigned nitems = (code == cmd_dworddup) ? 1 : 2;
+        image_t_stack_take(stack, nitems);
+        for (unsigned i = 0; i < nitems; i++){
+            top = stack->items + stack->size - nitems;
+            if (top->is_const){
+                image_t_stack_push(stack, true, top->value);
+                continue;
+            }
+            reg = image_t_stack_alloc(stack);
+            top = stack->items + stack->size - nitems;
+            //45 89 ..                         mov    %r..d,%r..d
+            char copy[] = {0x45, 0x89, 0xc0 | (top->reg << 3) | reg};
+            buffer_t_append(binary, copy, sizeof(copy));
+            image_t_stack_push(stack, false, reg);
+        }
+        return true;
+    }
+    case cmd_abs:
+    case cmd_fabs:
+        image_t_stack_take(stack, 1);
+        top = stack->items + stack->size - 1;
+        if (top->is_const){
+            if (code == cmd_fabs)
+                top->value &= 0x7fffffff;
+            else if ((int)top->value < 0)
+                top->value = -top->value;
+        }
+        else if (code == cmd_fabs){
+            //41 81 e0+. ff ff ff 7f           and    $0x7fffffff,%r..d
+            char fabs[] = {0x41, 0x81, 0xe0 | top->reg, 0xff, 0xff, 0xff, 0x7f};
+            buffer_t_append(binary, fabs, sizeof(fabs));
+        }
+        else{
+            //41 f7 d8+.                       neg    %r..d
+            //79 03                            jns    <end>
+            //41 f7 d8+.                       neg    %r..d
+            char abs[] = {0x41, 0xf7, 0xd8 | top->reg, 0x79, 0x03, 0x41, 0xf7, 0xd8 | top->reg};
+            buffer_t_append(binary, abs, sizeof(abs));
+        }
+        return true;
+    case cmd_add:
+    case cmd_sub:
+    case cmd_mul:{
+        image_t_stack_take(stack, 2);
+        top = stack->items + stack->size - 1;
+        prev = top - 1;
+        if (top->is_const && prev->is_const){
+            prev->value = (code == cmd_add) ? top->value + prev->value :
+                          (code == cmd_sub) ? top->value - prev->value : top->value * prev->value;
+            image_t_stack_drop(stack);
+            return true;
+        }
+        // The result goes to the register of the operand on the left
+        if (top->is_const && code != cmd_sub){
+            image_t_stack_item swap = *top;
+            *top = *prev;
+            *prev = swap;
+        }
+        reg = image_t_stack_to_reg(stack, 0);
+        top = stack->items + stack->size - 1;
+        prev = top - 1;
+        if (prev->is_const){
+            //41 81 c0+. .. .. .. ..           add    $0x........,%r..d
+            //41 81 e8+. .. .. .. ..           sub    $0x........,%r..d
+            //45 69 .. .. .. .. ..             imul   $0x........,%r..d,%r..d
+            char add[] = {0x41, 0x81, 0xc0 | reg};
+            char sub[] = {0x41, 0x81, 0xe8 | reg};
+            char mul[] = {0x45, 0x69, 0xc0 | (reg << 3) | reg};
+            buffer_t_append(binary, (code == cmd_add) ? add : (code == cmd_sub) ? sub : mul, sizeof(add));
+            buffer_t_append(binary, (char*)&prev->value, sizeof(unsigned));
+        }
+        else{
+            //45 01 ..                         add    %r..d,%r..d
+            //45 29 ..                         sub    %r..d,%r..d
+            //45 0f af ..                      imul   %r..d,%r..d
+            char add[] = {0x45, 0x01, 0xc0 | (prev->reg << 3) | reg};
+            char sub[] = {0x45, 0x29, 0xc0 | (prev->reg << 3) | reg};
+            char mul[] = {0x45, 0x0f, 0xaf, 0xc0 | (reg << 3) | prev->reg};
+            if (code == cmd_mul)
+                buffer_t_append(binary, mul, sizeof(mul));
+            else
+                buffer_t_append(binary, (code == cmd_add) ? add : sub, sizeof(add));
+            stack->is_busy[(int)prev->reg] = false;
+        }
+        *prev = *top;
+        stack->size--;
+        return true;
+    }
+    case cmd_div:
+    case cmd_mod:{
+        image_t_stack_take(stack, 2);
+        reg = image_t_stack_to_reg(stack, 1);
+        top = stack->items + stack->size - 1;
+        //50                               push   %rax
+        //52                               push   %rdx
+        char save[] = {0x50, 0x52};
+        buffer_t_append(binary, save, sizeof(save));
+        if (top->is_const){
+            //b8 .. .. .. ..                   mov    $0x........,%eax
+            char load[] = {0xb8};
+            buffer_t_append(binary, load, sizeof(load));
+            buffer_t_append(binary, (char*)&top->value, sizeof(unsigned));
+        }
+        else{
+            //44 89 c0+.                       mov    %r..d,%eax
+            char load[] = {0x44, 0x89, 0xc0 | (top->reg << 3)};
+            buffer_t_append(binary, load, sizeof(load));
+        }
+        //99                               cltd
+        //41 f7 f8+.                       idiv   %r..d
+        //41 89 ..                         mov    %eax/%edx,%r..d
+        //5a                               pop    %rdx
+        //58                               pop    %rax
+        char divide[] = {0x99, 0x41, 0xf7, 0xf8 | reg, 0x41, 0x89, (code == cmd_div ? 0xc0 : 0xd0) | reg, 0x5a, 0x58};
+        buffer_t_append(binary, divide, sizeof(divide));
+        image_t_stack_drop(stack);
+        return true;
+    }
+    case ir_shl:
+        image_t_stack_take(stack, 1);
+        top = stack->items + stack->size - 1;
+        if (top->is_const)
+            top->value <<= (unsigned char)*source;
+        else{
+            //41 c1 e0+. ..                    shl    $0x..,%r..d
+            char shl[] = {0x41, 0xc1, 0xe0 | top->reg, *source};
+            buffer_t_append(binary, shl, sizeof(shl));
+        }
+        return true;
+    case cmd_fadd:
+    case cmd_fsub:
+    case cmd_fmul:
+    case cmd_fdiv:
+    case cmd_cmp:
+    case cmd_fcmp:{
+        image_t_stack_take(stack, 2);
+        reg = image_t_stack_to_reg(stack, 0);
+        char other = image_t_stack_to_reg(stack, 1);
+        if (code == cmd_cmp){
+            //45 39 ..                         cmp    %r..d,%r..d
+            char compare[] = {0x45, 0x39, 0xc0 | (other << 3) | reg};
+            buffer_t_append(binary, compare, sizeof(compare));
+            image_t_get_flags_in(stack->image, 0x9c, reg, other);
+            image_t_stack_drop(stack);
+            image_t_stack_drop(stack);
+            return true;
+        }
+        //66 41 0f 6e c0+.                 movd   %r..d,%xmm0
+        //66 41 0f 6e c8+.                 movd   %r..d,%xmm1
+        char load[] = {0x66, 0x41, 0x0f, 0x6e, 0xc0 | reg, 0x66, 0x41, 0x0f, 0x6e, 0xc8 | other};
+        buffer_t_append(binary, load, sizeof(load));
+        if (code == cmd_fcmp){
+            //0f 2e c8                         ucomiss %xmm0,%xmm1
+            char compare[] = {0x0f, 0x2e, 0xc8};
+            buffer_t_append(binary, compare, sizeof(compare));
+            image_t_get_float_flags_in(stack->image, reg, other);
+            image_t_stack_drop(stack);
+            image_t_stack_drop(stack);
+            return true;
+        }
+        //f3 0f .. c1                      addss/subss/mulss/divss %xmm1,%xmm0
+        //66 41 0f 7e c0+.                 movd   %xmm0,%r..d
+        char operation = (code == cmd_fadd) ? 0x58 : (code == cmd_fsub) ? 0x5c : (code == cmd_fmul) ? 0x59 : 0x5e;
+        char compute[] = {0xf3, 0x0f, operation, 0xc1, 0x66, 0x41, 0x0f, 0x7e, 0xc0 | other};
+        buffer_t_append(binary, compute, sizeof(compute));
+        image_t_stack_drop(stack);
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+//^^^^^^^^^^^^^^^^^^^^^^^^
+// PEEPHOLE
+//^^^^^^^^^^^^^^^^^^^^^^^^
+// The emitters translate every instruction on its own, through the stack in the memory.
+// With This->is_peephole the pairs of IMAGE_T_PEEPHOLES are translated at once: the immediates go
+// to the ALU instructions, the pushes followed by the pops become moves, the stores followed by
+// the loads of the same place keep the value and the jcc over the jmp becomes the inverted jcc.
+// The pairs go through the stack in the memory, so image_t_iterate gives them the instructions
+// only while the stack model is empty (it is flushed or nothing is pushed in the block yet).
+// The pairs are the neighbours in the IR, the second instruction must not be jumped to:
+// its position isn't mapped to the translation.
+
+//81 04 24 .. .. .. ..    addl   $0x........,(%rsp)
+bool image_t_peephole_push_int_add (image_t* This, const char first[], const char second[], size_t end)
+{
+    char intel_add[] = {0x81, 0x04, 0x24};
+    buffer_t_append(&This->binary, intel_add, sizeof(intel_add));
+    buffer_t_append(&This->binary, first, sizeof(unsigned));
+    return true;
+}
+
+// The top is the immediate, so it is the minuend
+//f7 1c 24                negl   (%rsp)
+//81 04 24 .. .. .. ..    addl   $0x........,(%rsp)
+bool image_t_peephole_push_int_sub (image_t* This, const char first[], const char second[], size_t end)
+{
+    char intel_neg[] = {0xf7, 0x1c, 0x24};
+    buffer_t_append(&This->binary, intel_neg, sizeof(intel_neg));
+    return image_t_peephole_push_int_add(This, first, second, end);
+}
+
+//44 69 2c 24 .. .. .. .. imul   $0x........,(%rsp),%r13d
+//44 89 2c 24             mov    %r13d,(%rsp)
+bool image_t_peephole_push_int_mul (image_t* This, const char first[], const char second[], size_t end)
+{
+    char intel_mul[] = {0x44, 0x69, 0x2c, 0x24};
+    buffer_t_append(&This->binary, intel_mul, sizeof(intel_mul));
+    buffer_t_append(&This->binary, first, sizeof(unsigned));
+    char intel_store[] = {0x44, 0x89, 0x2c, 0x24};
+    buffer_t_append(&This->binary, intel_store, sizeof(intel_store));
+    return true;
+}
+
+// The immediate is the top: it is less if the previous is greater
+//81 3c 24 .. .. .. ..    cmpl   $0x........,(%rsp)
+//flags (setg)
+//48 83 c4 04             add    $0x4,%rsp
+bool image_t_peephole_push_int_cmp (image_t* This, const char first[], const char second[], size_t end)
+{
+    char intel_cmp[] = {0x81, 0x3c, 0x24};
+    buffer_t_append(&This->binary, intel_cmp, sizeof(intel_cmp));
+    buffer_t_append(&This->binary, first, sizeof(unsigned));
+    image_t_get_flags(This, 0x9f);
+    char intel_pop[] = {0x48, 0x83, 0xc4, 0x04};
+    buffer_t_append(&This->binary, intel_pop, sizeof(intel_pop));
+    return true;
+}
+
+//41 b8+. .. .. .. ..     mov    $0x........,%e..
+bool image_t_peephole_push_int_pop_reg (image_t* This, const char first[], const char second[], size_t end)
+{
+    char reg = image_t_host_register(*second);
+    char rex = 0x41;
+    if (reg >= 0x8)
+        buffer_t_append(&This->binary, &rex, sizeof(char));
+    char intel_mov = 0xb8 | (reg & 0x7);
+    buffer_t_append(&This->binary, &intel_mov, sizeof(char));
+    buffer_t_append(&This->binary, first, sizeof(unsigned));
+    return true;
+}
+
+//01 .. 24                add    %e..,(%rsp)
+bool image_t_peephole_push_reg_add (image_t* This, const char first[], const char second[], size_t end)
+{
+    image_t_get_register_move(This, *first, 0x0, 0x01, false);
+    return true;
+}
+
+//f7 1c 24                negl   (%rsp)
+//01 .. 24                add    %e..,(%rsp)
+bool image_t_peephole_push_reg_sub (image_t* This, const char first[], const char second[], size_t end)
+{
+    char intel_neg[] = {0xf7, 0x1c, 0x24};
+    buffer_t_append(&This->binary, intel_neg, sizeof(intel_neg));
+    return image_t_peephole_push_reg_add(This, first, second, end);
+}
+
+// The register is the top: it is less if the previous is greater
+//39 .. 24                cmp    %e..,(%rsp)
+//flags (setg)
+//48 83 c4 04             add    $0x4,%rsp
+bool image_t_peephole_push_reg_cmp (image_t* This, const char first[], const char second[], size_t end)
+{
+    image_t_get_register_move(This, *first, 0x0, 0x39, false);
+    image_t_get_flags(This, 0x9f);
+    char intel_pop[] = {0x48, 0x83, 0xc4, 0x04};
+    buffer_t_append(&This->binary, intel_pop, sizeof(intel_pop));
+    return true;
+}
+
+//4. 89 ..                mov    %e..,%e..
+bool image_t_peephole_push_reg_pop_reg (image_t* This, const char first[], const char second[], size_t end)
+{
+    char source = image_t_host_register(*first);
+    char destination = image_t_host_register(*second);
+    char rex = 0x40 | ((source >= 0x8)? 0x4 : 0x0) | ((destination >= 0x8)? 0x1 : 0x0);
+    if (rex != 0x40)
+        buffer_t_append(&This->binary, &rex, sizeof(char));
+    char intel_mov[] = {0x89, 0xc0 | ((source & 0x7) << 3) | (destination & 0x7)};
+    buffer_t_append(&This->binary, intel_mov, sizeof(intel_mov));
+    return true;
+}
+
+// Moves between the register and the memory of the program
+//4. 8b/89 .. .. .. .. .. mov    0x........(%r14),%e.. or back
+void image_t_get_memory_move (image_t* This, char reg, char opcode, const char address[])
+{
+    char intel_mov[] = {0x41 | ((reg >= 0x8)? 0x4 : 0x0), opcode, 0x86 | ((reg & 0x7) << 3)};
+    buffer_t_append(&This->binary, intel_mov, sizeof(intel_mov));
+    buffer_t_append(&This->binary, address, sizeof(unsigned));
+}
+
+bool image_t_peephole_push_mem_pop_reg (image_t* This, const char first[], const char second[], size_t end)
+{
+    image_t_get_memory_move(This, image_t_host_register(*second), 0x8b, first);
+    return true;
+}
+
+bool image_t_peephole_push_reg_pop_mem (image_t* This, const char first[], const char second[], size_t end)
+{
+    image_t_get_memory_move(This, image_t_host_register(*first), 0x89, second);
+    return true;
+}
+
+// The value stays on the stack instead of being loaded back
+//44 8b 3c 24             mov    (%rsp),%r15d
+//45 89 be .. .. .. ..    mov    %r15d,0x........(%r14)
+bool image_t_peephole_pop_mem_push_mem (image_t* This, const char first[], const char second[], size_t end)
+{
+    if (memcmp(first, second, sizeof(unsigned)))
+        return false;
+    char intel_load[] = {0x44, 0x8b, 0x3c, 0x24};
+    buffer_t_append(&This->binary, intel_load, sizeof(intel_load));
+    image_t_get_memory_move(This, 0xf, 0x89, first);
+    return true;
+}
+
+//4. 8b .. 24             mov    (%rsp),%e..
+bool image_t_peephole_pop_reg_push_reg (image_t* This, const char first[], const char second[], size_t end)
+{
+    if (*first != *second)
+        return false;
+    image_t_get_register_move(This, *first, 0x0, 0x8b, false);
+    return true;
+}
+
+// jcc over jmp: the inverted jcc to the target of the jmp
+//41 f6 c4 ..             test   $0x..,%r12b
+//0f 8. .. .. .. ..       jnz/jz ...
+#define IMAGE_T_PEEPHOLE_JUMP(_name) \
+bool image_t_peephole_ ## _name ## _jmp (image_t* This, const char first[], const char second[], size_t end)\
+{\
+    unsigned target = 0;\
+    memcpy(&target, first, sizeof(unsigned));\
+    if (target != end)\
+        return false;\
+    char intel_con_jump[] = {0x0f, (image_t_get_condition(This, cmd_ ## _name) ^ 0x1) + 0x10};\
+    buffer_t_append(&This->binary, intel_con_jump, sizeof(intel_con_jump));\
+    int jmp_pos = image_t_get_target(This, second);\
+    buffer_t_append(&This->binary, (char*)(&jmp_pos), sizeof(int));\
+    return true;\
+}
+IMAGE_T_PEEPHOLE_JUMP (ja)
+IMAGE_T_PEEPHOLE_JUMP (jae)
+IMAGE_T_PEEPHOLE_JUMP (jb)
+IMAGE_T_PEEPHOLE_JUMP (jbe)
+IMAGE_T_PEEPHOLE_JUMP (je)
+IMAGE_T_PEEPHOLE_JUMP (jne)
+#undef IMAGE_T_PEEPHOLE_JUMP
+
+// Translates the instruction at the index with the next one if they are in IMAGE_T_PEEPHOLES.
+// Returns the index after the pair, 0 if it isn't translated.
+size_t image_t_peephole (image_t* This, const ir_t* ir, size_t index)
+{
+    size_t next = ir_t_next(ir, index);
+    if (next >= ir->size)
+        return 0;
+    // The removed instructions between them may be jumped to as well. The second one may still
+    // follow a jump (the jmp after the jcc): it's reached only through the first one then
+    for (size_t i = index + 1; i <= next; i++)
+        if (ir->insns[i].is_target)
+            return 0;
+    const ir_t_insn* first = ir->insns + index;
+    const ir_t_insn* second = ir->insns + next;
+    size_t end = second->pos + 1 + ir_t_operand_size(second->code);
+    #if defined(DEBUG)
+    size_t begin = This->binary.size;
+    #define IMAGE_T_PEEPHOLE_CHECK() \
+    if (This->binary.size - begin > IMAGE_T_COVERAGE[first->code].max_size + IMAGE_T_COVERAGE[second->code].max_size)\
+        printf ("image_t_peephole: Error! The peephole at %u is longer than the pair\n", first->pos);
+    #else
+    #define IMAGE_T_PEEPHOLE_CHECK()
+    #endif // DEBUG
+    #define IMAGE_T_PEEPHOLE(_name, _code_1, _code_2) \
+    if (first->code == _code_1 && second->code == _code_2 &&\
+        image_t_peephole_ ## _name (This, first->operand, second->operand, end)){\
+        IMAGE_T_PEEPHOLE_CHECK()\
+        This->peepholes[IMAGE_T_PEEPHOLE_ ## _name]++;\
+        return next + 1;\
+    }
+    IMAGE_T_PEEPHOLES
+    #undef IMAGE_T_PEEPHOLE
+    #undef IMAGE_T_PEEPHOLE_CHECK
     return 0;
 }
 #endif  // IMAGE_T_H_INCLUDED
@@ -0,0 +1,562 @@
+#include "mylib.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <string.h>
+#include "buffer_t.h"
+#include "commands_enum.h"
+
+#ifndef IR_T_H_INCLUDED
+#define IR_T_H_INCLUDED
+
+#define DEFINES_ONLY
+#include "reg_address.h"
+#undef DEFINES_ONLY
+
+/// More comfortable dump
+#define ir_t_dump(This) ir_t_dump_(This, #This)
+/// Depth of the stack that the passes follow inside the basic block
+#define IR_T_DEPTH 64
+/// Maximum number of the rounds of ir_t_optimize
+#define IR_T_ROUNDS 8
+/// Stack entry that wasn't pushed by a known instruction of the block
+#define IR_T_NONE SIZE_MAX
+
+/// IR_T_INSN(name, code): instructions of the IR that the processor doesn't have,
+/// their codes are not used by commands.h (its codes are the line numbers)
+#define IR_T_INSNS \
+IR_T_INSN(nop, 0) /* Removed instruction, its position is still mapped */\
+IR_T_INSN(shl, UCHAR_MAX - 1) /* Multiplies the top by 2^operand[0] */\
+IR_T_INSN(div_pow2, UCHAR_MAX) /* Divides the top by 2^operand[0], rounds as div */
+
+enum IR_T_CODES
+{
+    #define IR_T_INSN(_name, _code) ir_ ## _name = _code,
+    IR_T_INSNS
+    #undef IR_T_INSN
+};
+
+/// What the register is known to hold in the basic block
+enum IR_T_VALUE {IR_T_UNKNOWN, IR_T_COPY, IR_T_CONSTANT};
+
+/// Instruction of the IR: the command of the source, maybe rewritten by the passes
+typedef struct ir_t_insn ir_t_insn;
+struct ir_t_insn
+{
+    unsigned char code;/**< Command of commands.h or one of IR_T_INSNS */
+    bool is_leader;/**< If the basic block starts here: it may be jumped to or follows a jump */
+    bool is_target;/**< If it may be jumped to: the target of a jump or a call, a return address */
+    unsigned pos;/**< Position of the command in the source */
+    char operand[sizeof(unsigned)];/**< Operand as it is in the source */
+};
+
+/**
+@brief Stack IR of the code section of the program.
+
+Every command of the code section becomes an instruction with the same position, so the
+translation can still be mapped to the source. The basic blocks are split at the positions
+that may be jumped to and after the jumps. The passes of ir_t_optimize work inside the
+blocks only: the stack and the registers are unknown at their beginning.
+*/
+typedef struct ir_t ir_t;
+struct ir_t
+{
+    ir_t_insn* insns;
+    size_t size;
+    size_t begin;/**< Position of the code section in the source, the data goes before it */
+};
+
+/**
+*@brief IR constructor, the code section of the source is decoded.
+*
+*@param This Pointer to the IR to be constructed.
+*@param source Binary of the program, it starts with the jump over the data section.
+*@return true if success, false otherwise.
+*/
+bool ir_t_construct (ir_t* This, const buffer_t* source);
+
+/**
+*@brief Destructs the IR.
+*/
+void ir_t_destruct (ir_t* This);
+
+/**
+*@brief Validates the IR.
+*/
+bool ir_t_OK (const ir_t* This);
+
+/**
+*@brief Prints IR's dump.
+*/
+void ir_t_dump_ (const ir_t* This, const char name[]);
+
+/**
+*@brief Size of the operand of the command in the source.
+*/
+size_t ir_t_operand_size (unsigned char code);
+
+/**
+*@brief Marks the positions of the source that may be jumped to: the targets of the jumps and calls,
+*the return addresses and the pushed integers (they may be used by ret).
+*
+*@return Array of size + 1 flags, it must be freed, NULL if there is no memory.
+*/
+bool* ir_t_find_targets (const buffer_t* source, size_t begin);
+
+/**
+*@brief Index of the next instruction that isn't removed.
+*/
+size_t ir_t_next (const ir_t* This, size_t index);
+
+/**
+*@brief Runs the passes over every basic block until nothing changes:
+*the propagation of the constants and the copies of the registers, the folding of the constants,
+*the removal of the dead pushes and pops and the strength reduction of mul and div.
+*
+*@return Number of the changes.
+*/
+size_t ir_t_optimize (ir_t* This);
+
+/**
+*@brief Number of the dwords the instruction pops and pushes.
+*
+*@return false if the instruction works with other sizes or does something else:
+*the passes forget the stack there.
+*/
+bool ir_t_stack_effect (unsigned char code, unsigned* pops, unsigned* pushes);
+
+size_t ir_t_propagate (ir_t* This, size_t begin, size_t end);
+size_t ir_t_fold (ir_t* This, size_t begin, size_t end, bool is_dead[]);
+void ir_t_find_dead (const ir_t* This, size_t begin, size_t end, bool is_dead[]);
+
+bool ir_t_construct (ir_t* This, const buffer_t* source)
+{
+    assert (This);
+    This->insns = NULL;
+    This->size = 0;
+    unsigned jmp_pos = 0;
+    if (source->size >= 1 + sizeof(unsigned) && (unsigned char)*source->data == cmd_jmp)
+        memcpy(&jmp_pos, source->data + 1, sizeof(unsigned));
+    This->begin = jmp_pos;
+    if (This->begin < 1 + sizeof(unsigned) || This->begin > source->size){
+        printf ("ir_t_construct: Error! The data section is corrupted!\n");
+        return false;
+    }
+    // Every command takes a byte at least
+    This->insns = (ir_t_insn*)calloc(source->size - This->begin + 1, sizeof(ir_t_insn));
+    bool* is_target = ir_t_find_targets(source, This->begin);
+    if (!This->insns || !is_target){
+        perror("ir_t_construct: (can't allocate instructions)");
+        free (is_target);
+        ir_t_destruct(This);
+        return false;
+    }
+    bool is_jump = true;
+    for (size_t pos = This->begin; pos < source->size; This->size++){
+        ir_t_insn* insn = This->insns + This->size;
+        insn->code = source->data[pos];
+        insn->pos = pos;
+        insn->is_target = is_target[pos];
+        insn->is_leader = is_jump || insn->is_target;
+        size_t operand_size = ir_t_operand_size(insn->code);
+        if (pos + 1 + operand_size > source->size){
+            printf ("ir_t_construct: Error! The command at %lu is cut\n", pos);
+            free (is_target);
+            ir_t_destruct(This);
+            return false;
+        }
+        memcpy(insn->operand, source->data + pos + 1, operand_size);
+        pos += 1 + operand_size;
+        // Nothing is known after the jumps, the stops and the calls
+        switch (insn->code)
+        {
+        case cmd_ja:
+        case cmd_jae:
+        case cmd_jb:
+        case cmd_jbe:
+        case cmd_je:
+        case cmd_jne:
+        case cmd_jmp:
+        case cmd_call:
+        case cmd_ret:
+        case cmd_stop:
+        case cmd_err:
+            is_jump = true;
+            break;
+        default:
+            is_jump = false;
+        }
+    }
+    free (is_target);
+    return true;
+}
+
+void ir_t_destruct (ir_t* This)
+{
+    assert (This);
+    free (This->insns);
+    This->insns = NULL;
+    This->size = 0;
+}
+
+bool ir_t_OK (const ir_t* This)
+{
+    assert (This);
+    return This->insns;
+}
+
+void ir_t_dump_ (const ir_t* This, const char name[])
+{
+    assert (This);
+    DUMP_INDENT += INDENT_VALUE;
+    printf ("%s = " ANSI_COLOR_BLUE "ir_t" ANSI_COLOR_RESET " (", name);
+    if (ir_t_OK(This))
+        printf (ANSI_COLOR_GREEN "ok" ANSI_COLOR_RESET ")\n");
+    else
+        printf (ANSI_COLOR_RED "ERROR" ANSI_COLOR_RESET ")\n");
+    printf ("%*sbegin = %lu\n", DUMP_INDENT, "", This->begin);
+    printf ("%*ssize = %lu\n", DUMP_INDENT, "", This->size);
+    for (size_t i = 0; This->insns && i < This->size; i++){
+        unsigned operand = 0;
+        memcpy(&operand, This->insns[i].operand, sizeof(unsigned));
+        printf ("%*s%c%6u: %3u %u\n", DUMP_INDENT, "", (This->insns[i].is_leader)? '>' : ' ',
+                This->insns[i].pos, (unsigned)This->insns[i].code, operand);
+    }
+    DUMP_INDENT -= INDENT_VALUE;
+}
+
+size_t ir_t_operand_size (unsigned char code)
+{
+    switch (code)
+    {
+    case cmd_push_int:
+    case cmd_push_float:
+    case cmd_push_mem_byte:
+    case cmd_push_mem_word:
+    case cmd_push_mem_dword:
+    case cmd_pop_mem_byte:
+    case cmd_pop_mem_word:
+    case cmd_pop_mem_dword:
+    case cmd_ja:
+    case cmd_jae:
+    case cmd_jb:
+    case cmd_jbe:
+    case cmd_je:
+    case cmd_jne:
+    case cmd_jmp:
+    case cmd_call:
+        return sizeof(unsigned);
+    case cmd_push_char:
+    case cmd_push_reg_byte:
+    case cmd_push_reg_word:
+    case cmd_push_reg_dword:
+    case cmd_pop_reg_byte:
+    case cmd_pop_reg_word:
+    case cmd_pop_reg_dword:
+        return sizeof(char);
+    default:
+        return 0;
+    }
+}
+
+bool* ir_t_find_targets (const buffer_t* source, size_t begin)
+{
+    size_t size = source->size;
+    bool* is_target = (bool*)calloc(size + 1, sizeof(bool));
+    if (!is_target)
+        return NULL;
+    for (size_t pos = begin; pos < size;){
+        unsigned char code = source->data[pos];
+        size_t next = pos + 1 + ir_t_operand_size(code);
+        if (next > size)
+            break;
+        unsigned operand = 0;
+        if (next - pos - 1 == sizeof(unsigned))
+            memcpy(&operand, source->data + pos + 1, sizeof(unsigned));
+        switch (code)
+        {
+        case cmd_call:
+            is_target[next] = true;
+            // The target of the call is marked as well
+            // Falls through
+        case cmd_ja:
+        case cmd_jae:
+        case cmd_jb:
+        case cmd_jbe:
+        case cmd_je:
+        case cmd_jne:
+        case cmd_jmp:
+        case cmd_push_int:
+            if (operand <= size)
+                is_target[operand] = true;
+            break;
+        }
+        pos = next;
+    }
+    return is_target;
+}
+
+size_t ir_t_next (const ir_t* This, size_t index)
+{
+    for (index++; index < This->size && This->insns[index].code == ir_nop; index++);
+    return index;
+}
+
+size_t ir_t_optimize (ir_t* This)
+{
+    ASSERT_OK(ir_t, This);
+    bool* is_dead = (bool*)calloc(This->size + 1, sizeof(bool));
+    if (!is_dead)
+        return 0;
+    size_t changes = 0;
+    for (unsigned round = 0; round < IR_T_ROUNDS; round++){
+        size_t round_changes = 0;
+        for (size_t begin = 0, end = 0; begin < This->size; begin = end){
+            for (end = begin + 1; end < This->size && !This->insns[end].is_leader; end++);
+            round_changes += ir_t_propagate(This, begin, end);
+            ir_t_find_dead(This, begin, end, is_dead);
+            round_changes += ir_t_fold(This, begin, end, is_dead);
+        }
+        changes += round_changes;
+        if (!round_changes)
+            break;
+    }
+    free (is_dead);
+    return changes;
+}
+
+bool ir_t_stack_effect (unsigned char code, unsigned* pops, unsigned* pushes)
+{
+    switch (code)
+    {
+    case ir_nop:
+        *pops = *pushes = 0;
+        return true;
+    case ir_shl:
+    case ir_div_pow2:
+        *pops = *pushes = 1;
+        return true;
+    }
+    if (!command_stack_effect(code, pops, pushes) || *pops % sizeof(int) || *pushes % sizeof(int))
+        return false;
+    *pops /= sizeof(int);
+    *pushes /= sizeof(int);
+    return true;
+}
+
+// Index of the register at the address of the operand
+#define IR_T_REGISTER(_insn) (((unsigned char)(_insn)->operand[0] / REG_SIZE) % REG_NUMBER)
+
+// Forgets the values of the register and its copies
+void ir_t_kill (char kinds[], unsigned values[], unsigned reg)
+{
+    kinds[reg] = IR_T_UNKNOWN;
+    for (unsigned i = 0; i < REG_NUMBER; i++)
+        if (kinds[i] == IR_T_COPY && values[i] == reg)
+            kinds[i] = IR_T_UNKNOWN;
+}
+
+// Constants and copies of the registers: 'push 5; pop ecx; push ecx' pushes 5,
+// 'push ecx; pop ebx; push ebx' pushes ecx while neither of them is popped to again
+size_t ir_t_propagate (ir_t* This, size_t begin, size_t end)
+{
+    char kinds[REG_NUMBER] = {};
+    unsigned values[REG_NUMBER] = {};
+    size_t changes = 0;
+    ir_t_insn* prev = NULL;
+    for (size_t i = begin; i < end; i++){
+        ir_t_insn* insn = This->insns + i;
+        if (insn->code == ir_nop)
+            continue;
+        unsigned reg = IR_T_REGISTER(insn);
+        switch (insn->code)
+        {
+        case cmd_push_reg_dword:
+            if (kinds[reg] == IR_T_CONSTANT){
+                insn->code = cmd_push_int;
+                memcpy(insn->operand, &values[reg], sizeof(unsigned));
+                changes++;
+            }
+            else if (kinds[reg] == IR_T_COPY){
+                insn->operand[0] = values[reg] * REG_SIZE;
+                changes++;
+            }
+            break;
+        case cmd_pop_reg_dword:
+            ir_t_kill(kinds, values, reg);
+            if (prev && prev->code == cmd_push_int){
+                kinds[reg] = IR_T_CONSTANT;
+                memcpy(&values[reg], prev->operand, sizeof(unsigned));
+            }
+            else if (prev && prev->code == cmd_push_reg_dword && IR_T_REGISTER(prev) != reg){
+                kinds[reg] = IR_T_COPY;
+                values[reg] = IR_T_REGISTER(prev);
+            }
+            break;
+        case cmd_pop_reg_byte:
+        case cmd_pop_reg_word:
+            ir_t_kill(kinds, values, reg);
+            break;
+        }
+        prev = insn;
+    }
+    return changes;
+}
+
+// The dword pops to the registers that are popped to again before they are read in the block.
+// The smaller pops keep the rest of the register, so they read it as well as the pushes do.
+void ir_t_find_dead (const ir_t* This, size_t begin, size_t end, bool is_dead[])
+{
+    unsigned live = (1u << REG_NUMBER) - 1;
+    for (size_t i = end; i-- > begin;){
+        const ir_t_insn* insn = This->insns + i;
+        unsigned reg = 1u << IR_T_REGISTER(insn);
+        is_dead[i] = false;
+        switch (insn->code)
+        {
+        case cmd_pop_reg_dword:
+            is_dead[i] = !(live & reg);
+            live &= ~reg;
+            break;
+        case cmd_pop_reg_byte:
+        case cmd_pop_reg_word:
+        case cmd_push_reg_byte:
+        case cmd_push_reg_word:
+        case cmd_push_reg_dword:
+            live |= reg;
+            break;
+        case cmd_debug:
+            live = (1u << REG_NUMBER) - 1;
+            break;
+        }
+    }
+}
+
+// Exponent of the power of two, -1 if it isn't one
+int ir_t_log2 (int value)
+{
+    if (value <= 0 || (value & (value - 1)))
+        return -1;
+    int exponent = 0;
+    for (; value > 1; value >>= 1)
+        exponent++;
+    return exponent;
+}
+
+// Folds the arithmetics of the pushed integers, as the processor does it
+bool ir_t_compute (unsigned char code, int top, int prev, int* result)
+{
+    switch (code)
+    {
+    case cmd_add:
+        *result = (int)((unsigned)top + (unsigned)prev);
+        return true;
+    case cmd_sub:
+        *result = (int)((unsigned)top - (unsigned)prev);
+        return true;
+    case cmd_mul:
+        *result = (int)((unsigned)top * (unsigned)prev);
+        return true;
+    case cmd_div:
+    case cmd_mod:
+        // The faults stay where they are
+        if (!prev || (top == INT_MIN && prev == -1))
+            return false;
+        *result = (code == cmd_div)? top / prev : top % prev;
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Follows the stack of the block: the entries are the indices of the pushes.
+// The arithmetics of two pushed integers becomes the push of the result, mul and div by
+// the pushed power of two become shl and div_pow2, the push of the value to the dead register
+// or to the register it was pushed from is removed with the pop.
+// The entry of the removed push leaves the stack before the effect of the instruction.
+size_t ir_t_fold (ir_t* This, size_t begin, size_t end, bool is_dead[])
+{
+    size_t stack[IR_T_DEPTH];
+    size_t depth = 0;
+    size_t changes = 0;
+    #define IR_T_REMOVE(_entry) \
+    do{\
+        This->insns[stack[_entry]].code = ir_nop;\
+        memmove(stack + (_entry), stack + (_entry) + 1, (depth - (_entry) - 1)*sizeof(size_t));\
+        depth--;\
+    }while (0)
+    for (size_t i = begin; i < end; i++){
+        ir_t_insn* insn = This->insns + i;
+        unsigned pops = 0, pushes = 0;
+        if (!ir_t_stack_effect(insn->code, &pops, &pushes)){
+            depth = 0;
+            continue;
+        }
+        // The entries are known pushes or IR_T_NONE
+        const ir_t_insn* top = (depth >= 1 && stack[depth - 1] != IR_T_NONE)? This->insns + stack[depth - 1] : NULL;
+        const ir_t_insn* prev = (depth >= 2 && stack[depth - 2] != IR_T_NONE)? This->insns + stack[depth - 2] : NULL;
+        int top_value = 0, prev_value = 0, result = 0;
+        if (top)
+            memcpy(&top_value, top->operand, sizeof(int));
+        if (prev)
+            memcpy(&prev_value, prev->operand, sizeof(int));
+        bool is_top_int = top && top->code == cmd_push_int;
+        bool is_prev_int = prev && prev->code == cmd_push_int;
+        size_t pushed = IR_T_NONE;
+        switch (insn->code)
+        {
+        case cmd_push_int:
+        case cmd_push_float:
+        case cmd_push_reg_dword:
+        case cmd_push_mem_dword:
+            pushed = i;
+            break;
+        case cmd_pop_reg_dword:
+            if (!top || (!is_dead[i] && (top->code != cmd_push_reg_dword || IR_T_REGISTER(top) != IR_T_REGISTER(insn))))
+                break;
+            IR_T_REMOVE(depth - 1);
+            insn->code = ir_nop;
+            changes++;
+            break;
+        case cmd_add:
+        case cmd_sub:
+        case cmd_mul:
+        case cmd_div:
+        case cmd_mod:
+            if (is_top_int && is_prev_int && ir_t_compute(insn->code, top_value, prev_value, &result)){
+                IR_T_REMOVE(depth - 1);
+                IR_T_REMOVE(depth - 1);
+                insn->code = cmd_push_int;
+                memcpy(insn->operand, &result, sizeof(int));
+                pushed = i;
+                changes++;
+                break;
+            }
+            // The top is the dividend, so only mul takes the power of two from the top
+            int exponent = -1;
+            if (insn->code == cmd_mul && is_top_int && (exponent = ir_t_log2(top_value)) >= 0)
+                IR_T_REMOVE(depth - 1);
+            else if ((insn->code == cmd_mul || insn->code == cmd_div) && is_prev_int &&
+                     (exponent = ir_t_log2(prev_value)) >= 0)
+                IR_T_REMOVE(depth - 2);
+            else
+                break;
+            insn->code = (!exponent)? ir_nop : (insn->code == cmd_mul)? ir_shl : ir_div_pow2;
+            insn->operand[0] = exponent;
+            changes++;
+            break;
+        }
+        ir_t_stack_effect(insn->code, &pops, &pushes);
+        depth = (pops > depth)? 0 : depth - pops;
+        for (unsigned j = 0; j < pushes; j++){
+            if (depth == IR_T_DEPTH)
+                depth = 0;
+            stack[depth++] = (pushes == 1)? pushed : IR_T_NONE;
+        }
+    }
+    #undef IR_T_REMOVE
+    return changes;
+}
+#undef IR_T_REGISTER
+
+#endif // IR_T_H_INCLUDED
@@ -78,7 +78,7 @@ void list_node_t_destruct (list_node_t* this);
 *Checks the links of the element.
 *@param this Pointer to the element to be checked
 */
-bool list_node_t_linked (const list_node_t* this);
+static inline bool list_node_t_linked (const list_node_t* this);
 /**
 *@brief Standard list element varificator.
 *
@@ -159,12 +159,12 @@ void list_t_dump_ (const list_t* this, const char name[]);
 */
 void list_t_add (list_t* this, char* data);
 
-inline bool list_t_is_empty (list_t* this)
+static inline bool list_t_is_empty (list_t* this)
 {
     return (this->first < SIZE_MAX)? false : true;
 }
 
-inline bool list_t_is_full (list_t* this)
+static inline bool list_t_is_full (list_t* this)
 {
     return (this->free == SIZE_MAX)? true : false;
 }
@@ -668,7 +668,7 @@ void list_t_exchange_num (list_t* this, size_t first, size_t second)
     list_node_t_exchange(first_node, second_node);
 }
 
-inline bool list_node_t_linked (const list_node_t* this)
+static inline bool list_node_t_linked (const list_node_t* this)
 {
     ASSERT_OK(list_node_t, this);
     return (this->head) ? true : false;
@@ -166,6 +166,35 @@ int print_help ()
 
 //+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
 
+/**
+*@brief Reads the size in bytes, K and M suffixes are allowed.
+*@param text The text to read from.
+*@param size Where to save the size.
+*@return true if the size is correct and fits 32-bit address, false otherwise.
+*/
+bool read_size (const char* text, unsigned* size)
+{
+    char* end = NULL;
+    errno = 0;
+    unsigned long long value = strtoull (text, &end, 10);
+    if (errno || end == text)
+        return false;
+    if (*end == 'K' || *end == 'k'){
+        value *= 1024;
+        end++;
+    }
+    else if (*end == 'M' || *end == 'm'){
+        value *= 1024*1024;
+        end++;
+    }
+    if (*end || value > UINT_MAX)
+        return false;
+    *size = (unsigned)value;
+    return true;
+}
+
+//+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
 /// Debug mode handler.
 #if defined(DEBUG)
     /**
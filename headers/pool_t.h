@@ -0,0 +1,231 @@
+#include "mylib.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifndef POOL_H_INCLUDED
+#define POOL_H_INCLUDED
+
+/// Job of the pool: runs the job with the given index on the given worker
+typedef void (*pool_t_job) (void* context, size_t job, unsigned worker);
+
+/**
+@brief Queue of the jobs of a single worker.
+
+The jobs are the indices from begin to end. The owner takes them from the front,
+the other workers steal them from the back.
+*/
+typedef struct pool_t_queue pool_t_queue;
+struct pool_t_queue
+{
+    pthread_mutex_t lock;
+    size_t begin;/**< First job that is not taken */
+    size_t end;/**< Next to the last job that is not taken */
+    size_t stolen;/**< Number of the jobs stolen by this worker */
+    char padding[64];/**< Keeps the queues in different cache lines */
+};
+
+/**
+@brief Pool of the worker threads with work stealing.
+
+Runs independent jobs on all the workers. The jobs are spread evenly before the start,
+so the workers contend only when someone runs out of the own jobs and steals.
+*/
+typedef struct pool_t pool_t;
+struct pool_t
+{
+    unsigned size;/**< Number of the workers, the calling thread is the first of them */
+    pool_t_queue* queues;/**< Queue of every worker */
+    pool_t_job job;/**< Job being run */
+    void* context;/**< Context of the job */
+};
+
+/**
+*@brief Pool constructor.
+*
+*@param This Pointer to the pool to be constructed.
+*@param size Number of the workers, 0 for the number of the online processors.
+*@return true if success, false otherwise.
+*/
+bool pool_t_construct (pool_t* This, unsigned size);
+
+/**
+*@brief Destructs the pool.
+*/
+void pool_t_destruct (pool_t* This);
+
+/**
+*@brief Validates the pool.
+*/
+bool pool_t_OK (const pool_t* This);
+
+/**
+*@brief Prints pool's dump.
+*/
+void pool_t_dump_ (const pool_t* This, const char name[]);
+
+/**
+*@brief Runs the jobs from 0 to njobs - 1 and waits for all of them.
+*
+*The jobs run in parallel, so job must be thread-safe.
+*@return true if success, false if some threads can't be created (the jobs are run by the others anyway).
+*/
+bool pool_t_run (pool_t* This, size_t njobs, pool_t_job job, void* context);
+
+/**
+*@brief Number of the jobs stolen during the last pool_t_run.
+*/
+size_t pool_t_stolen (const pool_t* This);
+
+/// More comfortable dump
+#define pool_t_dump(This) pool_t_dump_(This, #This)
+
+bool pool_t_construct (pool_t* This, unsigned size)
+{
+    assert (This);
+    if (!size){
+        long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        size = (processors > 0)? (unsigned)processors : 1;
+    }
+    This->size = size;
+    This->job = NULL;
+    This->context = NULL;
+    This->queues = (pool_t_queue*)calloc(size, sizeof(pool_t_queue));
+    if (!This->queues){
+        perror("pool_t_construct: (can't allocate queues)");
+        This->size = 0;
+        return false;
+    }
+    for (unsigned i = 0; i < size; i++)
+        pthread_mutex_init(&This->queues[i].lock, NULL);
+    return true;
+}
+
+void pool_t_destruct (pool_t* This)
+{
+    assert (This);
+    if (This->queues)
+        for (unsigned i = 0; i < This->size; i++)
+            pthread_mutex_destroy(&This->queues[i].lock);
+    free (This->queues);
+    This->queues = NULL;
+    This->size = 0;
+}
+
+bool pool_t_OK (const pool_t* This)
+{
+    assert (This);
+    return This->queues && This->size;
+}
+
+void pool_t_dump_ (const pool_t* This, const char name[])
+{
+    assert (This);
+    DUMP_INDENT += INDENT_VALUE;
+    printf ("%s = " ANSI_COLOR_BLUE "pool_t" ANSI_COLOR_RESET " (", name);
+    if (pool_t_OK(This))
+        printf (ANSI_COLOR_GREEN "ok" ANSI_COLOR_RESET ")\n");
+    else
+        printf (ANSI_COLOR_RED "ERROR" ANSI_COLOR_RESET ")\n");
+    printf ("%*ssize = %u\n", DUMP_INDENT, "", This->size);
+    for (unsigned i = 0; This->queues && i < This->size; i++)
+        printf ("%*s[%u] %lu..%lu, stolen %lu\n", DUMP_INDENT, "", i,
+                This->queues[i].begin, This->queues[i].end, This->queues[i].stolen);
+    DUMP_INDENT -= INDENT_VALUE;
+}
+
+// Takes the job from the front of the own queue
+bool pool_t_take (pool_t* This, unsigned worker, size_t* job)
+{
+    pool_t_queue* queue = This->queues + worker;
+    pthread_mutex_lock(&queue->lock);
+    bool is_taken = queue->begin < queue->end;
+    if (is_taken)
+        *job = queue->begin++;
+    pthread_mutex_unlock(&queue->lock);
+    return is_taken;
+}
+
+// Takes the job from the back of the queue of the other worker
+bool pool_t_steal (pool_t* This, unsigned worker, size_t* job)
+{
+    for (unsigned i = 1; i < This->size; i++){
+        pool_t_queue* victim = This->queues + (worker + i) % This->size;
+        pthread_mutex_lock(&victim->lock);
+        bool is_taken = victim->begin < victim->end;
+        if (is_taken)
+            *job = --victim->end;
+        pthread_mutex_unlock(&victim->lock);
+        if (is_taken){
+            This->queues[worker].stolen++;
+            return true;
+        }
+    }
+    return false;
+}
+
+typedef struct pool_t_worker pool_t_worker;
+struct pool_t_worker
+{
+    pool_t* pool;
+    unsigned index;
+    pthread_t thread;
+};
+
+void* pool_t_work (void* argument)
+{
+    pool_t_worker* worker = (pool_t_worker*)argument;
+    pool_t* This = worker->pool;
+    size_t job = 0;
+    while (pool_t_take(This, worker->index, &job) || pool_t_steal(This, worker->index, &job))
+        This->job(This->context, job, worker->index);
+    return NULL;
+}
+
+bool pool_t_run (pool_t* This, size_t njobs, pool_t_job job, void* context)
+{
+    ASSERT_OK(pool_t, This);
+    assert (job);
+    This->job = job;
+    This->context = context;
+    for (unsigned i = 0; i < This->size; i++){
+        This->queues[i].begin = njobs * i / This->size;
+        This->queues[i].end = njobs * (i + 1) / This->size;
+        This->queues[i].stolen = 0;
+    }
+    pool_t_worker* workers = (pool_t_worker*)calloc(This->size, sizeof(pool_t_worker));
+    if (!workers){
+        perror("pool_t_run: (can't allocate workers)");
+        return false;
+    }
+    bool is_ok = true;
+    unsigned started = 1;
+    for (; started < This->size; started++){
+        workers[started].pool = This;
+        workers[started].index = started;
+        if (pthread_create(&workers[started].thread, NULL, pool_t_work, workers + started)){
+            perror("pool_t_run: (can't create thread)");
+            is_ok = false;
+            break;
+        }
+    }
+    // The calling thread is the first worker, it steals the jobs of the threads that failed to start
+    workers[0].pool = This;
+    workers[0].index = 0;
+    pool_t_work(workers);
+    for (unsigned i = 1; i < started; i++)
+        pthread_join(workers[i].thread, NULL);
+    free (workers);
+    return is_ok;
+}
+
+size_t pool_t_stolen (const pool_t* This)
+{
+    size_t stolen = 0;
+    for (unsigned i = 0; i < This->size; i++)
+        stolen += This->queues[i].stolen;
+    return stolen;
+}
+
+#endif // POOL_H_INCLUDED
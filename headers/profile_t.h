@@ -0,0 +1,381 @@
+#include "mylib.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "cpu_t.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#ifndef PROFILE_H_INCLUDED
+#define PROFILE_H_INCLUDED
+
+/// Number of the hottest addresses and branches in the report
+#define PROFILE_REPORT_SIZE 10
+/// More comfortable dump
+#define profile_t_dump(This) profile_t_dump_(This, #This)
+
+/// Counters of a single instruction code
+typedef struct profile_t_opcode profile_t_opcode;
+struct profile_t_opcode
+{
+    uint64_t count;/**< Number of the executed instructions */
+    uint64_t time;/**< Time spent in their handlers, in the ticks of profile_t_clock */
+};
+
+/**
+@brief Execution profile of the decoded program.
+
+Collected by profile_t_run, a separate dispatch engine, so the other engines
+pay nothing for it. The superinstructions are counted as they are, the instructions
+fused into them are not executed and get no hits.
+*/
+typedef struct profile_t profile_t;
+struct profile_t
+{
+    profile_t_opcode opcodes[256];/**< Counters of every code, CPU_T_FUSED_BASE and above for the superinstructions */
+    uint64_t* hits;/**< Number of the executions of every decoded instruction */
+    uint64_t* taken;/**< Number of the executions that haven't fallen through to the next instruction */
+    unsigned size;/**< Number of the instructions in the decoded program */
+    uint64_t total;/**< Number of the executed instructions */
+    uint64_t time;/**< Time of the whole run in the ticks */
+};
+
+/**
+*@brief Profile constructor.
+*
+*@param This Pointer to the profile to be constructed.
+*@param cpu The cpu_t with the decoded program to profile.
+*@return true if success, false otherwise.
+*/
+bool profile_t_construct (profile_t* This, const cpu_t* cpu);
+
+/**
+*@brief Destructs the profile.
+*/
+void profile_t_destruct (profile_t* This);
+
+/**
+*@brief Validates the profile.
+*/
+bool profile_t_OK (const profile_t* This);
+
+/**
+*@brief Prints profile's dump.
+*/
+void profile_t_dump_ (const profile_t* This, const char name[]);
+
+/**
+*@brief Executes the decoded program as cpu_t_run does, counting every instruction.
+*
+*The handlers are timed with rdtsc where it is available (clock_gettime otherwise), so the time
+*includes a few ticks of the clock itself.
+*@param This The profile of the program loaded to cpu.
+*@param cpu Pointer to the cpu_t to perform operation on.
+*@return true if no error has occured, false otherwise.
+*/
+bool profile_t_run (profile_t* This, cpu_t* cpu);
+
+/**
+*@brief Prints the counters of the codes, the hottest addresses, the branches and the loops
+*worth compiling to native code.
+*/
+void profile_t_report (const profile_t* This, const cpu_t* cpu, FILE* f);
+
+/**
+*@brief Writes the profile as JSON.
+*@return true if success, false otherwise.
+*/
+bool profile_t_write_json (const profile_t* This, const cpu_t* cpu, FILE* f);
+
+/**
+*@brief Writes the profile as CSV: a row for every executed code and every executed address.
+*@return true if success, false otherwise.
+*/
+bool profile_t_write_csv (const profile_t* This, const cpu_t* cpu, FILE* f);
+
+/**
+*@brief Writes the profile to the file, as CSV if its name ends with ".csv" and as JSON otherwise.
+*@return true if success, false otherwise.
+*/
+bool profile_t_save (const profile_t* This, const cpu_t* cpu, const char filename[]);
+
+/// Name of the time unit of profile_t_clock
+#if defined(__x86_64__) || defined(__i386__)
+#define PROFILE_CLOCK "cycles"
+#else
+#define PROFILE_CLOCK "ns"
+#endif
+
+/// Current time: the time stamp counter of the processor or the monotonic clock
+static inline uint64_t profile_t_clock ()
+{
+    #if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+    #else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec*1000000000u + now.tv_nsec;
+    #endif
+}
+
+bool profile_t_construct (profile_t* This, const cpu_t* cpu)
+{
+    assert (This);
+    assert (cpu);
+    memset(This, 0, sizeof(profile_t));
+    This->size = cpu->code_size;
+    // The records of the end of the program and the bad address are counted too
+    This->hits = (uint64_t*)calloc(This->size + 2, sizeof(uint64_t));
+    This->taken = (uint64_t*)calloc(This->size + 2, sizeof(uint64_t));
+    if (!This->hits || !This->taken){
+        perror("profile_t_construct: (can't allocate counters)");
+        profile_t_destruct(This);
+        return false;
+    }
+    return true;
+}
+
+void profile_t_destruct (profile_t* This)
+{
+    assert (This);
+    free (This->hits);
+    free (This->taken);
+    This->hits = NULL;
+    This->taken = NULL;
+    This->size = 0;
+}
+
+bool profile_t_OK (const profile_t* This)
+{
+    assert (This);
+    return This->hits && This->taken;
+}
+
+void profile_t_dump_ (const profile_t* This, const char name[])
+{
+    assert (This);
+    DUMP_INDENT += INDENT_VALUE;
+    printf ("%s = " ANSI_COLOR_BLUE "profile_t" ANSI_COLOR_RESET " (", name);
+    if (profile_t_OK(This))
+        printf (ANSI_COLOR_GREEN "ok" ANSI_COLOR_RESET ")\n");
+    else
+        printf (ANSI_COLOR_RED "ERROR" ANSI_COLOR_RESET ")\n");
+    printf ("%*ssize = %u\n", DUMP_INDENT, "", This->size);
+    printf ("%*stotal = %llu\n", DUMP_INDENT, "", (unsigned long long)This->total);
+    printf ("%*stime = %llu " PROFILE_CLOCK "\n", DUMP_INDENT, "", (unsigned long long)This->time);
+    DUMP_INDENT -= INDENT_VALUE;
+}
+
+bool profile_t_run (profile_t* This, cpu_t* cpu)
+{
+    ASSERT_OK(profile_t, This);
+    if (!cpu->state){
+        printf (ANSI_COLOR_RED "*BEEP-BEEP*"ANSI_COLOR_RESET"[cpu is corrupted]\n");
+        return false;
+    }
+    if (This->size != cpu->code_size){
+        printf ("profile_t_run: Error! The profile is made for another program\n");
+        return false;
+    }
+    uint64_t start = profile_t_clock();
+    const insn_t* insn = cpu->code + cpu->pc;
+    bool is_ok = true;
+    while (insn->code)
+    {
+        unsigned index = cpu->pc;
+        // The failed handler may destruct cpu together with the decoded program
+        unsigned char code = insn->code;
+        // A superinstruction falls through past all of its parts
+        unsigned length = (code >= CPU_T_FUSED_BASE)? CPU_T_FUSIONS[code - CPU_T_FUSED_BASE].length : 1;
+        if (cpu->is_debug) printf("\n[%u] %s\n", insn->address, CPU_T_COMMANDS[code].name);
+        cpu->position = insn->next;
+        cpu->pc++;
+        uint64_t begin = profile_t_clock();
+        is_ok = insn->handler (cpu, insn);
+        uint64_t end = profile_t_clock();
+        This->opcodes[code].count++;
+        This->opcodes[code].time += end - begin;
+        This->hits[index]++;
+        This->total++;
+        if (!is_ok || (cpu->is_debug && !cpu_t_step_end (cpu))){
+            is_ok = false;
+            break;
+        }
+        if (cpu->pc != index + length)
+            This->taken[index]++;
+        insn = cpu->code + cpu->pc;
+    }
+    This->time += profile_t_clock() - start;
+    return is_ok;
+}
+
+// Gets the jump the instruction ends with (superinstructions end with their last part)
+const insn_t* profile_t_jump (const insn_t* insn)
+{
+    unsigned char code = insn->code;
+    if (code >= CPU_T_FUSED_BASE){
+        const cpu_t_fusion* fusion = CPU_T_FUSIONS + (code - CPU_T_FUSED_BASE);
+        code = fusion->codes[fusion->length - 1];
+        insn += fusion->length - 1;
+    }
+    return (code >= cmd_ja && code <= cmd_jmp)? insn : NULL;
+}
+
+// Checks if the instruction ends with a conditional jump
+bool profile_t_is_branch (const insn_t* insn)
+{
+    const insn_t* jump = profile_t_jump (insn);
+    return jump && jump->code != cmd_jmp;
+}
+
+// Name of the code for the output
+const char* profile_t_name (unsigned char code)
+{
+    return (CPU_T_COMMANDS[code].name)? CPU_T_COMMANDS[code].name : "unknown";
+}
+
+// Sorts the indices of the instructions by the counter, the largest first
+void profile_t_sort (unsigned indices[], unsigned size, const uint64_t counters[])
+{
+    for (unsigned i = 1; i < size; i++){
+        unsigned index = indices[i];
+        unsigned j = i;
+        for (; j > 0 && counters[indices[j - 1]] < counters[index]; j--)
+            indices[j] = indices[j - 1];
+        indices[j] = index;
+    }
+}
+
+void profile_t_report (const profile_t* This, const cpu_t* cpu, FILE* f)
+{
+    ASSERT_OK(profile_t, This);
+    fprintf (f, "#Profile: %llu instructions, %llu " PROFILE_CLOCK "\n",
+             (unsigned long long)This->total, (unsigned long long)This->time);
+    uint64_t handlers = 0;
+    for (unsigned code = 0; code < 256; code++)
+        handlers += This->opcodes[code].time;
+    fprintf (f, "#%-40s %14s %16s %7s %10s\n", "code", "count", PROFILE_CLOCK, "time", "per insn");
+    unsigned codes[256];
+    uint64_t times[256];
+    unsigned ncodes = 0;
+    for (unsigned code = 0; code < 256; code++){
+        times[code] = This->opcodes[code].time;
+        if (This->opcodes[code].count)
+            codes[ncodes++] = code;
+    }
+    profile_t_sort (codes, ncodes, times);
+    for (unsigned i = 0; i < ncodes; i++){
+        const profile_t_opcode* opcode = This->opcodes + codes[i];
+        fprintf (f, " %-40s %14llu %16llu %6.2lf%% %10.1lf\n", profile_t_name (codes[i]),
+                 (unsigned long long)opcode->count, (unsigned long long)opcode->time,
+                 (handlers)? 100.0*opcode->time/handlers : 0.0, (double)opcode->time/opcode->count);
+    }
+
+    unsigned* indices = (unsigned*)malloc ((This->size + 1) * sizeof(unsigned));
+    if (!indices){
+        perror("profile_t_report: (can't allocate indices)");
+        return;
+    }
+    unsigned nhot = 0;
+    for (unsigned i = 0; i < This->size; i++)
+        if (This->hits[i])
+            indices[nhot++] = i;
+    profile_t_sort (indices, nhot, This->hits);
+    fprintf (f, "#Hottest addresses:\n#%-10s %-40s %14s\n", "address", "code", "hits");
+    for (unsigned i = 0; i < nhot && i < PROFILE_REPORT_SIZE; i++)
+        fprintf (f, " %-10u %-40s %14llu\n", cpu->code[indices[i]].address,
+                 profile_t_name (cpu->code[indices[i]].code), (unsigned long long)This->hits[indices[i]]);
+
+    unsigned nbranches = 0;
+    for (unsigned i = 0; i < nhot; i++)
+        if (profile_t_is_branch (cpu->code + indices[i]))
+            indices[nbranches++] = indices[i];
+    fprintf (f, "#Branches:\n#%-10s %-40s %14s %14s %14s\n", "address", "code", "hits", "taken", "not taken");
+    for (unsigned i = 0; i < nbranches && i < PROFILE_REPORT_SIZE; i++){
+        unsigned index = indices[i];
+        fprintf (f, " %-10u %-40s %14llu %14llu %14llu\n", cpu->code[index].address, profile_t_name (cpu->code[index].code),
+                 (unsigned long long)This->hits[index], (unsigned long long)This->taken[index],
+                 (unsigned long long)(This->hits[index] - This->taken[index]));
+    }
+
+    // The loops are closed by the backward jumps, their iterations are worth compiling (see cpu_t_run_tiered)
+    unsigned nloops = 0;
+    for (unsigned i = 0; i < This->size; i++){
+        const insn_t* jump = profile_t_jump (cpu->code + i);
+        if (This->taken[i] && jump && jump->target <= i)
+            indices[nloops++] = i;
+    }
+    profile_t_sort (indices, nloops, This->taken);
+    fprintf (f, "#Hot loops (candidates for --jit):\n#%-10s %-10s %14s\n", "from", "to", "iterations");
+    for (unsigned i = 0; i < nloops && i < PROFILE_REPORT_SIZE; i++){
+        const insn_t* insn = cpu->code + indices[i];
+        fprintf (f, " %-10u %-10u %14llu\n", insn->address, cpu->code[profile_t_jump (insn)->target].address,
+                 (unsigned long long)This->taken[indices[i]]);
+    }
+    free (indices);
+}
+
+bool profile_t_write_json (const profile_t* This, const cpu_t* cpu, FILE* f)
+{
+    ASSERT_OK(profile_t, This);
+    fprintf (f, "{\n  \"clock\": \"%s\",\n  \"instructions\": %llu,\n  \"time\": %llu,\n  \"opcodes\": [",
+             PROFILE_CLOCK, (unsigned long long)This->total, (unsigned long long)This->time);
+    const char* separator = "\n";
+    for (unsigned code = 0; code < 256; code++){
+        if (!This->opcodes[code].count)
+            continue;
+        fprintf (f, "%s    {\"code\": %u, \"name\": \"%s\", \"count\": %llu, \"time\": %llu}", separator, code,
+                 profile_t_name (code), (unsigned long long)This->opcodes[code].count,
+                 (unsigned long long)This->opcodes[code].time);
+        separator = ",\n";
+    }
+    fprintf (f, "\n  ],\n  \"addresses\": [");
+    separator = "\n";
+    for (unsigned i = 0; i < This->size; i++){
+        if (!This->hits[i])
+            continue;
+        const insn_t* insn = cpu->code + i;
+        fprintf (f, "%s    {\"address\": %u, \"name\": \"%s\", \"hits\": %llu, \"taken\": %llu, \"branch\": %s}", separator,
+                 insn->address, profile_t_name (insn->code), (unsigned long long)This->hits[i],
+                 (unsigned long long)This->taken[i], (profile_t_is_branch (insn))? "true" : "false");
+        separator = ",\n";
+    }
+    fprintf (f, "\n  ]\n}\n");
+    return !ferror (f);
+}
+
+bool profile_t_write_csv (const profile_t* This, const cpu_t* cpu, FILE* f)
+{
+    ASSERT_OK(profile_t, This);
+    fprintf (f, "kind,code_or_address,name,count,time,taken\n");
+    for (unsigned code = 0; code < 256; code++)
+        if (This->opcodes[code].count)
+            fprintf (f, "opcode,%u,%s,%llu,%llu,\n", code, profile_t_name (code),
+                     (unsigned long long)This->opcodes[code].count, (unsigned long long)This->opcodes[code].time);
+    for (unsigned i = 0; i < This->size; i++)
+        if (This->hits[i])
+            fprintf (f, "address,%u,%s,%llu,,%llu\n", cpu->code[i].address, profile_t_name (cpu->code[i].code),
+                     (unsigned long long)This->hits[i], (unsigned long long)This->taken[i]);
+    return !ferror (f);
+}
+
+bool profile_t_save (const profile_t* This, const cpu_t* cpu, const char filename[])
+{
+    FILE* f = fopen(filename, "w");
+    if (!f){
+        perror("profile_t_save: (can't open file)");
+        return false;
+    }
+    size_t length = strlen(filename);
+    bool is_csv = length >= 4 && !strcmp(filename + length - 4, ".csv");
+    bool is_ok = (is_csv)? profile_t_write_csv(This, cpu, f) : profile_t_write_json(This, cpu, f);
+    is_ok = !fclose(f) && is_ok;
+    if (!is_ok)
+        perror("profile_t_save: (can't write file)");
+    return is_ok;
+}
+
+#endif // PROFILE_H_INCLUDED
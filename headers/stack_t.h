@@ -249,4 +249,86 @@ bool stack_t_pop (stack_t* This, void* dest, size_t nbytes)
     }
 }
 
+//vvvvvvvvvvvvvvvvvvvvvvvv
+// WIDTH-SPECIALIZED ACCESS
+//vvvvvvvvvvvvvvvvvvvvvvvv
+// The capacity is checked once per operation with stack_t_can_push/stack_t_can_pop,
+// after that stack_t_put_<name>/stack_t_take_<name> move the values with no checks at all.
+// stack_t_push_<name>/stack_t_pop_<name> do both. Unlike stack_t_push/stack_t_pop they only
+// invalidate the stack on fail and leave its destruction to the owner of the data.
+
+/**
+*@brief Checks if nbytes more bytes fit into the stack.
+*/
+static inline bool stack_t_can_push (const stack_t* This, size_t nbytes)
+{
+    return This->size + nbytes <= This->max_size;
+}
+
+/**
+*@brief Checks if the stack holds at least nbytes bytes.
+*/
+static inline bool stack_t_can_pop (const stack_t* This, size_t nbytes)
+{
+    return This->size >= nbytes;
+}
+
+#define STACK_T_ACCESS(_name, _nbytes) \
+static inline void stack_t_put_ ## _name (stack_t* This, const void* data)\
+{\
+    This->top -= _nbytes;\
+    This->size += _nbytes;\
+    memcpy (This->top + 1, data, _nbytes);\
+}\
+\
+static inline void stack_t_take_ ## _name (stack_t* This, void* dest)\
+{\
+    memcpy (dest, This->top + 1, _nbytes);\
+    This->top += _nbytes;\
+    This->size -= _nbytes;\
+}\
+\
+static inline bool stack_t_push_ ## _name (stack_t* This, const void* data)\
+{\
+    if (!stack_t_can_push (This, _nbytes)){\
+        This->is_valid = false;\
+        return false;\
+    }\
+    stack_t_put_ ## _name (This, data);\
+    return true;\
+}\
+\
+static inline bool stack_t_pop_ ## _name (stack_t* This, void* dest)\
+{\
+    if (!stack_t_can_pop (This, _nbytes)){\
+        This->is_valid = false;\
+        return false;\
+    }\
+    stack_t_take_ ## _name (This, dest);\
+    return true;\
+}
+
+#define VAR(_name, _nbytes) STACK_T_ACCESS(_name, _nbytes)
+#include "var_sizes.h"
+#undef VAR
+
+// Typed values are passed by value: stack_t_put_int (stack, 5), x = stack_t_take_float (stack)
+#define STACK_T_TYPED(_type, _name) \
+static inline void stack_t_put_ ## _type (stack_t* This, _type value)\
+{\
+    stack_t_put_ ## _name (This, &value);\
+}\
+\
+static inline _type stack_t_take_ ## _type (stack_t* This)\
+{\
+    _type value;\
+    stack_t_take_ ## _name (This, &value);\
+    return value;\
+}
+
+STACK_T_TYPED(int, dword)
+STACK_T_TYPED(unsigned, dword)
+STACK_T_TYPED(float, dword)
+STACK_T_TYPED(char, byte)
+
 #endif // STACK_H_INCLUDED
@@ -0,0 +1,329 @@
+#include "mylib.h"
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#ifndef STREAM_H_INCLUDED
+#define STREAM_H_INCLUDED
+
+/// Default size of the stream buffer
+#define STREAM_SIZE (64*1024)
+/// Longest number that can be read
+#define STREAM_NUMBER_SIZE 64
+/// More comfortable dump
+#define stream_t_dump(This) stream_t_dump_(This, #This)
+
+// Indent of the dump is declared in mylib
+extern int DUMP_INDENT;
+
+/**
+@brief Buffered stream of the file descriptor
+
+Reads and writes are collected in the buffer, so the file is touched with a few read(2) and write(2) calls.
+The stream works in one direction only: either reading or writing.
+*/
+typedef struct stream_t stream_t;
+struct stream_t
+{
+    int fd;/**< File descriptor of the stream. */
+    char* data;/**< Buffer. */
+    size_t size;/**< Number of bytes in the buffer. */
+    size_t max_size;/**< Size of the buffer. */
+    size_t position;/**< Next byte to read (reading only). */
+    bool is_eof;/**< true if the end of the file is reached (reading only). */
+};
+
+/**
+*@brief Stream constructor.
+*
+*@param This Pointer to the stream to be constructed.
+*@param fd File descriptor, it isn't closed by the stream.
+*@param nbytes Size of the buffer.
+*@return true if success, false otherwise.
+*/
+bool stream_t_construct (stream_t* This, int fd, size_t nbytes);
+
+/**
+*@brief Destructs the stream. Written data is lost, so flush it first.
+*/
+void stream_t_destruct (stream_t* This);
+
+/**
+*@brief Validates the stream.
+*/
+bool stream_t_OK (const stream_t* This);
+
+/**
+*@brief Prints stream's dump.
+*/
+void stream_t_dump_ (const stream_t* This, const char name[]);
+
+/**
+*@brief Writes the buffer to the file.
+*@return true if success, false otherwise.
+*/
+bool stream_t_flush (stream_t* This);
+
+/**
+*@brief Appends the bytes to the stream, flushing the buffer when it is full.
+*@return true if success, false otherwise.
+*/
+bool stream_t_write (stream_t* This, const void* data, size_t nbytes);
+
+/**
+*@brief Reads more bytes from the file, unread bytes are kept.
+*@return false if nothing was read.
+*/
+bool stream_t_fill (stream_t* This);
+
+/**
+*@brief Takes exactly nbytes from the stream.
+*@return false if the stream has ended earlier.
+*/
+bool stream_t_read (stream_t* This, void* data, size_t nbytes);
+
+/**
+*@brief Skips the white space.
+*@return false if the stream has ended.
+*/
+bool stream_t_skip_space (stream_t* This);
+
+/**
+*@brief Reads the word that ends with the white space or the end of the stream.
+*@param word Where to save the word, STREAM_NUMBER_SIZE bytes.
+*@return false if there is no word or it is too long.
+*/
+bool stream_t_read_word (stream_t* This, char word[]);
+
+/**
+*@brief Reads the value as scanf does with "%d", "%f" and "%c".
+*@return false if there is no value.
+*/
+bool stream_t_scan_int (stream_t* This, int* value);
+bool stream_t_scan_float (stream_t* This, float* value);
+bool stream_t_scan_char (stream_t* This, char* value);
+
+/**
+*@brief Writes the value and the new line as printf does with "%d", "%g" and "%c".
+*@return true if success, false otherwise.
+*/
+bool stream_t_print_int (stream_t* This, int value);
+bool stream_t_print_float (stream_t* This, float value);
+bool stream_t_print_char (stream_t* This, char value);
+
+bool stream_t_construct (stream_t* This, int fd, size_t nbytes)
+{
+    assert (This);
+    This->fd = fd;
+    This->size = 0;
+    This->position = 0;
+    This->is_eof = false;
+    This->max_size = nbytes;
+    This->data = (char*)malloc(nbytes);
+    if (!This->data){
+        perror("stream_t_construct: (can't allocate buffer)");
+        This->max_size = 0;
+        return false;
+    }
+    return true;
+}
+
+void stream_t_destruct (stream_t* This)
+{
+    assert (This);
+    free (This->data);
+    This->data = NULL;
+    This->size = 0;
+    This->max_size = 0;
+    This->position = 0;
+    This->fd = -1;
+}
+
+bool stream_t_OK (const stream_t* This)
+{
+    assert (This);
+    return This->data && This->fd >= 0 && This->size <= This->max_size && This->position <= This->size;
+}
+
+void stream_t_dump_ (const stream_t* This, const char name[])
+{
+    assert (This);
+    DUMP_INDENT += INDENT_VALUE;
+    printf ("%s = " ANSI_COLOR_BLUE "stream_t" ANSI_COLOR_RESET " (", name);
+    if (stream_t_OK(This))
+        printf (ANSI_COLOR_GREEN "ok" ANSI_COLOR_RESET ")\n");
+    else
+        printf (ANSI_COLOR_RED "ERROR" ANSI_COLOR_RESET ")\n");
+    printf ("%*sfd = %d\n", DUMP_INDENT, "", This->fd);
+    printf ("%*sdata = %p\n", DUMP_INDENT, "", This->data);
+    printf ("%*ssize = %lu\n", DUMP_INDENT, "", This->size);
+    printf ("%*smax_size = %lu\n", DUMP_INDENT, "", This->max_size);
+    printf ("%*sposition = %lu\n", DUMP_INDENT, "", This->position);
+    printf ("%*sis_eof = %d\n", DUMP_INDENT, "", This->is_eof);
+    DUMP_INDENT -= INDENT_VALUE;
+}
+
+bool stream_t_flush (stream_t* This)
+{
+    ASSERT_OK(stream_t, This);
+    size_t written = 0;
+    while (written < This->size){
+        ssize_t result = write(This->fd, This->data + written, This->size - written);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0){
+            perror("stream_t_flush: (can't write)");
+            This->size = 0;
+            return false;
+        }
+        written += result;
+    }
+    This->size = 0;
+    return true;
+}
+
+bool stream_t_write (stream_t* This, const void* data, size_t nbytes)
+{
+    ASSERT_OK(stream_t, This);
+    const char* bytes = (const char*)data;
+    while (This->size + nbytes > This->max_size){
+        size_t part = This->max_size - This->size;
+        memcpy(This->data + This->size, bytes, part);
+        This->size += part;
+        bytes += part;
+        nbytes -= part;
+        if (!stream_t_flush(This))
+            return false;
+    }
+    memcpy(This->data + This->size, bytes, nbytes);
+    This->size += nbytes;
+    return true;
+}
+
+bool stream_t_fill (stream_t* This)
+{
+    ASSERT_OK(stream_t, This);
+    if (This->is_eof)
+        return false;
+    // Moving the unread bytes to the beginning
+    memmove(This->data, This->data + This->position, This->size - This->position);
+    This->size -= This->position;
+    This->position = 0;
+    if (This->size == This->max_size)
+        return false;
+    ssize_t result = 0;
+    do
+        result = read(This->fd, This->data + This->size, This->max_size - This->size);
+    while (result < 0 && errno == EINTR);
+    if (result <= 0){
+        if (result < 0)
+            perror("stream_t_fill: (can't read)");
+        This->is_eof = true;
+        return false;
+    }
+    This->size += result;
+    return true;
+}
+
+bool stream_t_read (stream_t* This, void* data, size_t nbytes)
+{
+    ASSERT_OK(stream_t, This);
+    while (This->size - This->position < nbytes)
+        if (!stream_t_fill(This))
+            return false;
+    memcpy(data, This->data + This->position, nbytes);
+    This->position += nbytes;
+    return true;
+}
+
+bool stream_t_skip_space (stream_t* This)
+{
+    ASSERT_OK(stream_t, This);
+    while (true){
+        while (This->position < This->size && isspace((unsigned char)This->data[This->position]))
+            This->position++;
+        if (This->position < This->size)
+            return true;
+        if (!stream_t_fill(This))
+            return false;
+    }
+}
+
+bool stream_t_read_word (stream_t* This, char word[])
+{
+    if (!stream_t_skip_space(This))
+        return false;
+    size_t length = 0;
+    while (true){
+        if (This->position == This->size && !stream_t_fill(This))
+            break;
+        char symbol = This->data[This->position];
+        if (isspace((unsigned char)symbol))
+            break;
+        if (length + 1 == STREAM_NUMBER_SIZE)
+            return false;
+        word[length++] = symbol;
+        This->position++;
+    }
+    word[length] = '\0';
+    return length;
+}
+
+bool stream_t_scan_int (stream_t* This, int* value)
+{
+    char word[STREAM_NUMBER_SIZE];
+    if (!stream_t_read_word(This, word))
+        return false;
+    char* end = NULL;
+    long result = strtol(word, &end, 10);
+    *value = (int)result;
+    return end != word;
+}
+
+bool stream_t_scan_float (stream_t* This, float* value)
+{
+    char word[STREAM_NUMBER_SIZE];
+    if (!stream_t_read_word(This, word))
+        return false;
+    char* end = NULL;
+    *value = strtof(word, &end);
+    return end != word;
+}
+
+bool stream_t_scan_char (stream_t* This, char* value)
+{
+    return stream_t_read(This, value, sizeof(char));
+}
+
+bool stream_t_print_int (stream_t* This, int value)
+{
+    char text[STREAM_NUMBER_SIZE];
+    char* end = text + sizeof(text);
+    unsigned magnitude = (value < 0)? 0u - (unsigned)value : (unsigned)value;
+    *--end = '\n';
+    do{
+        *--end = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude);
+    if (value < 0)
+        *--end = '-';
+    return stream_t_write(This, end, text + sizeof(text) - end);
+}
+
+bool stream_t_print_float (stream_t* This, float value)
+{
+    char text[STREAM_NUMBER_SIZE];
+    int length = snprintf(text, sizeof(text), "%g\n", value);
+    return stream_t_write(This, text, length);
+}
+
+bool stream_t_print_char (stream_t* This, char value)
+{
+    char text[] = {value, '\n'};
+    return stream_t_write(This, text, sizeof(text));
+}
+
+#endif // STREAM_H_INCLUDED
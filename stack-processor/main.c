@@ -12,27 +12,79 @@
 #include <limits.h>
 #include "stack_t.h"
 #include "cpu_t.h"
+#include "profile_t.h"
 #include <time.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 int main (int argc, char* argv[])
 {
     CHECK_DEFAULT_ARGS();
     char prog_name[NAME_MAX] = {};
     //bool is_debug = false;
-    switch (argc)
-    {
-    case 2:
-        strcpy (prog_name, argv[1]);
-        break;
-    /*case 3:
-        strcpy (prog_name, argv[1]);
-        if (!strcmp ("--debug", argv[2])){
-            is_debug = true;
-            break;
-        }//*/
-    default:
+    bool do_fuse = false;
+    bool do_cache = false;
+    bool do_jit = false;
+    bool is_checked = false;
+    bool do_profile = false;
+    const char* profile_name = NULL;
+    bool is_headless = false;
+    bool is_binary = false;
+    const char* input_name = NULL;
+    const char* output_name = NULL;
+    const char* save_name = NULL;
+    const char* restore_name = NULL;
+    unsigned save_address = 0;
+    unsigned memory_size = MEM_SIZE;
+    unsigned stack_size = STACK_SIZE;
+    if (argc < 2){
         WRITE_WRONG_USE();
     }
+    strcpy (prog_name, argv[1]);
+    for (int i = 2; i < argc; i++){
+        if (!strcmp ("--fuse", argv[i]))
+            do_fuse = true;
+        else if (!strcmp ("--cache", argv[i]))
+            do_cache = true;
+        else if (!strcmp ("--jit", argv[i]))
+            do_jit = true;
+        else if (!strcmp ("--checked", argv[i]))
+            is_checked = true;
+        else if (!strcmp ("--profile", argv[i]))
+            do_profile = true;
+        else if (!strcmp ("--profile-out", argv[i]) && i + 1 < argc){
+            do_profile = true;
+            profile_name = argv[++i];
+        }
+        else if (!strcmp ("--headless", argv[i]))
+            is_headless = true;
+        else if (!strcmp ("--binary", argv[i]))
+            is_headless = is_binary = true;
+        else if (!strcmp ("--input", argv[i]) && i + 1 < argc){
+            is_headless = true;
+            input_name = argv[++i];
+        }
+        else if (!strcmp ("--output", argv[i]) && i + 1 < argc){
+            is_headless = true;
+            output_name = argv[++i];
+        }
+        else if (!strcmp ("--memory", argv[i]) && i + 1 < argc && read_size (argv[i + 1], &memory_size))
+            i++;
+        else if (!strcmp ("--stack", argv[i]) && i + 1 < argc && read_size (argv[i + 1], &stack_size))
+            i++;
+        else if (!strcmp ("--save-at", argv[i]) && i + 2 < argc && read_size (argv[i + 1], &save_address)){
+            save_name = argv[i + 2];
+            i += 2;
+        }
+        else if (!strcmp ("--restore", argv[i]) && i + 1 < argc)
+            restore_name = argv[++i];
+        /*else if (!strcmp ("--debug", argv[i]))
+            is_debug = true;//*/
+        else{
+            WRITE_WRONG_USE();
+        }
+    }
     // Testing staff
     /*
     stack_t stack;
@@ -48,23 +100,85 @@ int main (int argc, char* argv[])
     stack_t_destruct(&stack);
     */
 
+    int in_fd = STDIN_FILENO;
+    int out_fd = STDOUT_FILENO;
+    if (is_headless){
+        in_fd = (input_name)? open (input_name, O_RDONLY) : STDIN_FILENO;
+        out_fd = (output_name)? open (output_name, O_WRONLY | O_CREAT | O_TRUNC, 0644) : dup (STDOUT_FILENO);
+        if (in_fd < 0 || out_fd < 0){
+            perror ("Can't open the input or the output");
+            return WRONG_USE;
+        }
+        // Only the output of the program goes to the standard output, the messages go to stderr
+        fflush (stdout);
+        dup2 (STDERR_FILENO, STDOUT_FILENO);
+    }
+
     buffer_t program;
-    buffer_t_construct_filename (&program, prog_name);
+    if (!buffer_t_construct_map (&program, prog_name))
+        return WRONG_RESULT;
     cpu_t cpu;
-    cpu_t_construct(&cpu);
+    if (!cpu_t_construct_size(&cpu, memory_size, stack_size)){
+        buffer_t_destruct (&program);
+        return WRONG_RESULT;
+    }
     if (!cpu_t_load_program(&cpu, &program)){
         COMMENT("Loading problem!");
         goto ERROR;
     }
+    // The program is verified on load, the second time tells why it isn't
+    if (is_checked)
+        cpu.is_verified = false;
+    else if (!cpu.is_verified)
+        cpu_t_verify(&cpu, true);
+    if (is_headless && !cpu_t_set_io(&cpu, in_fd, out_fd, is_binary))
+        goto ERROR;
+    if (do_fuse)
+        cpu_t_fuse(&cpu, true);
+    if (restore_name){
+        cpu_t_snapshot snapshot;
+        if (!cpu_t_snapshot_construct_filename(&snapshot, restore_name))
+            goto ERROR;
+        bool is_restored = cpu_t_restore(&cpu, &snapshot);
+        cpu_t_snapshot_destruct(&snapshot);
+        if (!is_restored)
+            goto ERROR;
+    }
+    if (save_name){
+        cpu_t_snapshot snapshot;
+        if (!cpu_t_run_to(&cpu, save_address)){
+            COMMENT ("The program hasn't reached the address of the snapshot!");
+            goto ERROR;
+        }
+        if (!cpu_t_snapshot_construct(&snapshot, &cpu))
+            goto ERROR;
+        bool is_saved = cpu_t_snapshot_save(&snapshot, save_name);
+        cpu_t_snapshot_destruct(&snapshot);
+        if (!is_saved)
+            goto ERROR;
+        cpu_t_flush_io(&cpu);
+        printf ("Snapshot is saved to %s\n", save_name);
+        return NO_ERROR;
+    }
+    profile_t profile;
+    if (do_profile && !profile_t_construct(&profile, &cpu))
+        goto ERROR;
     clock_t begin, end;
     begin = clock();
-    if (!cpu_t_run(&cpu)){
+    if (!(do_profile? profile_t_run(&profile, &cpu) : do_jit? cpu_t_run_tiered(&cpu) : do_cache? cpu_t_run_cached(&cpu) : cpu_t_run(&cpu))){
         COMMENT ("Runtime error occured!");
         goto ERROR;
     }
     end = clock();
     double time_spent = (double)(end - begin) / CLOCKS_PER_SEC;
     printf ("Emulated: %lfms\n", time_spent*1000);
+    cpu_t_flush_io(&cpu);
+    if (do_profile){
+        profile_t_report(&profile, &cpu, stdout);
+        if (profile_name && !profile_t_save(&profile, &cpu, profile_name))
+            goto ERROR;
+        profile_t_destruct(&profile);
+    }
 
     return NO_ERROR;
 ERROR:
@@ -16,6 +16,7 @@
 #include <inttypes.h>
 #include <sys/mman.h>
 #include <limits.h>
+#include <sys/stat.h>
 #include "mylib.h"
 #include "image_t.h"
 #include "buffer_t.h"
@@ -34,6 +35,10 @@ void* load_code_section (const void* data, size_t nbytes);
 // Just runs the code situated in the given area
 void run_code (void* address);
 void stack_dump (size_t nbytes);
+// Gets the directory of the translations cache and creates it if needed.
+// $STACK_PROCESSOR_CACHE is used first (empty value turns the cache off),
+// then $XDG_CACHE_HOME/stack-processor and $HOME/.cache/stack-processor.
+bool get_cache_dir (char dir[]);
 
 int main (int argc, char* argv[])
 {
@@ -50,19 +55,41 @@ int main (int argc, char* argv[])
     }//*/
     //run_code(load_code_section(0,0));
     buffer_t binary;
-    buffer_t_construct_filename(&binary, prog_name);
+    if (!buffer_t_construct_map(&binary, prog_name))
+        return WRONG_RESULT;
     image_t image;
 
     image_t_construct(&image, &binary);
-    image_t_translate(&image);
+    // $STACK_PROCESSOR_PEEPHOLE=0 translates every instruction on its own, to compare with the peephole
+    const char* peephole = getenv("STACK_PROCESSOR_PEEPHOLE");
+    image.is_peephole = !peephole || strcmp(peephole, "0");
+    // $STACK_PROCESSOR_OPTIMIZE=0 translates the IR as it is decoded, without its passes
+    const char* optimize = getenv("STACK_PROCESSOR_OPTIMIZE");
+    image.is_optimized = !optimize || strcmp(optimize, "0");
+    // $STACK_PROCESSOR_MEMORY is the size of the memory of the program, as --memory of the processor
+    const char* memory = getenv("STACK_PROCESSOR_MEMORY");
+    if (memory && !read_size(memory, &image.memory_size)){
+        printf ("Wrong size of the memory: %s\n", memory);
+        return WRONG_RESULT;
+    }
+    char cache_dir[PATH_MAX];
+    bool is_cached = get_cache_dir(cache_dir);
+    if (!is_cached || !image_t_load_cache(&image, cache_dir)){
+        if (!image_t_translate(&image))
+            return WRONG_RESULT;
+        if (is_cached)
+            image_t_save_cache(&image, cache_dir);
+    }
     //clock_t begin = clock();
     image_t_execute(&image);
     /*clock_t end = clock();
     double time_spent = (double)(end - begin) / CLOCKS_PER_SEC;
     printf ("Translated: %lfms\n", time_spent*1000); //*/
+    // The program has stopped with err, as the processor does it fails
+    bool is_interrupted = image.state == INTERRUPTED;
     image_t_destruct(&image);
     buffer_t_destruct(&binary);
-    return NO_ERROR;
+    return (is_interrupted)? WRONG_RESULT : NO_ERROR;
 }
 
 void* load_code_section (const void* data, size_t nbytes)
@@ -129,3 +156,36 @@ void stack_dump (size_t nbytes)
         printf (ANSI_COLOR_RESET"\n");
     }
 }
+
+// The cache directory is created with every missing parent
+bool get_cache_dir (char dir[])
+{
+    const char* cache = getenv("STACK_PROCESSOR_CACHE");
+    if (cache){
+        if (!*cache || strlen(cache) >= PATH_MAX)
+            return false;
+        strcpy(dir, cache);
+    }
+    else{
+        const char* home = getenv("XDG_CACHE_HOME");
+        const char* format = "%s/stack-processor";
+        if (!home || !*home){
+            home = getenv("HOME");
+            format = "%s/.cache/stack-processor";
+        }
+        if (!home || !*home)
+            return false;
+        int length = snprintf(dir, PATH_MAX, format, home);
+        if (length <= 0 || length >= PATH_MAX)
+            return false;
+    }
+    // Creating every directory of the path
+    for (char* slash = strchr(dir + 1, '/'); slash; slash = strchr(slash + 1, '/')){
+        *slash = '\0';
+        mkdir(dir, 0755);
+        *slash = '/';
+    }
+    if (mkdir(dir, 0755) && errno != EEXIST)
+        return false;
+    return true;
+}
@@ -0,0 +1,17 @@
+; The jcc over the jmp: the translator must pair them into the inverted jcc (je_jmp)
+;
+; INPUT:   a number
+; OUTPUT:  1 and 2 if it is 0, 2 otherwise
+.code
+    in
+    push 0
+    cmp
+    je ZERO
+    jmp END
+ZERO:
+    push 1
+    out
+END:
+    push 2
+    out
+    stop
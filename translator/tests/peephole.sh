@@ -0,0 +1,31 @@
+#!/bin/bash
+# Runs the programs of the peephole pass through the translator and checks the outputs
+# and that the pairs are translated together. The translator must be built with VERBOSE.
+#     ./peephole.sh [Assembler] [translator]
+assembler=$(realpath "${1:-./Assembler}")
+translator=$(realpath "${2:-./translator}")
+tests=$(dirname "$(realpath "$0")")
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+failed=0
+
+# check program input expected_output expected_pair
+check ()
+{
+    "$assembler" "$tests/$1.asm" "$dir/program.bin" > /dev/null || { echo "FAILED $1: can't assemble"; failed=1; return; }
+    local log=$(cd "$dir" && echo "$2" | STACK_PROCESSOR_CACHE= "$translator" 2>&1 | sed 's/\x1b\[[0-9;]*m//g')
+    local output=$(echo "$log" | grep -ao "OUT\[[a-z]*\]>.*" | sed 's/.*>//' | tr '\n' ' ')
+    if [ "$output" != "$3" ]; then
+        echo "FAILED $1 ($2): the output is '$output' instead of '$3'"
+        failed=1
+    elif ! echo "$log" | grep -q "^ *$4: [1-9]"; then
+        echo "FAILED $1 ($2): $4 is not translated"
+        failed=1
+    else
+        echo "ok $1 ($2)"
+    fi
+}
+
+check jcc_jmp 0 "1 2 " je_jmp
+check jcc_jmp 5 "2 " je_jmp
+exit $failed